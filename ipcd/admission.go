@@ -0,0 +1,36 @@
+package main
+
+// Admission control: bound the number of requests being
+// processed at once, refusing (rather than queueing) those
+// beyond the limit.  Under a storm of connections clients are
+// told quickly to proceed without optimization, instead of
+// everyone's connect() waiting on the daemon.
+
+import (
+	"errors"
+)
+
+// Returned when a request is refused due to load or quotas.
+var ErrBusy = errors.New("Busy, try later")
+
+type Admission struct {
+	Slots chan struct{}
+}
+
+func (A *Admission) init(Max int) {
+	A.Slots = make(chan struct{}, Max)
+}
+
+// Claim a slot if one is available, without waiting.
+func (A *Admission) tryAcquire() bool {
+	select {
+	case A.Slots <- struct{}{}:
+		return true
+	default:
+		return false
+	}
+}
+
+func (A *Admission) release() {
+	<-A.Slots
+}
@@ -9,13 +9,16 @@ import (
 	"os"
 	"os/exec"
 	"strings"
+	"syscall"
 	"testing"
 	"time"
 )
 
 // Run server daemon, assumes no server running already.
-func StartServerProcess() *os.Process {
+// Optional arguments are added to its environment.
+func StartServerProcess(Env ...string) *os.Process {
 	cmd := exec.Command("./ipcd")
+	cmd.Env = append(os.Environ(), Env...)
 	err := cmd.Start()
 	if err != nil {
 		panic(err)
@@ -213,10 +216,13 @@ func TestUnregister(t *testing.T) {
 	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
 	CheckReq("REGISTER 1 5\n", "200 ID 1", t)
 	CheckReq("REGISTER 1 9\n", "200 ID 2", t)
+	CheckReq("REGISTER 1 11\n", "200 ID 3", t)
 	// Valid
 	CheckReq("UNREGISTER 1\n", "200 OK", t)
 	CheckReq("UNREGISTER 0\n", "200 OK", t)
 	CheckReq("UNREGISTER 2\n", "200 OK", t)
+	// With the bytes sent and received
+	CheckReq("UNREGISTER 3 100 65536\n", "200 OK", t)
 	// Invalid
 	CheckReq("UNREGISTER 1\n", "303 Invalid Endpoint ID '1'", t)
 	CheckReq("UNREGISTER 3\n", "303 Invalid Endpoint ID '3'", t)
@@ -425,6 +431,7 @@ func TestEndpointInfo(t *testing.T) {
 	CheckReq("ENDPOINT_INFO 0 192.168.0.1 80 192.168.0.3 30 0 0 0 0 1\n", "303 cannot change address", t)
 	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 1 0 0 1\n", "303 cannot change timings", t)
 	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 1 0 0 0\n", "303 cannot change is_accept", t)
+	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 0 0 0 1 0 1\n", "303 cannot change protocol", t)
 }
 
 func TestTimingOK(t *testing.T) {
@@ -535,3 +542,598 @@ func TestTimingTrans(t *testing.T) {
 	CheckReq("FIND_PAIR 1 4455 1234 0\n", "303 too many potential matches", t)
 	CheckReq("FIND_PAIR 2 4455 1234 0\n", "303 potential dup detected", t)
 }
+
+// Register/unregister from many clients at once,
+// verify endpoint ID's handed out are unique and reused.
+func TestConcurrentRegister(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	const Clients = 16
+	const PerClient = 50
+
+	IDs := make(chan int, Clients*PerClient)
+	Errs := make(chan error, Clients)
+	for c := 0; c < Clients; c++ {
+		go func(c int) {
+			conn, err := net.Dial("unix", SOCKET_PATH)
+			if err != nil {
+				Errs <- err
+				return
+			}
+			defer conn.Close()
+			r := bufio.NewReader(conn)
+			for i := 0; i < PerClient; i++ {
+				conn.Write([]byte(fmt.Sprintf("REGISTER %d %d\n", c, i)))
+				line, err := r.ReadString('\n')
+				if err != nil {
+					Errs <- err
+					return
+				}
+				var ID int
+				if _, err := fmt.Sscanf(line, "200 ID %d\n", &ID); err != nil {
+					Errs <- fmt.Errorf("Unexpected response '%s'", line)
+					return
+				}
+				IDs <- ID
+			}
+			Errs <- nil
+		}(c)
+	}
+	for c := 0; c < Clients; c++ {
+		if err := <-Errs; err != nil {
+			t.Fatal(err)
+		}
+	}
+	close(IDs)
+
+	Seen := make(map[int]bool)
+	for ID := range IDs {
+		if Seen[ID] || ID < 0 || ID >= Clients*PerClient {
+			t.Fatalf("Unexpected or duplicate endpoint ID %d", ID)
+		}
+		Seen[ID] = true
+	}
+
+	for c := 0; c < Clients; c++ {
+		CheckReq(fmt.Sprintf("REMOVEALL %d\n", c), fmt.Sprintf("200 REMOVED %d", PerClient), t)
+	}
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+}
+
+// Verify pipelined requests (several in a single write,
+// including one split across writes) are all answered in order.
+func TestPipelinedRequests(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	c, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+
+	c.Write([]byte("REGISTER 1 10\nREGISTER 1 11\nBOGUS 1\nUNREGISTER 0\nREGI"))
+	time.Sleep(time.Second / 30)
+	c.Write([]byte("STER 1 12\n"))
+
+	Expected := []string{"200 ID 0", "200 ID 1", "300 Unrecognized command", "200 OK", "200 ID 0"}
+	r := bufio.NewReader(c)
+	for _, exp := range Expected {
+		line, err := r.ReadString('\n')
+		if err != nil {
+			t.Fatal(err)
+		}
+		if resp := strings.TrimSuffix(line, "\n"); resp != exp {
+			t.Fatalf("Unexpected response '%s', expected '%s'", resp, exp)
+		}
+	}
+}
+
+// Verify request lines longer than the initial read buffer are handled.
+func TestLongRequest(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 "+strings.Repeat("0", 2*READ_BUFFER_SIZE)+"10\n", "200 ID 0", t)
+}
+
+// Not a real test: when run as a helper process (see
+// TestReclaimKilledProcess), register an endpoint and wait to be killed.
+func TestHelperRegisterAndWait(t *testing.T) {
+	if os.Getenv("IPCD_TEST_HELPER") != "1" {
+		return
+	}
+	c, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		os.Exit(1)
+	}
+	c.Write([]byte("REGISTER 1 10\n"))
+	line, _ := bufio.NewReader(c).ReadString('\n')
+	fmt.Print(line)
+	time.Sleep(time.Minute)
+	os.Exit(0)
+}
+
+// Verify endpoints of a process that is killed
+// (and so never unregisters them) are reclaimed.
+func TestReclaimKilledProcess(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	Helper := exec.Command(os.Args[0], "-test.run=TestHelperRegisterAndWait")
+	Helper.Env = append(os.Environ(), "IPCD_TEST_HELPER=1")
+	Out, err := Helper.StdoutPipe()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := Helper.Start(); err != nil {
+		t.Fatal(err)
+	}
+	line, err := bufio.NewReader(Out).ReadString('\n')
+	if err != nil || line != "200 ID 0\n" {
+		t.Fatalf("Unexpected helper output '%s'", line)
+	}
+
+	Helper.Process.Kill()
+	Helper.Wait()
+	time.Sleep(time.Second / 15)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+}
+
+// Verify references REREGISTER'd before fork
+// must be adopted, and only owners may unregister.
+func TestAdopt(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REREGISTER 0 1 10\n", "200 OK", t)
+	CheckReq(fmt.Sprintf("ADOPT %d\n", os.Getpid()), "200 ADOPTED 0", t)
+	CheckReq("ADOPT 1\n", "200 ADOPTED 0", t)
+	CheckReq("UNREGISTER 0\n", "200 OK", t)
+	CheckReq("UNREGISTER 0\n", "200 OK", t)
+	CheckReq("UNREGISTER 0\n", "303 Invalid Endpoint ID '0'", t)
+}
+
+// Verify registrations beyond a client's quota are refused
+// with a "busy" response, until some are unregistered.
+func TestClientEndpointLimit(t *testing.T) {
+	P := StartServerProcess("IPCD_MAX_CLIENT_ENDPOINTS=2")
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 11\n", "200 ID 1", t)
+	CheckReq("REGISTER 1 12\n", "304 Busy, try later", t)
+	CheckReq("UNREGISTER 0\n", "200 OK", t)
+	CheckReq("REGISTER 1 12\n", "200 ID 0", t)
+}
+
+// Perform request expecting a descriptor attached to the response.
+// Returns the response string and the descriptor (-1 if none).
+func DoReqFD(req string, t *testing.T) (string, int) {
+	c, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+	c.Write([]byte(req))
+
+	buf := make([]byte, 100)
+	oob := make([]byte, syscall.CmsgSpace(4))
+	n, oobn, _, _, err := c.(*net.UnixConn).ReadMsgUnix(buf, oob)
+	if err != nil {
+		t.Fatal(err)
+	}
+	fd := -1
+	msgs, err := syscall.ParseSocketControlMessage(oob[:oobn])
+	if err == nil && len(msgs) == 1 {
+		if fds, err := syscall.ParseUnixRights(&msgs[0]); err == nil && len(fds) == 1 {
+			fd = fds[0]
+		}
+	}
+	return strings.TrimSuffix(string(buf[:n]), "\n"), fd
+}
+
+// Verify FIND_PAIR_FD hands each side its local fd
+// along with the pairing response, and that they're connected.
+func TestFindPairFD(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 15\n", "200 ID 1", t)
+	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 0 0 0 1\n", "200 OK", t)
+	CheckReq("ENDPOINT_INFO 1 192.168.0.3 30 192.168.0.2 80 0 0 0 0 0\n", "200 OK", t)
+
+	if resp, fd := DoReqFD("FIND_PAIR_FD 0 1234 4455 0\n", t); resp != "200 NOPAIR" || fd != -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd)
+	}
+	resp, fd1 := DoReqFD("FIND_PAIR_FD 1 4455 1234 0\n", t)
+	if resp != "200 PAIR 0" || fd1 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd1)
+	}
+	resp, fd0 := DoReqFD("FIND_PAIR_FD 0 1234 4455 0\n", t)
+	if resp != "200 PAIR 1" || fd0 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd0)
+	}
+	// Both fds handed out already
+	CheckReq("GETLOCALFD 0\n", "303 Local FD already retrieved", t)
+
+	F0 := os.NewFile(uintptr(fd0), "f0")
+	F1 := os.NewFile(uintptr(fd1), "f1")
+	defer F0.Close()
+	defer F1.Close()
+	F1.Write([]byte("Testing\n"))
+	line, err := bufio.NewReader(F0).ReadString('\n')
+	if err != nil || line != "Testing\n" {
+		t.Fatal("Failed to communicate over localized fd's")
+	}
+}
+
+// A process pairing its own endpoints gets a ring: each fd first
+// carries the side it's on, with the ring's memory.
+func TestFindPairFDSameProcess(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	PID := os.Getpid()
+	CheckReq(fmt.Sprintf("REGISTER %d 10\n", PID), "200 ID 0", t)
+	CheckReq(fmt.Sprintf("REGISTER %d 15\n", PID), "200 ID 1", t)
+	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 0 0 0 1\n", "200 OK", t)
+	CheckReq("ENDPOINT_INFO 1 192.168.0.3 30 192.168.0.2 80 0 0 0 0 0\n", "200 OK", t)
+
+	CheckReq("FIND_PAIR_FD 0 1234 4455 0\n", "200 NOPAIR", t)
+	resp, fd1 := DoReqFD("FIND_PAIR_FD 1 4455 1234 0\n", t)
+	if resp != "200 PAIR 0 RING" || fd1 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd1)
+	}
+	resp, fd0 := DoReqFD("FIND_PAIR_FD 0 1234 4455 0\n", t)
+	if resp != "200 PAIR 1 RING" || fd0 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd0)
+	}
+	defer syscall.Close(fd0)
+	defer syscall.Close(fd1)
+
+	Sides := ""
+	for _, FD := range []int{fd0, fd1} {
+		Buf := make([]byte, 1)
+		OOB := make([]byte, syscall.CmsgSpace(4))
+		n, oobn, _, _, err := syscall.Recvmsg(FD, Buf, OOB, 0)
+		if err != nil || n != 1 {
+			t.Fatalf("No ring on fd %d: %v", FD, err)
+		}
+		Msgs, err := syscall.ParseSocketControlMessage(OOB[:oobn])
+		if err != nil || len(Msgs) != 1 {
+			t.Fatalf("No ring memory on fd %d: %v", FD, err)
+		}
+		Rights, err := syscall.ParseUnixRights(&Msgs[0])
+		if err != nil || len(Rights) != 1 {
+			t.Fatalf("No ring memory on fd %d: %v", FD, err)
+		}
+		syscall.Close(Rights[0])
+		Sides += string(Buf)
+	}
+	if Sides != "01" && Sides != "10" {
+		t.Fatalf("Unexpected sides '%s'", Sides)
+	}
+}
+
+// Endpoints that drain exchange how much they sent over TCP.
+func TestFindPairMarks(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 15\n", "200 ID 1", t)
+	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 0 0 0 1\n", "200 OK", t)
+	CheckReq("ENDPOINT_INFO 1 192.168.0.3 30 192.168.0.2 80 0 0 0 0 0\n", "200 OK", t)
+
+	CheckReq("FIND_PAIR 0 1234 4455 0 70000\n", "200 NOPAIR", t)
+	CheckReq("FIND_PAIR 1 4455 1234 0 65536\n", "200 PAIR 0 70000", t)
+	CheckReq("FIND_PAIR 0 1234 4455 0 70000\n", "200 PAIR 1 65536", t)
+	CheckReq("FIND_PAIR 0 1234 4455 0 -1\n", "301 invalid sent mark", t)
+}
+
+// Verify LOCALIZE_FD localizes and returns our fd in one request.
+func TestLocalizeFD(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 5\n", "200 ID 1", t)
+	resp, fd0 := DoReqFD("LOCALIZE_FD 0 1\n", t)
+	if resp != "200 OK" || fd0 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd0)
+	}
+	resp, fd1 := DoReqFD("LOCALIZE_FD 1 0\n", t)
+	if resp != "200 OK" || fd1 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd1)
+	}
+	syscall.Close(fd0)
+	syscall.Close(fd1)
+}
+
+// Inode of the socket behind a TCP connection.
+func SocketInode(C net.Conn, t *testing.T) uint64 {
+	F, err := C.(*net.TCPConn).File()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer F.Close()
+	var St syscall.Stat_t
+	if err := syscall.Fstat(int(F.Fd()), &St); err != nil {
+		t.Fatal(err)
+	}
+	return St.Ino
+}
+
+// Real loopback connection is paired by socket identity,
+// despite a dup with the same addresses and timings.
+func TestFindPairByInode(t *testing.T) {
+	if D, err := NewSockDiag(); err != nil {
+		t.Skip("sock_diag not available: ", err)
+	} else {
+		syscall.Close(D.FD)
+	}
+	P := StartServerProcess()
+	defer Stop(P)
+
+	L, err := net.Listen("tcp4", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer L.Close()
+	Client, err := net.Dial("tcp4", L.Addr().String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer Client.Close()
+	Server, err := L.Accept()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer Server.Close()
+
+	CA := Client.LocalAddr().(*net.TCPAddr)
+	SA := Server.LocalAddr().(*net.TCPAddr)
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 15\n", "200 ID 1", t)
+	CheckReq("REGISTER 2 10\n", "200 ID 2", t)
+	CheckReq(fmt.Sprintf("ENDPOINT_INFO 0 127.0.0.1 %d 127.0.0.1 %d 0 0 0 0 1 %d\n",
+		SA.Port, CA.Port, SocketInode(Server, t)), "200 OK", t)
+	CheckReq(fmt.Sprintf("ENDPOINT_INFO 1 127.0.0.1 %d 127.0.0.1 %d 0 0 0 0 0 %d\n",
+		CA.Port, SA.Port, SocketInode(Client, t)), "200 OK", t)
+	// Dup of '1', claiming an inode that isn't the socket's
+	CheckReq(fmt.Sprintf("ENDPOINT_INFO 2 127.0.0.1 %d 127.0.0.1 %d 0 0 0 0 0 1\n",
+		CA.Port, SA.Port), "200 OK", t)
+
+	CheckReq("FIND_PAIR 0 1234 4455 0\n", "200 NOPAIR", t)
+	CheckReq("FIND_PAIR 1 4455 1234 0\n", "200 PAIR 0", t)
+	CheckReq("FIND_PAIR 0 1234 4455 0\n", "200 PAIR 1", t)
+
+}
+
+// Connection to a listener registered with LISTEN
+// is paired at once, each end getting its local fd.
+func TestFindPairFast(t *testing.T) {
+	if D, err := NewSockDiag(); err != nil {
+		t.Skip("sock_diag not available: ", err)
+	} else {
+		syscall.Close(D.FD)
+	}
+	// Without history, learning would leave it to the threshold.
+	P := StartServerProcess("IPCD_LEARN_THRESHOLD=0")
+	defer Stop(P)
+
+	L, err := net.Listen("tcp4", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer L.Close()
+	LA := L.Addr().(*net.TCPAddr)
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq(fmt.Sprintf("LISTEN 0 0.0.0.0 %d\n", LA.Port), "200 OK", t)
+
+	Client, err := net.Dial("tcp4", LA.String())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer Client.Close()
+	Server, err := L.Accept()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer Server.Close()
+
+	CA := Client.LocalAddr().(*net.TCPAddr)
+	CheckReq("REGISTER 2 10\n", "200 ID 1", t)
+	CheckReq("REGISTER 1 11\n", "200 ID 2", t)
+	CheckReq(fmt.Sprintf("ENDPOINT_INFO 1 127.0.0.1 %d 127.0.0.1 %d 0 0 0 0 0 %d\n",
+		CA.Port, LA.Port, SocketInode(Client, t)), "200 FAST", t)
+	if resp, fd := DoReqFD("FIND_PAIR_FAST 1 0\n", t); resp != "200 NOPAIR" || fd != -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd)
+	}
+	CheckReq(fmt.Sprintf("ENDPOINT_INFO 2 127.0.0.1 %d 127.0.0.1 %d 0 0 0 0 1 %d\n",
+		LA.Port, CA.Port, SocketInode(Server, t)), "200 FAST", t)
+	resp, fd2 := DoReqFD("FIND_PAIR_FAST 2 1\n", t)
+	if resp != "200 PAIR 1" || fd2 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd2)
+	}
+	resp, fd1 := DoReqFD("FIND_PAIR_FAST 1 0\n", t)
+	if resp != "200 PAIR 2" || fd1 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd1)
+	}
+	syscall.Close(fd1)
+	syscall.Close(fd2)
+}
+
+// Virtual connection to a VLISTEN listener arrives on its
+// accept queue, with the addresses it was made with.
+func TestVirtualConnect(t *testing.T) {
+	P := StartServerProcess()
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 2 10\n", "200 ID 1", t)
+	CheckReq("VCONNECT 1 127.0.0.1 5000 127.0.0.1 80\n", "200 NOPEER", t)
+	resp, queue := DoReqFD("VLISTEN 0 0.0.0.0 80\n", t)
+	if resp != "200 OK" || queue == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, queue)
+	}
+	defer syscall.Close(queue)
+	resp, fd1 := DoReqFD("VCONNECT 1 127.0.0.1 5000 127.0.0.1 80\n", t)
+	if resp != "200 OK" || fd1 == -1 {
+		t.Fatalf("Unexpected response '%s', fd %d", resp, fd1)
+	}
+	defer syscall.Close(fd1)
+
+	buf := make([]byte, 100)
+	oob := make([]byte, syscall.CmsgSpace(4))
+	n, oobn, _, _, err := syscall.Recvmsg(queue, buf, oob, 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if string(buf[:n]) != "127.0.0.1 5000 127.0.0.1 80" {
+		t.Fatalf("Unexpected connection addresses '%s'", buf[:n])
+	}
+	msgs, err := syscall.ParseSocketControlMessage(oob[:oobn])
+	if err != nil || len(msgs) != 1 {
+		t.Fatal("No fd for virtual connection")
+	}
+	fds, err := syscall.ParseUnixRights(&msgs[0])
+	if err != nil || len(fds) != 1 {
+		t.Fatal("No fd for virtual connection")
+	}
+	defer syscall.Close(fds[0])
+
+	syscall.Write(fd1, []byte("Testing\n"))
+	n, err = syscall.Read(fds[0], buf)
+	if err != nil || string(buf[:n]) != "Testing\n" {
+		t.Fatal("Failed to communicate over virtual connection")
+	}
+}
+
+// Server started with a listening socket (IPCD_LISTEN_FD)
+// serves clients that connected before it was running.
+func TestInheritedListener(t *testing.T) {
+	os.Remove(SOCKET_PATH)
+	L, err := net.Listen("unix", SOCKET_PATH)
+	if err != nil {
+		t.Fatal(err)
+	}
+	L.(*net.UnixListener).SetUnlinkOnClose(false)
+	F, err := L.(*net.UnixListener).File()
+	L.Close()
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	c, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+	c.Write([]byte("REGISTER 1 10\n"))
+
+	cmd := exec.Command("./ipcd")
+	cmd.Env = append(os.Environ(), LISTEN_FD_ENV+"=3")
+	cmd.ExtraFiles = []*os.File{F}
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	F.Close()
+	defer Stop(cmd.Process)
+
+	line, err := bufio.NewReader(c).ReadString('\n')
+	if err != nil || line != "200 ID 0\n" {
+		t.Fatalf("Unexpected response '%s', %v", line, err)
+	}
+	CheckReq("REGISTER 1 11\n", "200 ID 1", t)
+}
+
+// Verify a new ipcd started with IPCD_TAKEOVER takes over from the
+// running one: same endpoints (and ID's), owners and local fds,
+// served on the same socket, connected clients being disconnected.
+func TestTakeOver(t *testing.T) {
+	P := StartServerProcess()
+	Done := make(chan error, 1)
+	go func() {
+		_, err := P.Wait()
+		Done <- err
+	}()
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 11\n", "200 ID 1", t)
+	CheckReq("REGISTER 1 12\n", "200 ID 2", t)
+	CheckReq("LOCALIZE 0 1\n", "200 OK", t)
+	CheckReq("UNREGISTER 2\n", "200 OK", t)
+
+	c, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+
+	N := StartServerProcess(TAKEOVER_ENV + "=1")
+	defer Stop(N)
+	select {
+	case <-Done:
+	case <-time.After(5 * time.Second):
+		Stop(P)
+		t.Fatal("ipcd didn't hand over")
+	}
+
+	// Idle client was disconnected.
+	if _, err := bufio.NewReader(c).ReadByte(); err == nil {
+		t.Fatal("Expected connection to old ipcd to be closed")
+	}
+
+	fd1 := GetLocalFDFor(0, t)
+	fd2 := GetLocalFDFor(1, t)
+	F1 := os.NewFile(uintptr(fd1), "f1")
+	F2 := os.NewFile(uintptr(fd2), "f2")
+	defer F1.Close()
+	defer F2.Close()
+	F1.Write([]byte("Testing\n"))
+	line, err := bufio.NewReader(F2).ReadBytes('\n')
+	if err != nil || string(line) != "Testing\n" {
+		t.Fatalf("Failed to communicate over handed over fd's: %v", err)
+	}
+
+	CheckReq("REGISTER 1 13\n", "200 ID 2", t)
+	CheckReq("UNREGISTER 0\n", "200 OK", t)
+	CheckReq("UNREGISTER 0\n", "303 Invalid Endpoint ID '0'", t)
+}
+
+func TestPolicyFile(t *testing.T) {
+	F, err := os.CreateTemp("", "ipcd-policy")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.Remove(F.Name())
+	F.WriteString("port=80 threshold=4096 timeout=20ms\nport=81 off\nport=83 calls=8 age=1s\n")
+	F.Close()
+
+	P := StartServerProcess(POLICY_ENV + "=" + F.Name())
+	defer Stop(P)
+
+	CheckReq("REGISTER 1 10\n", "200 ID 0", t)
+	CheckReq("REGISTER 1 11\n", "200 ID 1", t)
+	CheckReq("REGISTER 1 12\n", "200 ID 2", t)
+	CheckReq("REGISTER 1 13\n", "200 ID 3", t)
+	CheckReq("ENDPOINT_INFO 0 192.168.0.2 80 192.168.0.3 30 0 0 0 0 1\n", "200 OK 4096 20 0 0", t)
+	CheckReq("ENDPOINT_INFO 1 192.168.0.3 30 192.168.0.2 81 0 0 0 0 0\n", "200 SKIP", t)
+	CheckReq("ENDPOINT_INFO 2 192.168.0.3 30 192.168.0.2 82 0 0 0 0 0\n", "200 OK", t)
+	CheckReq("ENDPOINT_INFO 3 192.168.0.3 30 192.168.0.2 83 0 0 0 0 0\n", "200 OK 0 0 8 1000", t)
+	CheckReq("UNREGISTER 3 10 10 1\n", "200 OK", t)
+}
+
+func TestPolicyFileInvalid(t *testing.T) {
+	cmd := exec.Command("./ipcd")
+	cmd.Env = append(os.Environ(), POLICY_ENV+"=/nonexistent")
+	if err := cmd.Run(); err == nil {
+		t.Fatal("Expected ipcd to refuse to start without its policy")
+	}
+}
@@ -5,18 +5,23 @@ package main
 // in our optimization context.
 
 import (
-	"bufio"
+	"bytes"
+	"errors"
 	"fmt"
 	"log"
+	"math"
 	"net"
 	"os"
 	"strconv"
-	"strings"
+	"syscall"
 	"time"
 )
 
 const SOCKET_PATH = "/tmp/ipcd.sock"
 
+// Listening socket inherited from whoever started us.
+const LISTEN_FD_ENV = "IPCD_LISTEN_FD"
+
 type ClientReq struct {
 	I int
 }
@@ -26,6 +31,7 @@ const (
 	REQ_ERR_INVALID_PARAMETER = iota
 	REQ_ERR_INSUFFICIENT_ARGS = iota
 	REQ_ERR_UNKNOWN           = iota
+	REQ_ERR_BUSY              = iota
 )
 
 type ReqError struct {
@@ -42,70 +48,274 @@ func (R *ReqError) Response() string {
 	return fmt.Sprintf("%d %s", ErrCode, R.Msg)
 }
 
-func listenForClients(C *IPCContext) {
+// Socket to accept clients on: the one we were started with,
+// if any (libipc binds it before starting us, so clients can
+// connect right away and are served once we're up), else our own.
+func clientListener() (net.Listener, error) {
+	if V := os.Getenv(LISTEN_FD_ENV); V != "" {
+		os.Unsetenv(LISTEN_FD_ENV)
+		FD, err := strconv.Atoi(V)
+		if err != nil {
+			return nil, err
+		}
+		F := os.NewFile(uintptr(FD), "listener")
+		defer F.Close()
+		return net.FileListener(F)
+	}
+
 	os.Remove(SOCKET_PATH)
 	ln, err := net.Listen("unix", SOCKET_PATH)
 	if err != nil {
-		panic(err)
+		return nil, err
 	}
+	return ln, os.Chmod(SOCKET_PATH, os.ModePerm)
+}
 
-	err = os.Chmod(SOCKET_PATH, os.ModePerm)
-	if err != nil {
-		panic(err)
+// Accept clients on the given listener, or our own if nil.
+func listenForClients(C *IPCContext, ln net.Listener) {
+	if ln == nil {
+		var err error
+		ln, err = clientListener()
+		if err != nil {
+			panic(err)
+		}
 	}
-
-	queue := make(chan *ContextRequest)
-
-	go FIFOhandler(C, queue)
+	C.Clients.setListener(ln)
 
 	for {
 		conn, err := ln.Accept()
 		if err != nil {
+			// Handing over, carry on if that fails.
+			if Resume := C.Clients.paused(); Resume != nil {
+				<-Resume
+				continue
+			}
 			log.Printf("Error in accept: %s\n", err.Error())
 			continue
 		}
-		go handleConnection(C, conn, queue)
+		go handleConnection(C, conn)
 	}
 }
 
-type ContextResponse struct {
-	Message string
-	Error   *ReqError
+// Size of the initial per-connection read buffer.
+// Grown as needed if a client sends a longer line.
+const READ_BUFFER_SIZE = 4096
+
+// Per-connection state, reused across requests so that
+// parsing and responding doesn't allocate.
+type ClientConn struct {
+	C net.Conn
+	// PID of the client process, 0 if unknown.
+	// Endpoints it registers are owned by this process.
+	PID int
+	// Bytes read from the client, of which RBuf[Start:End]
+	// have not been processed yet.
+	RBuf       []byte
+	Start, End int
+	// Responses not yet written to the client.
+	WBuf []byte
+	// Body of the response for the current request.
+	Resp []byte
+	// Descriptor to send along with the response, -1 if none.
+	// Closed once sent.
+	RespFD int
+	Tokens [MAX_TOKENS][]byte
+	// Name of the client program, once looked up.
+	Prog      ProgName
+	KnownProg bool
+	// Successor asking us to hand over (TAKEOVER),
+	// done once it has been answered.
+	HandOff bool
 }
 
-type ContextRequest struct {
-	C          net.Conn
-	Line       string
-	ResultChan chan ContextResponse
+func NewClientConn(C net.Conn) *ClientConn {
+	return &ClientConn{
+		C:      C,
+		PID:    peerPID(C),
+		RBuf:   make([]byte, READ_BUFFER_SIZE),
+		WBuf:   make([]byte, 0, READ_BUFFER_SIZE),
+		Resp:   make([]byte, 0, 64),
+		RespFD: -1,
+	}
 }
 
-func FIFOhandler(Context *IPCContext, queue chan *ContextRequest) {
-	for req := range queue {
-		msg, err := processRequestLine(Context, req.C, req.Line)
-		req.ResultChan <- ContextResponse{msg, err}
+// Credentials of the process on the other end of the connection,
+// nil if unknown.
+func peerCred(C net.Conn) *syscall.Ucred {
+	UC, ok := C.(*net.UnixConn)
+	if !ok {
+		return nil
+	}
+	Raw, err := UC.SyscallConn()
+	if err != nil {
+		return nil
 	}
+	var Cred *syscall.Ucred
+	Raw.Control(func(fd uintptr) {
+		Cred, err = syscall.GetsockoptUcred(int(fd), syscall.SOL_SOCKET, syscall.SO_PEERCRED)
+		if err != nil {
+			Cred = nil
+		}
+	})
+	return Cred
+}
+
+// PID of the process on the other end of the connection, 0 if unknown.
+func peerPID(C net.Conn) int {
+	if Cred := peerCred(C); Cred != nil {
+		return int(Cred.Pid)
+	}
+	return 0
+}
+
+// User on the other end of the connection, -1 if unknown.
+func peerUID(C net.Conn) int {
+	if Cred := peerCred(C); Cred != nil {
+		return int(Cred.Uid)
+	}
+	return -1
+}
+
+// Name of the client program.
+func (CC *ClientConn) program() ProgName {
+	if !CC.KnownProg {
+		CC.Prog = progName(CC.PID)
+		CC.KnownProg = true
+	}
+	return CC.Prog
+}
+
+func (CC *ClientConn) respondStr(S string) {
+	CC.Resp = append(CC.Resp, S...)
 }
 
-func handleConnection(Context *IPCContext, C net.Conn, queue chan *ContextRequest) {
+func (CC *ClientConn) respondInt(Prefix string, N int) {
+	CC.Resp = append(CC.Resp, Prefix...)
+	CC.Resp = strconv.AppendInt(CC.Resp, int64(N), 10)
+}
+
+// Write all pending responses to the client.
+func (CC *ClientConn) flush() error {
+	if len(CC.WBuf) == 0 {
+		return nil
+	}
+	_, err := CC.C.Write(CC.WBuf)
+	CC.WBuf = CC.WBuf[:0]
+	return err
+}
+
+// Send a file descriptor to the client, with a dummy byte.
+func (CC *ClientConn) writeFD(fd int) error {
+	return CC.writeWithFD([]byte{0}, fd)
+}
+
+// Send data to the client with a file descriptor attached.
+// Pending responses are flushed first to preserve ordering.
+func (CC *ClientConn) writeWithFD(Data []byte, fd int) error {
+	if err := CC.flush(); err != nil {
+		return err
+	}
+	UC, ok := CC.C.(*net.UnixConn)
+	if !ok {
+		return errors.New(fmt.Sprintf("unexpected type; expected UnixConn, got %T", CC.C))
+	}
+	rights := syscall.UnixRights(fd)
+	n, oobn, err := UC.WriteMsgUnix(Data, rights, nil)
+	if err != nil {
+		return err
+	}
+	if n != len(Data) || oobn != len(rights) {
+		return errors.New(fmt.Sprintf("WriteMsgUnix = %d, %d; want %d, %d", n, oobn, len(Data), len(rights)))
+	}
+	return nil
+}
+
+// Attach descriptor to the response for the current request.
+func (CC *ClientConn) respondFD(fd int) {
+	CC.RespFD = fd
+}
+
+// Process all complete lines currently buffered,
+// queueing responses in WBuf.
+// Responses carrying a descriptor are written immediately.
+func (CC *ClientConn) processBuffered(Context *IPCContext) (err error) {
+	for {
+		Pending := CC.RBuf[CC.Start:CC.End]
+		NL := bytes.IndexByte(Pending, '\n')
+		if NL == -1 {
+			break
+		}
+		Line := Pending[:NL]
+		CC.Start += NL + 1
+
+		CC.Resp = CC.Resp[:0]
+		RespStart := len(CC.WBuf)
+		Args := splitTokens(Line, CC.Tokens[:])
+		if rerr := processRequest(Context, CC, Args); rerr != nil {
+			CC.WBuf = append(CC.WBuf, rerr.Response()...)
+		} else {
+			CC.WBuf = append(CC.WBuf, "200 "...)
+			if len(CC.Resp) == 0 {
+				CC.WBuf = append(CC.WBuf, "OK"...)
+			} else {
+				CC.WBuf = append(CC.WBuf, CC.Resp...)
+			}
+		}
+		CC.WBuf = append(CC.WBuf, '\n')
+
+		if CC.RespFD != -1 {
+			Resp := CC.WBuf[RespStart:]
+			CC.WBuf = CC.WBuf[:RespStart]
+			if err == nil {
+				err = CC.writeWithFD(Resp, CC.RespFD)
+			}
+			syscall.Close(CC.RespFD)
+			CC.RespFD = -1
+			CC.WBuf = CC.WBuf[:0]
+		}
+	}
+
+	// Move partial line (if any) to front of buffer,
+	// growing the buffer if it's full.
+	CC.End = copy(CC.RBuf, CC.RBuf[CC.Start:CC.End])
+	CC.Start = 0
+	if CC.End == len(CC.RBuf) {
+		CC.RBuf = append(CC.RBuf, make([]byte, len(CC.RBuf))...)
+	}
+	return err
+}
+
+// Each client connection is served by its own goroutine,
+// executing requests directly against the (sharded) context.
+// Requests from different clients proceed in parallel.
+// All requests received in a single read (pipelined requests)
+// are answered with a single write.
+func handleConnection(Context *IPCContext, C net.Conn) {
 	// TODO: Use something more structured like protobuf, etc
-	b := bufio.NewReader(C)
+	CC := NewClientConn(C)
 	defer C.Close()
+	if !Context.Clients.add(C) {
+		// Handing over, client will reconnect.
+		return
+	}
+	defer Context.Clients.remove(C)
 
-	ResultChan := make(chan ContextResponse)
 	for {
-		line, err := b.ReadBytes('\n')
+		n, err := C.Read(CC.RBuf[CC.End:])
+		if n > 0 {
+			CC.End += n
+			if CC.processBuffered(Context) != nil || CC.flush() != nil {
+				break
+			}
+			if CC.HandOff {
+				Context.Clients.remove(C)
+				Context.handOff(CC)
+				break
+			}
+		}
 		if err != nil { // EOF, or worse
 			break
 		}
-		lineString := strings.TrimSuffix(string(line), "\n")
-		queue <- &ContextRequest{C, lineString, ResultChan}
-		result := <-ResultChan
-		if result.Error != nil {
-			resp := result.Error.Response()
-			C.Write([]byte(resp + "\n"))
-		} else {
-			C.Write([]byte(fmt.Sprintf("200 %s\n", result.Message)))
-		}
 	}
 }
 
@@ -118,54 +328,93 @@ func InvalidParameterErr(msg string) *ReqError {
 func UnknownErr(msg string) *ReqError {
 	return &ReqError{REQ_ERR_UNKNOWN, msg}
 }
+func BusyErr() *ReqError {
+	return &ReqError{REQ_ERR_BUSY, "Busy, try later"}
+}
 
-func processRequestLine(Ctxt *IPCContext, C net.Conn, line string) (Resp string, RErr *ReqError) {
-	Resp = "OK"
-	spaceDelimTokens := strings.Split(line, " ")
-	if len(spaceDelimTokens) < 2 {
+// Requests that may be refused when we're overloaded.
+// Clients can always proceed without these, by not optimizing,
+// while requests that finish (or undo) work already done aren't shed.
+// Pairing requests for endpoints already paired aren't shed either,
+// as their peer may already be using its local fd, nor are last
+// tries: an endpoint giving up mustn't be left looking paired.
+func sheddable(Ctxt *IPCContext, Args [][]byte) bool {
+	switch string(Args[0]) {
+	case "REGISTER", "ENDPOINT_INFO", "UNIX_INFO", "VCONNECT":
+		return true
+	case "FIND_PAIR", "FIND_PAIR_FD", "FIND_PAIR_FAST":
+		Done := 4
+		if string(Args[0]) == "FIND_PAIR_FAST" {
+			Done = 2
+		}
+		if len(Args) > Done && string(Args[Done]) != "0" {
+			return false
+		}
+		fallthrough
+	case "THRESH_CRC_KLUDGE", "ENDPOINT_KLUDGE":
+		EP, err := parseInt(Args[1])
+		return err != nil || !Ctxt.isPaired(EP)
+	}
+	return false
+}
+
+func processRequest(Ctxt *IPCContext, CC *ClientConn, Args [][]byte) (RErr *ReqError) {
+	if len(Args) < 2 {
 		RErr = InsufficientArgsErr()
 		return
 	}
-	command := spaceDelimTokens[0]
-	// fmt.Printf("processRequest: '%s'\n", line)
-	switch command {
+	command := Args[0]
+	// fmt.Printf("processRequest: '%s'\n", command)
+	if sheddable(Ctxt, Args) {
+		if !Ctxt.Admission.tryAcquire() {
+			RErr = BusyErr()
+			return
+		}
+		defer Ctxt.Admission.release()
+	}
+	switch string(command) {
 	case "REGISTER":
 		// REGISTER PID FD
-		if len(spaceDelimTokens) < 3 {
+		if len(Args) < 3 {
 			RErr = InsufficientArgsErr()
 			return
 		}
 
-		PID, err := strconv.Atoi(spaceDelimTokens[1])
+		PID, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		FD, err := strconv.Atoi(spaceDelimTokens[2])
+		FD, err := parseInt(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
 
-		ID, err := Ctxt.register(PID, FD)
+		ID, err := Ctxt.register(PID, FD, CC.PID)
 		if err != nil {
+			if err == ErrBusy {
+				RErr = BusyErr()
+				return
+			}
 			RErr = UnknownErr(err.Error())
 			return
 		}
-		return fmt.Sprintf("ID %d", ID), nil
+		CC.respondInt("ID ", ID)
+		return nil
 	case "LOCALIZE":
 		// LOCALIZE LOCALID REMOTEID
-		if len(spaceDelimTokens) < 3 {
+		if len(Args) < 3 {
 			RErr = InsufficientArgsErr()
 			return
 		}
 
-		LID, err := strconv.Atoi(spaceDelimTokens[1])
+		LID, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		RID, err := strconv.Atoi(spaceDelimTokens[2])
+		RID, err := parseInt(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
@@ -176,59 +425,100 @@ func processRequestLine(Ctxt *IPCContext, C net.Conn, line string) (Resp string,
 			RErr = UnknownErr(err.Error())
 			return
 		}
-	case "GETLOCALFD":
-		LID, err := strconv.Atoi(spaceDelimTokens[1])
+	case "LOCALIZE_FD":
+		// LOCALIZE_FD <local> <remote>
+		// LOCALIZE, and send our local fd with the response.
+		if len(Args) < 3 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		LID, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		RID, err := parseInt(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
 
-		FD, err := Ctxt.getLocalFD(LID)
+		FD, err := Ctxt.localizeFD(LID, RID)
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
+		CC.respondFD(FD)
+	case "GETLOCALFD":
+		LID, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
 
-		U, err := NewFromConn(C)
+		FD, err := Ctxt.getLocalFD(LID)
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
-		err = U.WriteFD(int(FD.Fd()))
+
+		// Once sent, close our copy of it.
+		err = CC.writeFD(FD)
+		syscall.Close(FD)
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
-		// close our copy of it.
-		// This seems to work, but I can't find
-		// documentation that it's safe to close it at this point.
-		FD.Close()
 	case "UNREGISTER":
-		// UNREGISTER <endpoint>
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		// UNREGISTER <endpoint> [<bytes sent> <bytes received> [<due>]]
+		// Byte counts, if given, are learned from, as is whether
+		// it got far enough to be paired some other way (due).
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-
-		err = Ctxt.unregister(EP)
+		if len(Args) > 3 {
+			Sent, err := parseInt64(Args[2])
+			if err != nil {
+				RErr = InvalidParameterErr(err.Error())
+				return
+			}
+			Recv, err := parseInt64(Args[3])
+			if err != nil {
+				RErr = InvalidParameterErr(err.Error())
+				return
+			}
+			Due := 0
+			if len(Args) > 4 {
+				Due, err = parseInt(Args[4])
+				if err != nil {
+					RErr = InvalidParameterErr(err.Error())
+					return
+				}
+			}
+			Ctxt.learn(EP, Sent, Recv, Due != 0)
+		}
+
+		err = Ctxt.unregister(EP, CC.PID)
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
 	case "REMOVEALL":
 		// REMOVEALL <pid>
-		PID, err := strconv.Atoi(spaceDelimTokens[1])
+		PID, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
 
 		removed := Ctxt.removeall(PID)
-		return fmt.Sprintf("REMOVED %d", removed), nil
+		CC.respondInt("REMOVED ", removed)
+		return nil
 	case "ENDPOINT_KLUDGE":
 		// ENDPOINT_KLUDGE <endpoint id>
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
@@ -240,31 +530,33 @@ func processRequestLine(Ctxt *IPCContext, C net.Conn, line string) (Resp string,
 			return
 		}
 		if Pair == EP {
-			return "NOPAIR", nil
+			CC.respondStr("NOPAIR")
+			return nil
 		}
-		return fmt.Sprintf("PAIR %d", Pair), nil
+		CC.respondInt("PAIR ", Pair)
+		return nil
 	case "THRESH_CRC_KLUDGE":
 		// THRESH_CRC_KLUDGE <endpoint id> <send_crc> <recv_crc> <done>
-		if len(spaceDelimTokens) < 5 {
+		if len(Args) < 5 {
 			RErr = InsufficientArgsErr()
 			return
 		}
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		S_CRC, err := strconv.Atoi(spaceDelimTokens[2])
+		S_CRC, err := parseInt(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		R_CRC, err := strconv.Atoi(spaceDelimTokens[3])
+		R_CRC, err := parseInt(Args[3])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		LastTry, err := strconv.Atoi(spaceDelimTokens[4])
+		LastTry, err := parseInt(Args[4])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
@@ -276,135 +568,431 @@ func processRequestLine(Ctxt *IPCContext, C net.Conn, line string) (Resp string,
 			return
 		}
 		if Pair == EP {
-			return "NOPAIR", nil
+			CC.respondStr("NOPAIR")
+			return nil
 		}
-		return fmt.Sprintf("PAIR %d", Pair), nil
+		CC.respondInt("PAIR ", Pair)
+		return nil
 	case "ENDPOINT_INFO":
 		// ENDPOINT_INFO <endpoint_id>
 		//           <srcip> <srcport> <dstip> <dstport>
 		//           <start_sec> <start_nsec>
 		//           <end_sec> <end_nsec>
-		//           <is_accept>
-		if len(spaceDelimTokens) < 11 {
+		//           <is_accept> [<inode> [<dgram>]]
+		// The socket's inode, if given, lets it be paired by
+		// the kernel's idea of its peer rather than by guesswork.
+		// Dgram, if nonzero, says it's a connected UDP socket.
+		// Responds FAST if connected to one of our listeners,
+		// meaning it can be paired right away (FIND_PAIR_FAST),
+		// or SKIP if such connections usually aren't worth
+		// optimizing (or policy says not to), so needn't be
+		// tracked at all.  Unless skipped, policy may also set
+		// when to pair (bytes, calls or ms connected) and how long
+		// to wait for the peer (in ms), 0 for libipc's defaults:
+		//   200 <OK|FAST> <threshold> <timeout> <calls> <age>
+		if len(Args) < 11 {
 			RErr = InsufficientArgsErr()
 			return
 		}
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		SIP := spaceDelimTokens[2]
-		SPort, err := strconv.Atoi(spaceDelimTokens[3])
+		SIP, err := parseIP(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
+			return
 		}
-		DIP := spaceDelimTokens[4]
-		DPort, err := strconv.Atoi(spaceDelimTokens[5])
+		SPort, err := parseInt(Args[3])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 		}
-		Start_S, err := strconv.ParseInt(spaceDelimTokens[6], 10, 64)
+		DIP, err := parseIP(Args[4])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		Start_NS, err := strconv.ParseInt(spaceDelimTokens[7], 10, 64)
+		DPort, err := parseInt(Args[5])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+		}
+		Start_S, err := parseInt64(Args[6])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Start_NS, err := parseInt64(Args[7])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		End_S, err := strconv.ParseInt(spaceDelimTokens[8], 10, 64)
+		End_S, err := parseInt64(Args[8])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		End_NS, err := strconv.ParseInt(spaceDelimTokens[9], 10, 64)
+		End_NS, err := parseInt64(Args[9])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		IsAccept, err := strconv.Atoi(spaceDelimTokens[10])
+		IsAccept, err := parseInt(Args[10])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
 
+		var Inode int64
+		if len(Args) > 11 {
+			Inode, err = parseInt64(Args[11])
+			if err != nil || Inode < 0 || Inode > math.MaxUint32 {
+				RErr = InvalidParameterErr("invalid inode")
+				return
+			}
+		}
+
+		Dgram := 0
+		if len(Args) > 12 {
+			Dgram, err = parseInt(Args[12])
+			if err != nil {
+				RErr = InvalidParameterErr(err.Error())
+				return
+			}
+		}
+
 		Src := NetAddr{SIP, SPort}
 		Dst := NetAddr{DIP, DPort}
-		Start := time.Unix(Start_S, Start_NS)
-		End := time.Unix(End_S, End_NS)
+		Start := Start_S*int64(time.Second) + Start_NS
+		End := End_S*int64(time.Second) + End_NS
 
-		err = Ctxt.endpoint_info(EP, Src, Dst, Start, End, IsAccept != 0)
+		Hint, err := Ctxt.endpoint_info(EP, Src, Dst, Start, End, IsAccept != 0, uint32(Inode), Dgram != 0, CC.program())
+		if err != nil {
+			RErr = UnknownErr(err.Error())
+			return
+		}
+		switch Hint {
+		case HINT_FAST:
+			CC.respondStr("FAST")
+		case HINT_SKIP:
+			CC.respondStr("SKIP")
+			return
+		}
+		if R := Ctxt.endpointRule(EP); R != nil && R.tunes() {
+			if Hint == HINT_NONE {
+				CC.respondStr("OK")
+			}
+			CC.respondInt(" ", R.Threshold)
+			CC.respondInt(" ", int(R.PairTimeout/time.Millisecond))
+			CC.respondInt(" ", R.Calls)
+			CC.respondInt(" ", int(R.Age/time.Millisecond))
+		}
+	case "UNIX_INFO":
+		// UNIX_INFO <endpoint id> <inode>
+		// ENDPOINT_INFO for AF_UNIX stream sockets, which have
+		// nothing but their inode to go by, responding the same
+		// way (never FAST).  Their peer is found from the kernel,
+		// SKIP if it can't be.
+		if len(Args) < 3 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		EP, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Inode, err := parseInt64(Args[2])
+		if err != nil || Inode <= 0 || Inode > math.MaxUint32 {
+			RErr = InvalidParameterErr("invalid inode")
+			return
+		}
+		Hint, err := Ctxt.unix_info(EP, uint32(Inode), CC.program())
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
-	case "FIND_PAIR":
-		// FIND_PAIR <endpoint id> <send_crc> <recv_crc> <done>
-		if len(spaceDelimTokens) < 5 {
+		if Hint == HINT_SKIP {
+			CC.respondStr("SKIP")
+			return
+		}
+		CC.respondStr("OK")
+		if R := Ctxt.endpointRule(EP); R != nil && R.tunes() {
+			CC.respondInt(" ", R.Threshold)
+			CC.respondInt(" ", int(R.PairTimeout/time.Millisecond))
+			CC.respondInt(" ", R.Calls)
+			CC.respondInt(" ", int(R.Age/time.Millisecond))
+		}
+	case "LISTEN":
+		// LISTEN <endpoint id> <ip> <port>
+		if len(Args) < 4 {
 			RErr = InsufficientArgsErr()
 			return
 		}
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		S_CRC, err := strconv.Atoi(spaceDelimTokens[2])
+		IP, err := parseIP(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		R_CRC, err := strconv.Atoi(spaceDelimTokens[3])
+		Port, err := parseInt(Args[3])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		LastTry, err := strconv.Atoi(spaceDelimTokens[4])
+		err = Ctxt.listen(EP, NetAddr{IP, Port})
+		if err != nil {
+			RErr = UnknownErr(err.Error())
+			return
+		}
+	case "VLISTEN":
+		// VLISTEN <endpoint id> <ip> <port>
+		// LISTEN, also accepting virtual connections,
+		// which are sent over the accept queue whose
+		// receiving end is sent with the response.
+		if len(Args) < 4 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		Pair, err := Ctxt.find_pair(EP, S_CRC, R_CRC, LastTry != 0)
+		IP, err := parseIP(Args[2])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Port, err := parseInt(Args[3])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		FD, err := Ctxt.vlisten(EP, NetAddr{IP, Port})
+		if err != nil {
+			RErr = UnknownErr(err.Error())
+			return
+		}
+		CC.respondFD(FD)
+	case "VCONNECT":
+		// VCONNECT <endpoint id> <srcip> <srcport> <dstip> <dstport>
+		// Connect to virtual listener, sending our end of
+		// the connection with the response.
+		// NOPEER if there's no virtual listener there.
+		if len(Args) < 6 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		EP, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		SIP, err := parseIP(Args[2])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		SPort, err := parseInt(Args[3])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		DIP, err := parseIP(Args[4])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		DPort, err := parseInt(Args[5])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		FD, err := Ctxt.vconnect(EP, NetAddr{SIP, SPort}, NetAddr{DIP, DPort})
+		switch {
+		case err == ErrNoPeer:
+			CC.respondStr("NOPEER")
+			return nil
+		case err == ErrBusy:
+			RErr = BusyErr()
+			return
+		case err != nil:
+			RErr = UnknownErr(err.Error())
+			return
+		}
+		CC.respondFD(FD)
+	case "FIND_PAIR_FAST":
+		// FIND_PAIR_FAST <endpoint id> <done>
+		// Pair before anything is sent, sending our local fd
+		// along with the response, as with FIND_PAIR_FD.
+		// NOPEER means don't bother asking again.
+		if len(Args) < 3 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		EP, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Done, err := parseInt(Args[2])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Pair, err := Ctxt.find_pair_fast(EP, Done != 0)
+		if err == ErrNoPeer {
+			CC.respondStr("NOPEER")
+			return nil
+		}
+		if err != nil {
+			RErr = UnknownErr(err.Error())
+			return
+		}
+		if Pair == EP {
+			CC.respondStr("NOPAIR")
+			return nil
+		}
+		FD, err := Ctxt.localizeFD(EP, Pair)
+		if err != nil {
+			RErr = UnknownErr(err.Error())
+			return
+		}
+		CC.respondFD(FD)
+		CC.respondInt("PAIR ", Pair)
+		if Ctxt.isRing(EP) {
+			CC.respondStr(" RING")
+		}
+		return nil
+	case "FIND_PAIR", "FIND_PAIR_FD":
+		// FIND_PAIR <endpoint id> <send_crc> <recv_crc> <done> [<sent>]
+		// FIND_PAIR_FD is the same, but once paired also localizes
+		// the pair and sends the local fd along with the response,
+		// saving separate LOCALIZE and GETLOCALFD requests.
+		// Endpoints that drain give how much they've sent over
+		// TCP, and get their pair's back: PAIR <id> <sent>.
+		// Either of the FD forms ends with RING if the local fd
+		// first carries a shared-memory ring (see ring.go).
+		if len(Args) < 5 {
+			RErr = InsufficientArgsErr()
+			return
+		}
+		EP, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		S_CRC, err := parseInt(Args[2])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		R_CRC, err := parseInt(Args[3])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		LastTry, err := parseInt(Args[4])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+		Sent := int64(-1)
+		if len(Args) > 5 {
+			Sent, err = parseInt64(Args[5])
+			if err != nil || Sent < 0 {
+				RErr = InvalidParameterErr("invalid sent mark")
+				return
+			}
+		}
+		Pair, PeerSent, err := Ctxt.find_pair_mark(EP, S_CRC, R_CRC, LastTry != 0, Sent)
+		if err == ErrNoPeer {
+			// Don't bother asking again.
+			CC.respondStr("NOPEER")
+			return nil
+		}
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
 		if Pair == EP {
-			return "NOPAIR", nil
+			CC.respondStr("NOPAIR")
+			return nil
+		}
+		if string(command) == "FIND_PAIR_FD" {
+			FD, err := Ctxt.localizeFD(EP, Pair)
+			if err != nil {
+				RErr = UnknownErr(err.Error())
+				return
+			}
+			CC.respondFD(FD)
 		}
-		return fmt.Sprintf("PAIR %d", Pair), nil
+		CC.respondInt("PAIR ", Pair)
+		if Sent >= 0 {
+			CC.respondInt(" ", int(PeerSent))
+		}
+		if string(command) == "FIND_PAIR_FD" && Ctxt.isRing(EP) {
+			CC.respondStr(" RING")
+		}
+		return nil
 	case "REREGISTER":
 		// REREGISTER EP PID FD
-		// TODO: Actually do something with PID/FD.
-		// (Esp useful when start checking caller's creds!)
-		// TODO: Consider requiring sender specifies the pid/fd of the original for verification.
-		if len(spaceDelimTokens) < 4 {
+		// Caller must own the endpoint, the new reference
+		// is pending until adopted by one of its children.
+		// The caller is known by its credentials, so PID and
+		// FD it sends are only checked to be numbers.
+		if len(Args) < 4 {
 			RErr = InsufficientArgsErr()
 			return
 		}
-		EP, err := strconv.Atoi(spaceDelimTokens[1])
+		EP, err := parseInt(Args[1])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		PID, err := strconv.Atoi(spaceDelimTokens[1])
+		PID, err := parseInt(Args[2])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
-		FD, err := strconv.Atoi(spaceDelimTokens[1])
+		FD, err := parseInt(Args[3])
 		if err != nil {
 			RErr = InvalidParameterErr(err.Error())
 			return
 		}
 
-		err = Ctxt.reregister(EP, PID, FD)
+		err = Ctxt.reregister(EP, PID, FD, CC.PID)
 		if err != nil {
 			RErr = UnknownErr(err.Error())
 			return
 		}
+	case "TAKEOVER":
+		// TAKEOVER <pid>
+		// Sent by a new ipcd, to which we hand over once
+		// this is answered (see handoff.go).
+		if CC.PID <= 0 || peerUID(CC.C) != os.Getuid() {
+			RErr = UnknownErr("not permitted")
+			return
+		}
+		CC.HandOff = true
+	case "ADOPT":
+		// ADOPT <parent pid>
+		// Sent by children after fork() to claim the
+		// references REREGISTER'd for them by their parent.
+		Parent, err := parseInt(Args[1])
+		if err != nil {
+			RErr = InvalidParameterErr(err.Error())
+			return
+		}
+
+		adopted := Ctxt.adopt(CC.PID, Parent)
+		CC.respondInt("ADOPTED ", adopted)
+		return nil
 	default:
 		RErr = &ReqError{REQ_ERR_UNRECOGNIZED_CMD, "Unrecognized command"}
 		return
@@ -0,0 +1,93 @@
+package main
+
+// Runtime settings, read from the environment at startup.
+
+import (
+	"log"
+	"os"
+	"strconv"
+	"time"
+)
+
+type Config struct {
+	// Endpoints that haven't sent ENDPOINT_INFO after this long
+	// are no longer paired.  They keep their ID (and count against
+	// their owner's limit) until unregistered or reclaimed.
+	// Zero disables this.
+	UnpairedTTL time.Duration
+	// How long references taken (by REREGISTER) for the children
+	// of an exited process are kept around for them to adopt.
+	AdoptGrace time.Duration
+	// How often to look for stale endpoints and owners.
+	SweepInterval time.Duration
+	// Maximum number of registration and pairing requests
+	// processed at once, beyond which they're refused.
+	MaxInFlight int
+	// Maximum number of endpoints registered by one process.
+	MaxClientEndpoints int
+	// Number of local transports to keep ready for use.
+	PoolSize int
+	// Connections carrying at least this many bytes (either way)
+	// are worth optimizing; history of which is used to decide
+	// how to treat new ones.  Zero disables this.
+	LearnThreshold int
+}
+
+func DefaultConfig() Config {
+	return Config{
+		UnpairedTTL:   time.Minute,
+		AdoptGrace:    10 * time.Second,
+		SweepInterval: time.Second,
+		MaxInFlight:   64,
+		// Matches libipc's endpoint table size
+		MaxClientEndpoints: 1024,
+		PoolSize:           16,
+		// Matches libipc's threshold
+		LearnThreshold: 1 << 16,
+	}
+}
+
+// Parse duration from the named environment variable,
+// keeping the default if unset or invalid.
+func envDuration(Name string, D *time.Duration) {
+	V := os.Getenv(Name)
+	if V == "" {
+		return
+	}
+	Parsed, err := time.ParseDuration(V)
+	if err != nil || Parsed < 0 {
+		log.Printf("Ignoring invalid %s='%s'\n", Name, V)
+		return
+	}
+	*D = Parsed
+}
+
+// Parse integer (at least Min) from the named environment variable,
+// keeping the default if unset or invalid.
+func envInt(Name string, N *int, Min int) {
+	V := os.Getenv(Name)
+	if V == "" {
+		return
+	}
+	Parsed, err := strconv.Atoi(V)
+	if err != nil || Parsed < Min {
+		log.Printf("Ignoring invalid %s='%s'\n", Name, V)
+		return
+	}
+	*N = Parsed
+}
+
+func LoadConfig() Config {
+	C := DefaultConfig()
+	envDuration("IPCD_UNPAIRED_TTL", &C.UnpairedTTL)
+	envDuration("IPCD_ADOPT_GRACE", &C.AdoptGrace)
+	envDuration("IPCD_SWEEP_INTERVAL", &C.SweepInterval)
+	envInt("IPCD_MAX_INFLIGHT", &C.MaxInFlight, 1)
+	envInt("IPCD_MAX_CLIENT_ENDPOINTS", &C.MaxClientEndpoints, 1)
+	envInt("IPCD_POOL_SIZE", &C.PoolSize, 0)
+	envInt("IPCD_LEARN_THRESHOLD", &C.LearnThreshold, 0)
+	if C.SweepInterval == 0 {
+		C.SweepInterval = DefaultConfig().SweepInterval
+	}
+	return C
+}
@@ -0,0 +1,253 @@
+package main
+
+// Look up TCP (and connected UDP) sockets by address using
+// NETLINK_SOCK_DIAG, giving the kernel's identity (inode) for
+// the socket on each end of a loopback connection.
+// This lets endpoints be paired by identity, not by guesswork.
+// AF_UNIX stream sockets are looked up by inode instead, the
+// kernel telling us their peer's.
+
+import (
+	"encoding/binary"
+	"errors"
+	"log"
+	"os"
+	"sync"
+	"syscall"
+)
+
+const (
+	NETLINK_SOCK_DIAG   = 4
+	SOCK_DIAG_BY_FAMILY = 20
+	// Don't check the socket cookie
+	INET_DIAG_NOCOOKIE = ^uint32(0)
+
+	// sizeof(struct inet_diag_req_v2)
+	INET_DIAG_REQ_V2_LEN = 56
+	// offsetof(struct inet_diag_msg, id.idiag_dport)
+	INET_DIAG_MSG_DPORT_OFF = 6
+	// offsetof(struct inet_diag_msg, idiag_inode)
+	INET_DIAG_MSG_INODE_OFF = 68
+
+	// sizeof(struct unix_diag_req)
+	UNIX_DIAG_REQ_LEN = 24
+	// sizeof(struct unix_diag_msg)
+	UNIX_DIAG_MSG_LEN = 16
+	UDIAG_SHOW_PEER   = 0x4
+	UNIX_DIAG_PEER    = 2
+)
+
+// No socket with the given addresses (in our network namespace).
+var ErrNoSocket = errors.New("no such socket")
+
+// Endpoint is connected to a socket that isn't local,
+// so will never find its pair.
+var ErrNoPeer = errors.New("peer is not local")
+
+type SockDiag struct {
+	Lock sync.Mutex
+	FD   int
+	Seq  uint32
+	Req  [syscall.NLMSG_HDRLEN + INET_DIAG_REQ_V2_LEN]byte
+	Resp [8192]byte
+}
+
+func NewSockDiag() (*SockDiag, error) {
+	FD, err := syscall.Socket(syscall.AF_NETLINK, syscall.SOCK_DGRAM|syscall.SOCK_CLOEXEC, NETLINK_SOCK_DIAG)
+	if err != nil {
+		return nil, os.NewSyscallError("socket", err)
+	}
+	if err := syscall.Bind(FD, &syscall.SockaddrNetlink{Family: syscall.AF_NETLINK}); err != nil {
+		syscall.Close(FD)
+		return nil, os.NewSyscallError("bind", err)
+	}
+	return &SockDiag{FD: FD}, nil
+}
+
+// Fill in address for inet_diag_sockid.
+func putDiagAddr(b []byte, IP [16]byte, IsV4 bool) {
+	if IsV4 {
+		copy(b, IP[12:])
+	} else {
+		copy(b, IP[:])
+	}
+}
+
+func isV4Mapped(IP [16]byte) bool {
+	for _, c := range IP[:10] {
+		if c != 0 {
+			return false
+		}
+	}
+	return IP[10] == 0xff && IP[11] == 0xff
+}
+
+// Find inode of the TCP socket with the given local and remote
+// addresses.  Sockets not yet accepted have inode 0.
+func (D *SockDiag) tcpInode(Src, Dst NetAddr) (uint32, error) {
+	return D.inode(syscall.IPPROTO_TCP, Src, Dst)
+}
+
+// Same for UDP, only finding sockets connected to Dst: the
+// kernel also gives one that merely receives from it, which
+// isn't talking to it (and won't be pairing).
+func (D *SockDiag) udpInode(Src, Dst NetAddr) (uint32, error) {
+	return D.inode(syscall.IPPROTO_UDP, Src, Dst)
+}
+
+func (D *SockDiag) inode(Proto uint8, Src, Dst NetAddr) (uint32, error) {
+	D.Lock.Lock()
+	defer D.Lock.Unlock()
+
+	NE := binary.NativeEndian
+	BE := binary.BigEndian
+
+	// struct inet_diag_req_v2
+	Req := D.request(INET_DIAG_REQ_V2_LEN)
+	R := Req[syscall.NLMSG_HDRLEN:]
+	IsV4 := isV4Mapped(Src.IP) && isV4Mapped(Dst.IP)
+	if IsV4 {
+		R[0] = syscall.AF_INET
+	} else {
+		R[0] = syscall.AF_INET6
+	}
+	R[1] = Proto
+	NE.PutUint32(R[4:], ^uint32(0)) // all states
+	// struct inet_diag_sockid
+	ID := R[8:]
+	BE.PutUint16(ID[0:], uint16(Src.Port))
+	BE.PutUint16(ID[2:], uint16(Dst.Port))
+	putDiagAddr(ID[4:20], Src.IP, IsV4)
+	putDiagAddr(ID[20:36], Dst.IP, IsV4)
+	NE.PutUint32(ID[40:], INET_DIAG_NOCOOKIE)
+	NE.PutUint32(ID[44:], INET_DIAG_NOCOOKIE)
+
+	Msg, err := D.query(Req)
+	if err != nil {
+		return 0, err
+	}
+	if len(Msg) < INET_DIAG_MSG_INODE_OFF+4 {
+		return 0, errors.New("short inet_diag_msg")
+	}
+	if BE.Uint16(Msg[INET_DIAG_MSG_DPORT_OFF:]) != uint16(Dst.Port) {
+		return 0, ErrNoSocket
+	}
+	return NE.Uint32(Msg[INET_DIAG_MSG_INODE_OFF:]), nil
+}
+
+// Find inode of the peer of the AF_UNIX stream socket with the
+// given inode.  ErrNoSocket if there's no such socket, or it
+// isn't connected (any more).
+func (D *SockDiag) unixPeer(Inode uint32) (uint32, error) {
+	D.Lock.Lock()
+	defer D.Lock.Unlock()
+
+	NE := binary.NativeEndian
+
+	// struct unix_diag_req
+	Req := D.request(UNIX_DIAG_REQ_LEN)
+	R := Req[syscall.NLMSG_HDRLEN:]
+	R[0] = syscall.AF_UNIX
+	NE.PutUint32(R[4:], ^uint32(0)) // all states
+	NE.PutUint32(R[8:], Inode)
+	NE.PutUint32(R[12:], UDIAG_SHOW_PEER)
+	NE.PutUint32(R[16:], INET_DIAG_NOCOOKIE)
+	NE.PutUint32(R[20:], INET_DIAG_NOCOOKIE)
+
+	Msg, err := D.query(Req)
+	if err != nil {
+		return 0, err
+	}
+	if len(Msg) < UNIX_DIAG_MSG_LEN {
+		return 0, errors.New("short unix_diag_msg")
+	}
+	if Msg[1] != syscall.SOCK_STREAM || NE.Uint32(Msg[4:]) != Inode {
+		return 0, ErrNoSocket
+	}
+	// Attributes follow, struct rtattr each.
+	for A := Msg[UNIX_DIAG_MSG_LEN:]; len(A) >= 4; {
+		Len := int(NE.Uint16(A[0:]))
+		if Len < 4 || Len > len(A) {
+			break
+		}
+		if NE.Uint16(A[2:]) == UNIX_DIAG_PEER && Len >= 8 {
+			return NE.Uint32(A[4:]), nil
+		}
+		Len = (Len + syscall.RTA_ALIGNTO - 1) &^ (syscall.RTA_ALIGNTO - 1)
+		if Len > len(A) {
+			break
+		}
+		A = A[Len:]
+	}
+	return 0, ErrNoSocket
+}
+
+// Start a request with a zeroed body of the given length.
+// Must hold Lock.
+func (D *SockDiag) request(Len int) []byte {
+	NE := binary.NativeEndian
+	D.Seq++
+
+	// struct nlmsghdr
+	Req := D.Req[:syscall.NLMSG_HDRLEN+Len]
+	for i := range Req {
+		Req[i] = 0
+	}
+	NE.PutUint32(Req[0:], uint32(len(Req)))
+	NE.PutUint16(Req[4:], SOCK_DIAG_BY_FAMILY)
+	NE.PutUint16(Req[6:], syscall.NLM_F_REQUEST)
+	NE.PutUint32(Req[8:], D.Seq)
+	return Req
+}
+
+// Send request, returning the message the kernel answers with.
+// Must hold Lock.
+func (D *SockDiag) query(Req []byte) ([]byte, error) {
+	NE := binary.NativeEndian
+
+	if err := syscall.Sendto(D.FD, Req, 0, &syscall.SockaddrNetlink{Family: syscall.AF_NETLINK}); err != nil {
+		return nil, os.NewSyscallError("sendto", err)
+	}
+
+	for {
+		n, _, err := syscall.Recvfrom(D.FD, D.Resp[:], 0)
+		if err != nil {
+			return nil, os.NewSyscallError("recvfrom", err)
+		}
+		Msgs, err := syscall.ParseNetlinkMessage(D.Resp[:n])
+		if err != nil {
+			return nil, err
+		}
+		for _, M := range Msgs {
+			if M.Header.Seq != D.Seq {
+				// Stale response to an earlier request
+				continue
+			}
+			switch M.Header.Type {
+			case syscall.NLMSG_ERROR:
+				if len(M.Data) < 4 {
+					return nil, errors.New("short netlink error")
+				}
+				Errno := syscall.Errno(-int32(NE.Uint32(M.Data)))
+				if Errno == syscall.ENOENT {
+					return nil, ErrNoSocket
+				}
+				return nil, os.NewSyscallError("sock_diag", Errno)
+			case SOCK_DIAG_BY_FAMILY:
+				return M.Data, nil
+			}
+		}
+	}
+}
+
+// Use sock_diag to pair endpoints by their sockets' identity, if we can.
+func (C *IPCContext) startSockDiag() {
+	D, err := NewSockDiag()
+	if err != nil {
+		log.Printf("Unable to look up sockets, pairing by address only: %s\n", err.Error())
+		return
+	}
+	C.SockLookup = D.tcpInode
+	C.DgramLookup = D.udpInode
+	C.UnixLookup = D.unixPeer
+}
@@ -0,0 +1,458 @@
+package main
+
+// Hot restart: a new ipcd started with IPCD_TAKEOVER set, finding
+// one already running, asks it to hand over (TAKEOVER) instead of
+// giving up.  The running ipcd stops serving (clients finish their
+// current request and are disconnected, to reconnect and carry on
+// with its successor) and sends its state: a snapshot of the
+// registry in an unlinked file, the listening socket, and the local
+// fds held by its endpoints.  Once the successor has all of it,
+// the old ipcd exits, and the new one serves on the same socket,
+// with the same endpoint ID's.
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/gob"
+	"errors"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// Set to take over from a running ipcd, rather than exit.
+const TAKEOVER_ENV = "IPCD_TAKEOVER"
+
+// Bound on handing over, including waiting for the old ipcd to exit.
+const HANDOFF_TIMEOUT = 10 * time.Second
+
+// Descriptors sent per message, below the kernel's SCM_MAX_FD.
+const HANDOFF_BATCH = 250
+
+// Client connections being served, so they can be wound
+// down when handing over to a successor.
+type ClientSet struct {
+	Lock     sync.Mutex
+	Listener net.Listener
+	Conns    map[net.Conn]bool
+	Active   sync.WaitGroup
+	// Handing over: no new connections are served,
+	// and Resume is closed if that fails.
+	Stopping bool
+	Resume   chan struct{}
+}
+
+func (S *ClientSet) init() {
+	S.Conns = make(map[net.Conn]bool)
+}
+
+func (S *ClientSet) setListener(ln net.Listener) {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	S.Listener = ln
+}
+
+// Start serving the given connection, false if we're handing over.
+func (S *ClientSet) add(C net.Conn) bool {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	if S.Stopping {
+		return false
+	}
+	S.Conns[C] = true
+	S.Active.Add(1)
+	return true
+}
+
+// Done serving the given connection, if we were.
+func (S *ClientSet) remove(C net.Conn) {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	if S.Conns[C] {
+		delete(S.Conns, C)
+		S.Active.Done()
+	}
+}
+
+// Channel to wait on before accepting again, nil if not handing over.
+func (S *ClientSet) paused() chan struct{} {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	if !S.Stopping {
+		return nil
+	}
+	return S.Resume
+}
+
+// Stop accepting clients, and wait for those connected to finish
+// the request they're on: they're disconnected once answered.
+// False if already handing over.
+func (S *ClientSet) stop() bool {
+	S.Lock.Lock()
+	if S.Stopping {
+		S.Lock.Unlock()
+		return false
+	}
+	S.Stopping = true
+	S.Resume = make(chan struct{})
+	if UL, ok := S.Listener.(*net.UnixListener); ok {
+		UL.SetDeadline(time.Now())
+	}
+	for C := range S.Conns {
+		C.SetReadDeadline(time.Now())
+	}
+	S.Lock.Unlock()
+
+	S.Active.Wait()
+	return true
+}
+
+// Serve clients again, after failing to hand over.
+func (S *ClientSet) resume() {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	S.Stopping = false
+	if UL, ok := S.Listener.(*net.UnixListener); ok {
+		UL.SetDeadline(time.Time{})
+	}
+	close(S.Resume)
+}
+
+// Copy of the listening socket, to send to our successor.
+func (S *ClientSet) listenerFile() (*os.File, error) {
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	UL, ok := S.Listener.(*net.UnixListener)
+	if !ok {
+		return nil, errors.New("listener can't be handed over")
+	}
+	return UL.File()
+}
+
+// Owner of endpoint references, as handed over.
+type OwnerState struct {
+	Refs    map[EPRef]int32
+	Pending map[EPRef]int32
+	Exited  int64
+}
+
+// Registry as handed over.  Pairing indexes aren't included,
+// they're rebuilt from the endpoints.
+type Snapshot struct {
+	// Endpoints in use, their LocalFD being the index of
+	// the descriptor sent for it (-1 if none).
+	Endpoints []EndPointInfo
+	// Generation of every slot, so references to endpoints
+	// since removed can't match one reusing the slot.
+	Gens     []uint32
+	Owners   map[int]OwnerState
+	Services map[ServiceKey]ServiceStats
+	// Local fds sent, after the snapshot and listener.
+	NumFDs int
+}
+
+// What our predecessor handed us.
+type Handoff struct {
+	State    Snapshot
+	Listener net.Listener
+	LocalFDs []int
+}
+
+// Take every lock guarding our state, so it holds still.
+func (C *IPCContext) freeze() {
+	C.PairLock.Lock()
+	for i := range C.Shards {
+		C.Shards[i].Lock.Lock()
+	}
+	C.IDs.Lock.Lock()
+	C.Owners.Lock.Lock()
+	C.Learner.Lock.Lock()
+}
+
+func (C *IPCContext) thaw() {
+	C.Learner.Lock.Unlock()
+	C.Owners.Lock.Unlock()
+	C.IDs.Lock.Unlock()
+	for i := range C.Shards {
+		C.Shards[i].Lock.Unlock()
+	}
+	C.PairLock.Unlock()
+}
+
+// Snapshot of our state, and the local fds it refers to.
+// Must be frozen.
+func (C *IPCContext) snapshot() (*Snapshot, []int) {
+	S := &Snapshot{
+		Gens:     make([]uint32, len(C.IDs.InUse)),
+		Owners:   make(map[int]OwnerState, len(C.Owners.Procs)),
+		Services: make(map[ServiceKey]ServiceStats, len(C.Learner.Services)),
+	}
+	var FDs []int
+	for ID := range S.Gens {
+		EPI := C.Slab.find(ID)
+		if EPI == nil {
+			continue
+		}
+		S.Gens[ID] = EPI.Gen
+		if !EPI.InUse {
+			continue
+		}
+		E := *EPI
+		if E.LocalFD != -1 {
+			FDs = append(FDs, E.LocalFD)
+			E.LocalFD = len(FDs) - 1
+		}
+		S.Endpoints = append(S.Endpoints, E)
+	}
+	for PID, R := range C.Owners.Procs {
+		S.Owners[PID] = OwnerState{R.Refs, R.Pending, R.Exited}
+	}
+	for K, V := range C.Learner.Services {
+		S.Services[K] = *V
+	}
+	S.NumFDs = len(FDs)
+	return S, FDs
+}
+
+// Pick up where our predecessor left off, given the local fds
+// it sent.  Must be done before serving anyone.
+func (C *IPCContext) restore(S *Snapshot, FDs []int) {
+	C.IDs.InUse = make([]bool, len(S.Gens))
+	for ID, Gen := range S.Gens {
+		if Gen != 0 {
+			C.Slab.slot(ID).Gen = Gen
+		}
+	}
+	for _, E := range S.Endpoints {
+		if E.ID < 0 || int(E.ID) >= len(S.Gens) {
+			continue
+		}
+		if E.LocalFD >= 0 && E.LocalFD < len(FDs) {
+			E.LocalFD = FDs[E.LocalFD]
+		} else {
+			E.LocalFD = -1
+		}
+		// Our policy may not be our predecessor's.
+		E.Rule = -1
+		*C.Slab.slot(int(E.ID)) = E
+		C.IDs.InUse[E.ID] = true
+
+		switch {
+		case E.Listening:
+			C.Listeners[E.Src] = E.ID
+		case E.Src.isValid():
+			Key := PairKey{E.Src, E.Dst}
+			C.PairIndex[Key] = append(C.PairIndex[Key], E.ID)
+		}
+		if E.Inode != 0 {
+			C.Inodes[E.Inode] = E.ID
+		}
+	}
+	for C.IDs.FreeID < len(C.IDs.InUse) && C.IDs.InUse[C.IDs.FreeID] {
+		C.IDs.FreeID++
+	}
+
+	for PID, O := range S.Owners {
+		R := &OwnerRecord{-1, O.Refs, O.Pending, O.Exited}
+		if R.Refs == nil {
+			R.Refs = make(map[EPRef]int32)
+		}
+		if R.Pending == nil {
+			R.Pending = make(map[EPRef]int32)
+		}
+		C.Owners.Procs[PID] = R
+	}
+	for K, V := range S.Services {
+		V := V
+		C.Learner.Services[K] = &V
+	}
+	log.Printf("Took over %d endpoint(s), %d local fd(s)\n", len(S.Endpoints), len(FDs))
+}
+
+// Send descriptors, a batch per message.
+func sendFDs(UC *net.UnixConn, FDs []int) error {
+	for len(FDs) > 0 {
+		N := len(FDs)
+		if N > HANDOFF_BATCH {
+			N = HANDOFF_BATCH
+		}
+		Rights := syscall.UnixRights(FDs[:N]...)
+		n, oobn, err := UC.WriteMsgUnix([]byte{0}, Rights, nil)
+		if err != nil {
+			return err
+		}
+		if n != 1 || oobn != len(Rights) {
+			return errors.New(fmt.Sprintf("WriteMsgUnix = %d, %d; want 1, %d", n, oobn, len(Rights)))
+		}
+		FDs = FDs[N:]
+	}
+	return nil
+}
+
+// Send our state to our successor: first the snapshot file and
+// listener, then the local fds.  Nothing changes meanwhile.
+func (C *IPCContext) sendState(UC *net.UnixConn) error {
+	Listener, err := C.Clients.listenerFile()
+	if err != nil {
+		return err
+	}
+	defer Listener.Close()
+
+	F, err := os.CreateTemp("", "ipcd-snapshot")
+	if err != nil {
+		return err
+	}
+	os.Remove(F.Name())
+	defer F.Close()
+
+	C.freeze()
+	defer C.thaw()
+
+	S, FDs := C.snapshot()
+	W := bufio.NewWriter(F)
+	if err := gob.NewEncoder(W).Encode(S); err != nil {
+		return err
+	}
+	if err := W.Flush(); err != nil {
+		return err
+	}
+	if err := sendFDs(UC, []int{int(F.Fd()), int(Listener.Fd())}); err != nil {
+		return err
+	}
+	return sendFDs(UC, FDs)
+}
+
+// Hand over to the successor that asked (TAKEOVER) on the given
+// connection, exiting once it has everything.  If anything goes
+// wrong we carry on serving, clients reconnecting as needed.
+func (C *IPCContext) handOff(CC *ClientConn) {
+	UC, ok := CC.C.(*net.UnixConn)
+	if !ok || !C.Clients.stop() {
+		log.Printf("Unable to hand over, already handing over?\n")
+		return
+	}
+	log.Printf("Handing over to successor (pid %d)...\n", CC.PID)
+
+	UC.SetDeadline(time.Now().Add(HANDOFF_TIMEOUT))
+	err := C.sendState(UC)
+	if err == nil {
+		// Successor acknowledges once it has it all.
+		var Ack [1]byte
+		_, err = UC.Read(Ack[:])
+	}
+	if err != nil {
+		log.Printf("Failed to hand over, resuming: %s\n", err.Error())
+		C.Clients.resume()
+		return
+	}
+
+	log.Printf("Handed over, exiting\n")
+	os.Exit(0)
+}
+
+// Descriptors attached to a message.
+func parseRights(OOB []byte) ([]int, error) {
+	Msgs, err := syscall.ParseSocketControlMessage(OOB)
+	if err != nil {
+		return nil, err
+	}
+	var FDs []int
+	for i := range Msgs {
+		Got, err := syscall.ParseUnixRights(&Msgs[i])
+		if err != nil {
+			return FDs, err
+		}
+		FDs = append(FDs, Got...)
+	}
+	return FDs, nil
+}
+
+func closeFDs(FDs []int) {
+	for _, FD := range FDs {
+		syscall.Close(FD)
+	}
+}
+
+func readSnapshot(FD int, S *Snapshot) error {
+	F := os.NewFile(uintptr(FD), "snapshot")
+	defer F.Close()
+	if _, err := F.Seek(0, 0); err != nil {
+		return err
+	}
+	return gob.NewDecoder(bufio.NewReader(F)).Decode(S)
+}
+
+// Ask the running ipcd to hand over to us, returning what it sent.
+// It exits once we acknowledge, releasing our lock file.
+func takeOver() (*Handoff, error) {
+	Conn, err := net.Dial("unix", SOCKET_PATH)
+	if err != nil {
+		return nil, err
+	}
+	defer Conn.Close()
+	UC := Conn.(*net.UnixConn)
+	UC.SetDeadline(time.Now().Add(HANDOFF_TIMEOUT))
+	if _, err := fmt.Fprintf(UC, "TAKEOVER %d\n", os.Getpid()); err != nil {
+		return nil, err
+	}
+
+	H := &Handoff{}
+	var Resp []byte
+	var FDs []int
+	Want := -1
+	Buf := make([]byte, 64)
+	OOB := make([]byte, syscall.CmsgSpace(HANDOFF_BATCH*4))
+	for Want == -1 || len(FDs) < Want {
+		n, oobn, _, _, err := UC.ReadMsgUnix(Buf, OOB)
+		if err == nil {
+			var Got []int
+			Got, err = parseRights(OOB[:oobn])
+			FDs = append(FDs, Got...)
+		}
+		if err != nil {
+			closeFDs(FDs)
+			return nil, err
+		}
+		// Only the response line matters, the rest is filler.
+		Resp = append(Resp, Buf[:n]...)
+		if NL := bytes.IndexByte(Resp, '\n'); NL != -1 && !bytes.HasPrefix(Resp, []byte("200 ")) {
+			closeFDs(FDs)
+			return nil, errors.New(string(Resp[:NL]))
+		}
+		if Want == -1 && len(FDs) >= 2 {
+			err := readSnapshot(FDs[0], &H.State)
+			FDs[0] = -1
+			if err != nil {
+				closeFDs(FDs)
+				return nil, err
+			}
+			Want = 2 + H.State.NumFDs
+		}
+	}
+
+	F := os.NewFile(uintptr(FDs[1]), "listener")
+	H.Listener, err = net.FileListener(F)
+	F.Close()
+	if err != nil {
+		closeFDs(FDs[2:])
+		return nil, err
+	}
+	H.LocalFDs = FDs[2:]
+
+	if _, err := UC.Write([]byte("OK\n")); err != nil {
+		H.Listener.Close()
+		closeFDs(H.LocalFDs)
+		return nil, err
+	}
+	return H, nil
+}
@@ -1,23 +1,50 @@
 package main
 
-import "os"
-import "fmt"
+import (
+	"fmt"
+	"net"
+	"os"
+)
 
 // Server entry point
 
-func StartServer() {
-	Context := NewContext()
-	listenForClients(Context)
+// Serve with what our predecessor handed us, if any.
+func StartServer(H *Handoff, P Policy) {
+	Context := NewContext(LoadConfig())
+	Context.Policy = P
+	var Listener net.Listener
+	if H != nil {
+		Context.restore(&H.State, H.LocalFDs)
+		Listener = H.Listener
+	}
+	Context.startSockDiag()
+	Context.startReclaimer()
+	Context.Transports.start()
+	listenForClients(Context, Listener)
 }
 
 func main() {
 	// TODO: Proper daemonification (per APUE book or equiv)
+	P, err := LoadPolicy(os.Getenv(POLICY_ENV))
+	if err != nil {
+		fmt.Println("Unable to load policy:", err)
+		os.Exit(1)
+	}
 	LockFile := OpenLock()
+	var H *Handoff
+	if LockFile == nil && os.Getenv(TAKEOVER_ENV) != "" {
+		H, err = takeOver()
+		if err != nil {
+			fmt.Println("Unable to take over from running ipcd:", err)
+			os.Exit(1)
+		}
+		LockFile = WaitLock(HANDOFF_TIMEOUT)
+	}
 	if LockFile == nil {
 		fmt.Println("Unable to open lock file, ipcd already running?")
 		os.Exit(1)
 	}
 	defer CleanupLock(LockFile)
 
-	StartServer()
+	StartServer(H, P)
 }
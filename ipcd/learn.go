@@ -0,0 +1,220 @@
+package main
+
+// Learned optimization policy: how much connections to each of
+// our listeners carry, by client program, decides whether
+// tracking and pairing them is worth the trouble.
+// Connections that (nearly) never reach the threshold aren't
+// tracked at all, those that (nearly) always do are paired
+// before sending anything, when possible.
+
+import (
+	"bytes"
+	"os"
+	"strconv"
+	"sync"
+)
+
+// Program name, as in /proc/<pid>/comm.
+// Fixed-size so endpoints can hold it without a pointer.
+type ProgName [16]byte
+
+// Name of the given process, empty if unknown.
+func progName(PID int) ProgName {
+	var Name ProgName
+	if PID <= 0 {
+		return Name
+	}
+	B, err := os.ReadFile("/proc/" + strconv.Itoa(PID) + "/comm")
+	if err != nil {
+		return Name
+	}
+	copy(Name[:], bytes.TrimRight(B, "\n"))
+	return Name
+}
+
+// Listener address and the program connecting to it.
+type ServiceKey struct {
+	Addr NetAddr
+	Prog ProgName
+}
+
+type ServiceStats struct {
+	// Connections seen, and how many reached the threshold.
+	// Halved now and then so old history fades.
+	Conns uint32
+	Large uint32
+	// Times told to skip, so every so often one isn't.
+	Skipped uint32
+}
+
+// Hints given in response to ENDPOINT_INFO.
+const (
+	HINT_NONE = iota
+	// Pair before sending anything (FIND_PAIR_FAST)
+	HINT_FAST
+	// Don't bother tracking or pairing
+	HINT_SKIP
+)
+
+// What history says to do with a connection.
+const (
+	POLICY_UNKNOWN = iota
+	POLICY_THRESHOLD
+	POLICY_FAST
+	POLICY_SKIP
+)
+
+const (
+	// Connections seen before history is trusted
+	LEARN_MIN_CONNS = 8
+	// Beyond this, counts are halved
+	LEARN_MAX_CONNS = 64
+	// One in this many connections told to skip isn't,
+	// so we notice if things change.
+	LEARN_EXPLORE = 16
+	// Services tracked, more are ignored
+	LEARN_MAX_SERVICES = 4096
+)
+
+type Learner struct {
+	Lock     sync.Mutex
+	Services map[ServiceKey]*ServiceStats
+}
+
+func (L *Learner) init() {
+	L.Services = make(map[ServiceKey]*ServiceStats)
+}
+
+// Policy for a new connection to the given service.
+func (L *Learner) policy(K ServiceKey) int {
+	L.Lock.Lock()
+	defer L.Lock.Unlock()
+
+	S := L.Services[K]
+	if S == nil || S.Conns < LEARN_MIN_CONNS {
+		return POLICY_UNKNOWN
+	}
+	switch {
+	case S.Large*10 < S.Conns:
+		S.Skipped++
+		if S.Skipped%LEARN_EXPLORE == 0 {
+			return POLICY_THRESHOLD
+		}
+		return POLICY_SKIP
+	case S.Large*10 >= S.Conns*9:
+		return POLICY_FAST
+	}
+	return POLICY_THRESHOLD
+}
+
+// Note how a connection to the given service went.
+func (L *Learner) record(K ServiceKey, Large bool) {
+	L.Lock.Lock()
+	defer L.Lock.Unlock()
+
+	S := L.Services[K]
+	if S == nil {
+		if len(L.Services) >= LEARN_MAX_SERVICES {
+			return
+		}
+		S = &ServiceStats{}
+		L.Services[K] = S
+	}
+	S.Conns++
+	if Large {
+		S.Large++
+	}
+	if S.Conns >= LEARN_MAX_CONNS {
+		S.Conns /= 2
+		S.Large /= 2
+	}
+}
+
+// Our peer's endpoint, if known and it has sent its info.
+// Must hold PairLock.
+func (C *IPCContext) infoPeer(EPI *EndPointInfo) *EndPointInfo {
+	if EPI.PeerInode == 0 {
+		return nil
+	}
+	k, ok := C.Inodes[EPI.PeerInode]
+	if !ok {
+		return nil
+	}
+	v := C.lookup(int(k))
+	if v == nil || (!v.Src.isValid() && !v.Unix) {
+		return nil
+	}
+	return v
+}
+
+// Decide how to treat a newly connected endpoint.
+// If our peer has already been told, do the same so both ends
+// agree; otherwise go by the policy rule for it, if any, and
+// how connections from this program to the listener went before:
+// until there's enough of that, they wait for the threshold.
+// Pairing first thing (Fast) also needs the peer's identity to be
+// known (CanFast), and is what connections to our listeners we
+// aren't learning about get.
+// Must hold PairLock.
+func (C *IPCContext) choosePolicy(EPI *EndPointInfo, CanFast bool, Prog ProgName) {
+	if !EPI.IsAccept && !EPI.Dgram && !EPI.Unix && C.Config.LearnThreshold > 0 {
+		if ID := C.listenerFor(EPI.Dst); ID != -1 {
+			if L := C.lookup(int(ID)); L != nil {
+				EPI.Service = ServiceKey{L.Src, Prog}
+				EPI.Learn = true
+			}
+		}
+	}
+
+	if Peer := C.infoPeer(EPI); Peer != nil {
+		EPI.Fast = CanFast && Peer.Fast
+		EPI.Skip = Peer.Skip
+		EPI.Rule = Peer.Rule
+	} else {
+		Policy := POLICY_UNKNOWN
+		if EPI.Learn {
+			Policy = C.Learner.policy(EPI.Service)
+		}
+		Server := EPI.Dst
+		if EPI.IsAccept {
+			Server = EPI.Src
+		}
+		EPI.Rule = C.Policy.match(Server, Prog)
+		if R := C.Policy.rule(EPI.Rule); R != nil {
+			switch R.Enable {
+			case RULE_ON:
+				if Policy == POLICY_SKIP {
+					Policy = POLICY_THRESHOLD
+				}
+			case RULE_OFF:
+				Policy = POLICY_SKIP
+			}
+		}
+		EPI.Fast = CanFast && (Policy == POLICY_FAST || (Policy == POLICY_UNKNOWN && !EPI.Learn))
+		EPI.Skip = Policy == POLICY_SKIP
+	}
+	// Skipped endpoints don't count what they carry.
+	EPI.Learn = EPI.Learn && !EPI.Skip
+}
+
+// Record how much an endpoint carried (sent and received),
+// if it's one we're learning from.  Only done once.
+// What's worth optimizing goes by the threshold it was given,
+// or the client saying it got far enough some other way (Due).
+func (C *IPCContext) learn(ID int, Sent, Recv int64, Due bool) {
+	C.PairLock.Lock()
+	EPI := C.lookup(ID)
+	if EPI == nil || !EPI.Learn {
+		C.PairLock.Unlock()
+		return
+	}
+	EPI.Learn = false
+	Key := EPI.Service
+	T := int64(C.Config.LearnThreshold)
+	if R := C.Policy.rule(EPI.Rule); R != nil && R.Threshold != 0 {
+		T = int64(R.Threshold)
+	}
+	C.PairLock.Unlock()
+
+	C.Learner.record(Key, Due || Sent >= T || Recv >= T)
+}
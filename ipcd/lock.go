@@ -3,6 +3,7 @@ package main
 import (
 	"os"
 	"syscall"
+	"time"
 )
 
 const LOCKFILE = "/tmp/ipcd.pid"
@@ -30,6 +31,17 @@ func OpenLock() *os.File {
 	return F
 }
 
+// OpenLock, waiting up to Timeout for whoever holds it.
+func WaitLock(Timeout time.Duration) *os.File {
+	Deadline := time.Now().Add(Timeout)
+	for {
+		if F := OpenLock(); F != nil || time.Now().After(Deadline) {
+			return F
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
+
 func CleanupLock(F *os.File) {
 	defer F.Close()
 
@@ -0,0 +1,333 @@
+package main
+
+// Track which processes hold references to endpoints,
+// so that when a process goes away (however it goes away)
+// its references are dropped and its endpoints reclaimed.
+//
+// Owners are identified by the credentials of the client
+// connection (SO_PEERCRED), not by what they claim to be.
+// Process exit is noticed using a pidfd for each owner,
+// or by polling if pidfds aren't supported.
+
+import (
+	"log"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// pidfd_open(2), not (yet) in the syscall package.
+const SYS_PIDFD_OPEN = 434
+
+// A particular registration of an endpoint.
+// The generation guards against the ID having been reused.
+type EPRef struct {
+	ID  int32
+	Gen uint32
+}
+
+// Link to no endpoint.
+var NoRef = EPRef{-1, 0}
+
+func (R EPRef) isValid() bool {
+	return R.ID != -1
+}
+
+type OwnerRecord struct {
+	// pidfd for the process, -1 if not watched that way.
+	PIDFD int
+	// References held on endpoints.
+	Refs map[EPRef]int32
+	// References taken (by REREGISTER before fork) on behalf
+	// of children that have not yet adopted them.
+	Pending map[EPRef]int32
+	// When the process exited (ns), zero if still running.
+	// Records with pending references outlive their process
+	// for a while, so its children can still adopt them.
+	Exited int64
+}
+
+// Lock order: shard locks before Lock.
+type OwnerTable struct {
+	Lock  sync.Mutex
+	Procs map[int]*OwnerRecord
+	// epoll instance watching the pidfds of owners,
+	// -1 if not (yet) available.
+	EpollFD int
+}
+
+func (O *OwnerTable) init() {
+	O.Procs = make(map[int]*OwnerRecord)
+	O.EpollFD = -1
+}
+
+// Find record for the given (running) process, creating it if needed.
+// Must hold O.Lock.
+func (O *OwnerTable) record(PID int) *OwnerRecord {
+	R := O.Procs[PID]
+	if R == nil {
+		R = &OwnerRecord{-1, make(map[EPRef]int32), make(map[EPRef]int32), 0}
+		O.Procs[PID] = R
+	}
+	if R.Exited != 0 {
+		// PID reused by a new process.
+		R.Exited = 0
+	}
+	if R.PIDFD == -1 && O.EpollFD != -1 {
+		O.watch(PID, R)
+	}
+	return R
+}
+
+// Start watching for exit of the given process.
+// On failure the record is left for the sweeper to poll.
+// Must hold O.Lock.
+func (O *OwnerTable) watch(PID int, R *OwnerRecord) {
+	FD, _, errno := syscall.Syscall(SYS_PIDFD_OPEN, uintptr(PID), 0, 0)
+	if errno != 0 {
+		return
+	}
+	Event := syscall.EpollEvent{Events: syscall.EPOLLIN, Fd: int32(PID)}
+	if err := syscall.EpollCtl(O.EpollFD, syscall.EPOLL_CTL_ADD, int(FD), &Event); err != nil {
+		syscall.Close(int(FD))
+		return
+	}
+	R.PIDFD = int(FD)
+}
+
+// May the given process register another endpoint?
+func (O *OwnerTable) admit(PID int, Max int) bool {
+	if PID <= 0 {
+		return true
+	}
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	R := O.Procs[PID]
+	return R == nil || len(R.Refs) < Max
+}
+
+// Record reference held by the given process.
+// Non-positive PID's are unknown owners, and not tracked.
+func (O *OwnerTable) addRef(PID int, Ref EPRef) {
+	if PID <= 0 {
+		return
+	}
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	O.record(PID).Refs[Ref]++
+}
+
+// Record reference taken by the given process for its children.
+func (O *OwnerTable) addPending(PID int, Ref EPRef) {
+	if PID <= 0 {
+		return
+	}
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	O.record(PID).Pending[Ref]++
+}
+
+func decrement(M map[EPRef]int32, Ref EPRef) bool {
+	N := M[Ref]
+	if N == 0 {
+		return false
+	}
+	if N == 1 {
+		delete(M, Ref)
+	} else {
+		M[Ref] = N - 1
+	}
+	return true
+}
+
+// Does the given process hold a reference to this endpoint?
+func (O *OwnerTable) holds(PID int, Ref EPRef) bool {
+	if PID <= 0 {
+		return true
+	}
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	R := O.Procs[PID]
+	return R != nil && (R.Refs[Ref] > 0 || R.Pending[Ref] > 0)
+}
+
+// Drop a reference held by the given process,
+// returning false if it doesn't hold one.
+func (O *OwnerTable) dropRef(PID int, Ref EPRef) bool {
+	if PID <= 0 {
+		return true
+	}
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	R := O.Procs[PID]
+	if R == nil {
+		return false
+	}
+	return decrement(R.Refs, Ref) || decrement(R.Pending, Ref)
+}
+
+// Transfer references pending for children of Parent to Child.
+// If a process forks several children at once, the first
+// to adopt gets them all, which only affects which
+// process's exit releases them.
+func (O *OwnerTable) adopt(Child, Parent int) int {
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	P := O.Procs[Parent]
+	if P == nil || Child <= 0 || Child == Parent {
+		return 0
+	}
+	C := O.record(Child)
+	Count := 0
+	for Ref, N := range P.Pending {
+		C.Refs[Ref] += N
+		Count += int(N)
+		delete(P.Pending, Ref)
+	}
+	if P.Exited != 0 {
+		delete(O.Procs, Parent)
+	}
+	return Count
+}
+
+type OwnedRefs struct {
+	Ref EPRef
+	N   int32
+}
+
+// Note exit of the given process, returning the
+// references it held that should now be dropped.
+func (O *OwnerTable) exited(PID int, Now int64) []OwnedRefs {
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	R := O.Procs[PID]
+	if R == nil || R.Exited != 0 {
+		return nil
+	}
+
+	Drop := make([]OwnedRefs, 0, len(R.Refs))
+	for Ref, N := range R.Refs {
+		Drop = append(Drop, OwnedRefs{Ref, N})
+	}
+	if R.PIDFD != -1 {
+		syscall.EpollCtl(O.EpollFD, syscall.EPOLL_CTL_DEL, R.PIDFD, nil)
+		syscall.Close(R.PIDFD)
+		R.PIDFD = -1
+	}
+	if len(R.Pending) == 0 {
+		delete(O.Procs, PID)
+	} else {
+		R.Refs = make(map[EPRef]int32)
+		R.Exited = Now
+	}
+	return Drop
+}
+
+// Return pending references of processes that exited
+// before Before and were never adopted, forgetting those processes.
+func (O *OwnerTable) expirePending(Before int64) []OwnedRefs {
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	var Drop []OwnedRefs
+	for PID, R := range O.Procs {
+		if R.Exited == 0 || R.Exited > Before {
+			continue
+		}
+		for Ref, N := range R.Pending {
+			Drop = append(Drop, OwnedRefs{Ref, N})
+		}
+		delete(O.Procs, PID)
+	}
+	return Drop
+}
+
+// Running processes we aren't able to watch with a pidfd.
+func (O *OwnerTable) unwatched() []int {
+	O.Lock.Lock()
+	defer O.Lock.Unlock()
+
+	var PIDs []int
+	for PID, R := range O.Procs {
+		if R.PIDFD == -1 && R.Exited == 0 {
+			PIDs = append(PIDs, PID)
+		}
+	}
+	return PIDs
+}
+
+func (C *IPCContext) dropRefs(Drop []OwnedRefs) {
+	for _, D := range Drop {
+		C.unref(D.Ref, D.N)
+	}
+}
+
+// Drop all references held by the given process.
+func (C *IPCContext) reclaimProcess(PID int) {
+	Drop := C.Owners.exited(PID, time.Now().UnixNano())
+	if len(Drop) > 0 {
+		log.Printf("Process %d exited, dropping %d endpoint reference(s)\n", PID, len(Drop))
+	}
+	C.dropRefs(Drop)
+}
+
+// Start noticing exit of owners and sweeping for stale endpoints.
+func (C *IPCContext) startReclaimer() {
+	EpollFD, err := syscall.EpollCreate1(syscall.EPOLL_CLOEXEC)
+	if err != nil {
+		log.Printf("Unable to create epoll instance, polling for exits: %s\n", err.Error())
+	} else {
+		C.Owners.Lock.Lock()
+		C.Owners.EpollFD = EpollFD
+		// Owners handed over to us by our predecessor.
+		for PID, R := range C.Owners.Procs {
+			if R.PIDFD == -1 && R.Exited == 0 {
+				C.Owners.watch(PID, R)
+			}
+		}
+		C.Owners.Lock.Unlock()
+		go C.watchOwners(EpollFD)
+	}
+	go C.sweep()
+}
+
+func (C *IPCContext) watchOwners(EpollFD int) {
+	var Events [64]syscall.EpollEvent
+	for {
+		n, err := syscall.EpollWait(EpollFD, Events[:], -1)
+		if err == syscall.EINTR {
+			continue
+		}
+		if err != nil {
+			log.Printf("Error waiting for process exits: %s\n", err.Error())
+			return
+		}
+		for _, E := range Events[:n] {
+			C.reclaimProcess(int(E.Fd))
+		}
+	}
+}
+
+func (C *IPCContext) sweep() {
+	for range time.Tick(C.Config.SweepInterval) {
+		// Processes we can't watch are checked directly.
+		for _, PID := range C.Owners.unwatched() {
+			if syscall.Kill(PID, 0) == syscall.ESRCH {
+				C.reclaimProcess(PID)
+			}
+		}
+
+		Now := time.Now().UnixNano()
+		C.dropRefs(C.Owners.expirePending(Now - int64(C.Config.AdoptGrace)))
+		if C.Config.UnpairedTTL != 0 {
+			C.expireUnpaired(Now - int64(C.Config.UnpairedTTL))
+		}
+	}
+}
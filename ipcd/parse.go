@@ -0,0 +1,125 @@
+package main
+
+// Allocation-free helpers for parsing request lines.
+// Requests are parsed in-place from the connection's read buffer,
+// so the common path doesn't produce garbage for the GC to chase.
+
+import (
+	"errors"
+	"net"
+	"strconv"
+)
+
+// Maximum number of space-delimited tokens in a request.
+// Anything beyond this is ignored.
+const MAX_TOKENS = 16
+
+// Split 'line' on spaces into 'tokens', returning the
+// (sub)slice of tokens that were filled.
+// Tokens refer to the memory of 'line', nothing is copied.
+func splitTokens(line []byte, tokens [][]byte) [][]byte {
+	n := 0
+	start := -1
+	for i, c := range line {
+		if c == ' ' {
+			if start != -1 {
+				if n == len(tokens) {
+					return tokens[:n]
+				}
+				tokens[n] = line[start:i]
+				n++
+				start = -1
+			}
+		} else if start == -1 {
+			start = i
+		}
+	}
+	if start != -1 && n < len(tokens) {
+		tokens[n] = line[start:]
+		n++
+	}
+	return tokens[:n]
+}
+
+// Parse decimal integer, like strconv.ParseInt(string(b), 10, 64)
+// but without the conversion to string.
+func parseInt64(b []byte) (int64, error) {
+	neg := false
+	digits := b
+	if len(digits) > 0 && (digits[0] == '-' || digits[0] == '+') {
+		neg = digits[0] == '-'
+		digits = digits[1:]
+	}
+	// Anything long enough to possibly overflow is left to strconv.
+	if len(digits) == 0 || len(digits) > 18 {
+		return parseIntSlow(b)
+	}
+	var n int64
+	for _, c := range digits {
+		if c < '0' || c > '9' {
+			return parseIntSlow(b)
+		}
+		n = n*10 + int64(c-'0')
+	}
+	if neg {
+		n = -n
+	}
+	return n, nil
+}
+
+// Slow path, also used to produce the same errors strconv would.
+func parseIntSlow(b []byte) (int64, error) {
+	n, err := strconv.ParseInt(string(b), 10, 64)
+	if err != nil {
+		// Strip the "strconv.ParseInt: " prefix for brevity,
+		// matching the messages produced by strconv.Atoi.
+		if nerr, ok := err.(*strconv.NumError); ok {
+			return 0, errors.New("strconv.Atoi: parsing " + strconv.Quote(nerr.Num) + ": " + nerr.Err.Error())
+		}
+	}
+	return n, err
+}
+
+func parseInt(b []byte) (int, error) {
+	n, err := parseInt64(b)
+	return int(n), err
+}
+
+// Parse IP address into its 16-byte form,
+// with IPv4 addresses stored as v4-mapped IPv6 addresses.
+// Dotted-quad IPv4 addresses are parsed without allocating.
+func parseIP(b []byte) (IP [16]byte, err error) {
+	IP[10], IP[11] = 0xff, 0xff
+	Octet, Digits, Dots := 0, 0, 0
+	for _, c := range b {
+		switch {
+		case c >= '0' && c <= '9' && Digits < 3:
+			Octet = Octet*10 + int(c-'0')
+			Digits++
+		case c == '.' && Digits > 0 && Dots < 3:
+			if Octet > 255 {
+				return parseIPSlow(b)
+			}
+			IP[12+Dots] = byte(Octet)
+			Octet, Digits = 0, 0
+			Dots++
+		default:
+			return parseIPSlow(b)
+		}
+	}
+	if Dots != 3 || Digits == 0 || Octet > 255 {
+		return parseIPSlow(b)
+	}
+	IP[15] = byte(Octet)
+	return IP, nil
+}
+
+// Slow path for IPv6 and anything unusual.
+func parseIPSlow(b []byte) (IP [16]byte, err error) {
+	Parsed := net.ParseIP(string(b))
+	if Parsed == nil {
+		return IP, errors.New("invalid IP address: " + strconv.Quote(string(b)))
+	}
+	copy(IP[:], Parsed.To16())
+	return IP, nil
+}
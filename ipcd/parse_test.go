@@ -0,0 +1,73 @@
+package main
+
+// Unit tests for request parsing helpers.
+
+import (
+	"net"
+	"testing"
+)
+
+func TestSplitTokens(t *testing.T) {
+	var Tokens [MAX_TOKENS][]byte
+	Args := splitTokens([]byte("  FIND_PAIR  12 "), Tokens[:])
+	if len(Args) != 2 || string(Args[0]) != "FIND_PAIR" || string(Args[1]) != "12" {
+		t.Fatalf("Unexpected tokens: %q", Args)
+	}
+}
+
+func TestParseInt(t *testing.T) {
+	Good := map[string]int64{
+		"0": 0, "42": 42, "-7": -7, "+3": 3,
+		"9223372036854775807": 9223372036854775807,
+	}
+	for S, exp := range Good {
+		n, err := parseInt64([]byte(S))
+		if err != nil || n != exp {
+			t.Fatalf("parseInt64(%s) = %d, %v; expected %d", S, n, err, exp)
+		}
+	}
+	for _, S := range []string{"", "-", "1x", "99999999999999999999"} {
+		if _, err := parseInt64([]byte(S)); err == nil {
+			t.Fatalf("parseInt64(%s) unexpectedly succeeded", S)
+		}
+	}
+}
+
+// Parsing and responding to a request should not allocate.
+func TestRequestNoAllocs(t *testing.T) {
+	CC := NewClientConn(nil)
+	Line := []byte("FIND_PAIR 12")
+	allocs := testing.AllocsPerRun(100, func() {
+		Args := splitTokens(Line, CC.Tokens[:])
+		switch string(Args[0]) {
+		case "FIND_PAIR":
+			n, err := parseInt(Args[1])
+			if err != nil {
+				t.Fatal(err)
+			}
+			CC.Resp = CC.Resp[:0]
+			CC.respondInt("PAIR ", n)
+			CC.WBuf = append(CC.WBuf[:0], CC.Resp...)
+		}
+	})
+	if allocs != 0 {
+		t.Fatalf("Request parsing allocated %v times per run", allocs)
+	}
+}
+
+func TestParseIP(t *testing.T) {
+	for _, S := range []string{"192.168.0.2", "0.0.0.0", "255.255.255.255", "::1", "fe80::1"} {
+		IP, err := parseIP([]byte(S))
+		if err != nil {
+			t.Fatal(err)
+		}
+		if exp := net.ParseIP(S); !net.IP(IP[:]).Equal(exp) {
+			t.Fatalf("parseIP(%s) = %v, expected %v", S, net.IP(IP[:]), exp)
+		}
+	}
+	for _, S := range []string{"", "1.2.3", "1.2.3.256", "1..2.3", "1.2.3.4.", "host"} {
+		if _, err := parseIP([]byte(S)); err == nil {
+			t.Fatalf("parseIP(%s) unexpectedly succeeded", S)
+		}
+	}
+}
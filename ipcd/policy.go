@@ -0,0 +1,229 @@
+package main
+
+// Optimization policy set by hand, in the file named by IPCD_POLICY.
+// Each line is a rule: what it matches, then what it sets, e.g.
+//
+//	# Latency-sensitive: pair early, and don't wait long to.
+//	port=5432 threshold=4096 calls=8 age=100ms timeout=20ms
+//	net=10.1.0.0/16 port=8000-8099 off
+//	prog=backup threshold=1048576
+//
+// Connections are matched by the address of their server end
+// (port or range of ports, and network) and by the program on the
+// end asking.  The first rule matching decides, and the other end
+// of the connection follows, so both agree.
+// Rules override what's been learned (see learn.go).
+
+import (
+	"bufio"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"os"
+	"strconv"
+	"strings"
+	"time"
+)
+
+const POLICY_ENV = "IPCD_POLICY"
+
+// Whether a rule turns optimization on or off.
+const (
+	RULE_DEFAULT = iota
+	RULE_ON
+	RULE_OFF
+)
+
+// Local transports.
+const (
+	TRANSPORT_DEFAULT = iota
+	// socketpair(AF_UNIX)
+	TRANSPORT_UNIX
+	// Shared-memory ring, the socketpair only for wakeups (ring.go)
+	TRANSPORT_RING
+)
+
+type PolicyRule struct {
+	// Matches, zero values matching anything.
+	PortLo, PortHi int
+	Net, Mask      [16]byte
+	Prog           ProgName
+	// Settings, zero values leaving things as they'd otherwise be.
+	Enable int
+	// Bytes carried, I/O calls made or time connected before
+	// pairing is first tried, whichever comes first.
+	Threshold int
+	Calls     int
+	Age       time.Duration
+	// How long each try waits for the peer.
+	PairTimeout time.Duration
+	Transport   int
+}
+
+// Rules, in order.  Never changed once loaded.
+type Policy struct {
+	Rules []PolicyRule
+}
+
+// Rule with the given index, nil if none.
+func (P *Policy) rule(Index int32) *PolicyRule {
+	if Index < 0 || int(Index) >= len(P.Rules) {
+		return nil
+	}
+	return &P.Rules[Index]
+}
+
+// Index of the first rule matching a connection to Server
+// by Prog, -1 if none do.
+func (P *Policy) match(Server NetAddr, Prog ProgName) int32 {
+	for i := range P.Rules {
+		if P.Rules[i].matches(Server, Prog) {
+			return int32(i)
+		}
+	}
+	return -1
+}
+
+func (R *PolicyRule) matches(Server NetAddr, Prog ProgName) bool {
+	if R.PortHi != 0 && (Server.Port < R.PortLo || Server.Port > R.PortHi) {
+		return false
+	}
+	for i := range R.Net {
+		if Server.IP[i]&R.Mask[i] != R.Net[i] {
+			return false
+		}
+	}
+	return R.Prog == ProgName{} || R.Prog == Prog
+}
+
+// Does the rule change what libipc does once it's tracking
+// a connection?
+func (R *PolicyRule) tunes() bool {
+	return R.Threshold != 0 || R.PairTimeout != 0 || R.Calls != 0 || R.Age != 0
+}
+
+// Load policy from the named file, if any.
+func LoadPolicy(Path string) (Policy, error) {
+	if Path == "" {
+		return Policy{}, nil
+	}
+	F, err := os.Open(Path)
+	if err != nil {
+		return Policy{}, err
+	}
+	defer F.Close()
+	P, err := parsePolicy(F)
+	if err != nil {
+		return Policy{}, errors.New(Path + ": " + err.Error())
+	}
+	return P, nil
+}
+
+func parsePolicy(R io.Reader) (Policy, error) {
+	var P Policy
+	S := bufio.NewScanner(R)
+	for Line := 1; S.Scan(); Line++ {
+		Text := S.Text()
+		if i := strings.IndexByte(Text, '#'); i != -1 {
+			Text = Text[:i]
+		}
+		Fields := strings.Fields(Text)
+		if len(Fields) == 0 {
+			continue
+		}
+		var Rule PolicyRule
+		for _, F := range Fields {
+			if err := Rule.parseField(F); err != nil {
+				return Policy{}, errors.New(fmt.Sprintf("line %d: %s", Line, err.Error()))
+			}
+		}
+		P.Rules = append(P.Rules, Rule)
+	}
+	return P, S.Err()
+}
+
+func (R *PolicyRule) parseField(F string) error {
+	switch F {
+	case "on":
+		R.Enable = RULE_ON
+		return nil
+	case "off":
+		R.Enable = RULE_OFF
+		return nil
+	}
+	Key, Value, ok := strings.Cut(F, "=")
+	if !ok || Value == "" {
+		return errors.New("invalid field " + strconv.Quote(F))
+	}
+	switch Key {
+	case "port":
+		Lo, Hi, Range := strings.Cut(Value, "-")
+		var err error
+		if R.PortLo, err = strconv.Atoi(Lo); err != nil {
+			return err
+		}
+		R.PortHi = R.PortLo
+		if Range {
+			if R.PortHi, err = strconv.Atoi(Hi); err != nil {
+				return err
+			}
+		}
+		if R.PortLo < 1 || R.PortHi > 65535 || R.PortLo > R.PortHi {
+			return errors.New("invalid port range " + strconv.Quote(Value))
+		}
+	case "net":
+		_, N, err := net.ParseCIDR(Value)
+		if err != nil {
+			return err
+		}
+		Ones, Bits := N.Mask.Size()
+		if Bits == 32 {
+			// As an IPv4-mapped address
+			Ones += 96
+		}
+		for i := 0; i < Ones; i++ {
+			R.Mask[i/8] |= 0x80 >> (i % 8)
+		}
+		copy(R.Net[:], N.IP.To16())
+	case "prog":
+		// As truncated in /proc/<pid>/comm
+		copy(R.Prog[:len(R.Prog)-1], Value)
+	case "threshold":
+		T, err := strconv.Atoi(Value)
+		if err != nil || T < 1 {
+			return errors.New("invalid threshold " + strconv.Quote(Value))
+		}
+		R.Threshold = T
+	case "calls":
+		N, err := strconv.Atoi(Value)
+		if err != nil || N < 1 {
+			return errors.New("invalid calls " + strconv.Quote(Value))
+		}
+		R.Calls = N
+	case "age":
+		D, err := time.ParseDuration(Value)
+		if err != nil || D < time.Millisecond {
+			return errors.New("invalid age " + strconv.Quote(Value))
+		}
+		R.Age = D
+	case "timeout":
+		D, err := time.ParseDuration(Value)
+		if err != nil || D < time.Millisecond {
+			return errors.New("invalid timeout " + strconv.Quote(Value))
+		}
+		R.PairTimeout = D
+	case "transport":
+		switch Value {
+		case "unix":
+			R.Transport = TRANSPORT_UNIX
+		case "ring":
+			R.Transport = TRANSPORT_RING
+		default:
+			return errors.New("unknown transport " + strconv.Quote(Value))
+		}
+	default:
+		return errors.New("unknown setting " + strconv.Quote(Key))
+	}
+	return nil
+}
@@ -0,0 +1,84 @@
+package main
+
+// Pool of local transports (connected socketpairs), created ahead
+// of time by a background goroutine so that localizing a pair of
+// endpoints doesn't create one while holding locks, or at all
+// on the critical path of an optimizing client.
+
+import (
+	"os"
+	"syscall"
+)
+
+type Transport struct {
+	A, B int
+}
+
+// Socketpair of the given type: SOCK_STREAM for TCP,
+// SOCK_SEQPACKET for UDP (keeping datagrams whole).
+func NewTransport(Type int) (Transport, error) {
+	FDs, err := syscall.Socketpair(syscall.AF_UNIX, Type|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		return Transport{-1, -1}, os.NewSyscallError("socketpair", err)
+	}
+	return Transport{FDs[0], FDs[1]}, nil
+}
+
+func (T Transport) Close() {
+	syscall.Close(T.A)
+	syscall.Close(T.B)
+}
+
+type TransportPool struct {
+	Ready chan Transport
+	// Poked when a transport is taken from the pool.
+	Refill chan struct{}
+}
+
+func (P *TransportPool) init(Size int) {
+	P.Ready = make(chan Transport, Size)
+	P.Refill = make(chan struct{}, 1)
+}
+
+// Take a transport from the pool, creating one if it's empty.
+func (P *TransportPool) get() (Transport, error) {
+	select {
+	case T := <-P.Ready:
+		select {
+		case P.Refill <- struct{}{}:
+		default:
+		}
+		return T, nil
+	default:
+		return NewTransport(syscall.SOCK_STREAM)
+	}
+}
+
+// Return unused transport to the pool, or close it if full.
+func (P *TransportPool) put(T Transport) {
+	select {
+	case P.Ready <- T:
+	default:
+		T.Close()
+	}
+}
+
+// Keep the pool full, in the background.
+func (P *TransportPool) start() {
+	if cap(P.Ready) == 0 {
+		return
+	}
+	go func() {
+		for {
+			for len(P.Ready) < cap(P.Ready) {
+				T, err := NewTransport(syscall.SOCK_STREAM)
+				if err != nil {
+					// Probably out of descriptors, try again later.
+					break
+				}
+				P.put(T)
+			}
+			<-P.Refill
+		}
+	}()
+}
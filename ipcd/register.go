@@ -3,57 +3,184 @@ package main
 import (
 	"errors"
 	"fmt"
-	"os"
+	"log"
 	"sync"
+	"sync/atomic"
 	"syscall"
 	"time"
 )
 
-type LocalizedEP struct {
-	EP      *EndPointInfo
-	LocalFD *os.File
-}
-
-type LocalInfo struct {
-	A, B LocalizedEP
-}
-
 type EndPoint struct {
 	PID int
 	FD  int
 }
 
+// IPv6 (or v4-mapped IPv4) address and port.
+// Fixed-size so it can be compared and used as a map key
+// without allocating.
 type NetAddr struct {
-	IP   string
+	IP   [16]byte
 	Port int
 }
 
+// No pointers in here: endpoints live in the slab,
+// which the GC then doesn't need to scan.
+// Links to other endpoints are by EPRef, so they don't follow
+// an ID to whatever reuses it once the endpoint is gone.
 type EndPointInfo struct {
-	EP         EndPoint
-	Info       *LocalInfo
-	KludgePair *EndPointInfo
+	EP EndPoint
+	// Process that registered it, by the credentials of its
+	// connection (SO_PEERCRED) unlike EP.PID; 0 if unknown.
+	Owner int32
+	// Our end of the localized socketpair, -1 if none
+	// or if it has already been handed to the client.
+	LocalFD    int
+	LocalPeer  EPRef
+	KludgePair EPRef
 	S_CRC      int
 	R_CRC      int
-	Src        NetAddr
-	Dst        NetAddr
-	IsAccept   bool
-	Start      time.Time
-	End        time.Time
-	RefCount   int
-	ID         int
+	// Looking for its pair, and hasn't given up yet.
+	Offered bool
+	// Bytes sent over TCP when offered, for endpoints that
+	// drain: read TCP until their peer's mark once paired,
+	// so in-flight data doesn't stand in the way of pairing.
+	Drains   bool
+	SentMark int64
+	Src      NetAddr
+	Dst      NetAddr
+	IsAccept bool
+	// Connected UDP socket, paired with the one it's connected
+	// to over a message-preserving transport (SOCK_SEQPACKET).
+	Dgram bool
+	// AF_UNIX stream socket: no addresses, its peer being known
+	// by inode alone.
+	Unix bool
+	// Localized over a shared-memory ring (see ring.go),
+	// the transport only carrying wakeups.
+	Ring  bool
+	InUse bool
+	// Listening socket, its address in Src.
+	Listening bool
+	// Connected to a listener of ours on this host,
+	// so may be paired before sending anything.
+	Fast      bool
+	FastState uint8
+	// Not worth tracking, going by history.
+	Skip bool
+	// How much this connection carries is to be
+	// recorded for Service once unregistered.
+	Learn   bool
+	Service ServiceKey
+	// Policy rule deciding how it's treated, -1 if none.
+	Rule int32
+	// Kernel identity (inode) of the socket, once verified
+	// against the addresses given, and of its peer once found;
+	// zero if unknown.
+	Inode     uint32
+	PeerInode uint32
+	// Removed from consideration for pairing after not
+	// sending ENDPOINT_INFO in time, but still referenced.
+	Expired bool
+	// Timings in nanoseconds since the epoch
+	Start      int64
+	End        int64
+	Registered int64
+	RefCount   int32
+	ID         int32
+	// Incremented each time the slot is reused.
+	Gen uint32
 }
 
-type IPCContext struct {
-	EPMap  map[int]*EndPointInfo
+func (E *EndPointInfo) ref() EPRef {
+	return EPRef{E.ID, E.Gen}
+}
+
+// Endpoints are stored in fixed-size chunks indexed by ID.
+// Chunks are allocated as needed and never moved or freed,
+// so pointers to endpoints remain valid and slots are reused
+// along with their ID's.
+const SLAB_CHUNK_SHIFT = 10
+const SLAB_CHUNK_SIZE = 1 << SLAB_CHUNK_SHIFT
+const SLAB_MAX_CHUNKS = 4096
+const MAX_ENDPOINTS = SLAB_CHUNK_SIZE * SLAB_MAX_CHUNKS
+
+type SlabChunk [SLAB_CHUNK_SIZE]EndPointInfo
+
+type EndPointSlab struct {
+	Chunks [SLAB_MAX_CHUNKS]atomic.Pointer[SlabChunk]
+}
+
+// Number of independently locked partitions of the endpoint table.
+// Endpoints are assigned to a shard by ID, so requests about
+// different endpoints (from different clients) rarely contend.
+// Each shard lock guards the slots of its endpoints.
+const NUM_SHARDS = 64
+
+type ContextShard struct {
+	Lock sync.Mutex
+}
+
+// Hands out endpoint ID's, always preferring the lowest unused one.
+type IDAllocator struct {
 	Lock   sync.Mutex
+	InUse  []bool
 	FreeID int
+}
+
+// Endpoints are found in PairIndex by their (Src, Dst) addresses.
+type PairKey struct {
+	Src, Dst NetAddr
+}
+
+// Progress of pairing from the first byte (FIND_PAIR_FAST).
+const (
+	FAST_NONE = iota
+	FAST_OFFERED
+	FAST_WITHDRAWN
+)
+
+type IPCContext struct {
+	Slab   EndPointSlab
+	Shards [NUM_SHARDS]ContextShard
+	IDs    IDAllocator
+	Owners OwnerTable
+	Config Config
+
+	Admission  Admission
+	Transports TransportPool
+	Learner    Learner
+	Clients    ClientSet
+	Policy     Policy
+
+	// Finds the inode of the TCP (or UDP) socket with the given
+	// addresses, nil if sockets can't be looked up (no sock_diag).
+	SockLookup  func(Src, Dst NetAddr) (uint32, error)
+	DgramLookup func(Src, Dst NetAddr) (uint32, error)
+	// Finds the peer of the AF_UNIX stream socket with the given
+	// inode, nil likewise.
+	UnixLookup func(Inode uint32) (uint32, error)
+
+	// Pairing is the only operation that looks across shards.
+	// PairLock serializes it and guards the pairing-related fields
+	// of all endpoints (CRC's, addresses, inodes and timings, and KludgePair,
+	// which is also written holding the shard locks),
+	// as well as PairIndex and the kludge state below.
+	// Lock order: PairLock first, then shard locks by index.
+	// Endpoints are removed from the pairing state before
+	// their ID (and slot) can be reused.
+	PairLock  sync.Mutex
+	PairIndex map[PairKey][]int32
+	// Endpoints with verified socket inodes, by inode.
+	Inodes map[uint32]int32
+	// Listening endpoints, by address.
+	Listeners map[NetAddr]int32
 	// Used for Endpoint sync kludge
-	WaitingEPI  *EndPointInfo
+	WaitingID   int32
 	WaitingTime time.Time
 }
 
 func InvalidAddr() NetAddr {
-	return NetAddr{"", -1}
+	return NetAddr{Port: -1}
 }
 
 func (N *NetAddr) isValid() bool {
@@ -66,16 +193,27 @@ func (E *EndPointInfo) matchesWithoutCRC(R *EndPointInfo) bool {
 		return false
 	}
 	// If already has a pair, also nothing to be done here
-	if E.KludgePair != nil || R.KludgePair != nil {
+	if E.KludgePair.isValid() || R.KludgePair.isValid() {
 		return false
 	}
 
-	if E.IsAccept == R.IsAccept {
+	if E.Dgram != R.Dgram {
 		return false
 	}
+	// Addresses are compared in their 16-byte form, IPv4 ones
+	// v4-mapped: an AF_INET6 socket talking to an AF_INET one
+	// sees ::ffff:a.b.c.d where its peer sees a.b.c.d.
 	if E.Src != R.Dst || E.Dst != R.Src {
 		return false
 	}
+	// Datagram sockets are connected to each other,
+	// neither accepts and either may go first.
+	if E.Dgram {
+		return true
+	}
+	if E.IsAccept == R.IsAccept {
+		return false
+	}
 
 	// Use "IsAccept" to designate client/server
 	Client, Server := E, R
@@ -86,11 +224,11 @@ func (E *EndPointInfo) matchesWithoutCRC(R *EndPointInfo) bool {
 	// Hmm, might not actually matter which is which
 	// looking at the code below.  Oh well O:)
 
-	if Client.Start.After(Server.End) {
+	if Client.Start > Server.End {
 		// Accept returned before connect() started, definitely not valid
 		return false
 	}
-	if Server.Start.After(Client.End) {
+	if Server.Start > Client.End {
 		// connect() finished before accept was called, also not valid.
 		// XXX: Nope, this definitely can happen.  This might happen generally,
 		//      but can easily happen with non-blocking accept().
@@ -106,244 +244,570 @@ func (E *EndPointInfo) matches(R *EndPointInfo) bool {
 		E.S_CRC == R.R_CRC && E.R_CRC == R.S_CRC
 }
 
-func NewContext() *IPCContext {
-	C := &IPCContext{}
-	C.EPMap = make(map[int]*EndPointInfo)
+func NewContext(Config Config) *IPCContext {
+	C := &IPCContext{Config: Config}
+	C.Owners.init()
+	C.Admission.init(Config.MaxInFlight)
+	C.Transports.init(Config.PoolSize)
+	C.Learner.init()
+	C.Clients.init()
+	C.PairIndex = make(map[PairKey][]int32)
+	C.Inodes = make(map[uint32]int32)
+	C.Listeners = make(map[NetAddr]int32)
+	C.WaitingID = -1
 	return C
 }
 
-func (C *IPCContext) register(PID, FD int) (int, error) {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+// Slot for the given ID, allocating its chunk if needed.
+// Only called for allocated ID's.
+func (S *EndPointSlab) slot(ID int) *EndPointInfo {
+	Chunk := &S.Chunks[ID>>SLAB_CHUNK_SHIFT]
+	C := Chunk.Load()
+	if C == nil {
+		Chunk.CompareAndSwap(nil, new(SlabChunk))
+		C = Chunk.Load()
+	}
+	return &C[ID&(SLAB_CHUNK_SIZE-1)]
+}
 
-	ID := C.FreeID
+// Slot for the given ID, or nil if there is no such slot.
+// Caller must check the slot is in use (under the shard lock).
+func (S *EndPointSlab) find(ID int) *EndPointInfo {
+	if ID < 0 || ID >= MAX_ENDPOINTS {
+		return nil
+	}
+	C := S.Chunks[ID>>SLAB_CHUNK_SHIFT].Load()
+	if C == nil {
+		return nil
+	}
+	return &C[ID&(SLAB_CHUNK_SIZE-1)]
+}
 
-	EPI := EndPointInfo{EndPoint{PID, FD}, nil,
-		nil,           /* kludge pair */
-		0,             /* S_CRC */
-		0,             /* R_CRC */
-		InvalidAddr(), /* Src */
-		InvalidAddr(), /* Dst*/
-		false,         /* IsAccept */
-		time.Time{},   /* Start */
-		time.Time{},   /* End */
-		1,             /* refcnt */
-		ID}
+func (A *IDAllocator) alloc() (int, error) {
+	A.Lock.Lock()
+	defer A.Lock.Unlock()
 
-	C.EPMap[ID] = &EPI
+	ID := A.FreeID
+	if ID >= MAX_ENDPOINTS {
+		return -1, errors.New("Too many endpoints")
+	}
+	for ID >= len(A.InUse) {
+		A.InUse = append(A.InUse, false)
+	}
+	A.InUse[ID] = true
 
 	// Find next free ID
-	used := true
-	for used {
-		C.FreeID++
-		_, used = C.EPMap[C.FreeID]
+	A.FreeID++
+	for A.FreeID < len(A.InUse) && A.InUse[A.FreeID] {
+		A.FreeID++
 	}
 
 	return ID, nil
 }
 
-func (C *IPCContext) localize(LID, RID int) error {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+func (A *IDAllocator) free(ID int) {
+	A.Lock.Lock()
+	defer A.Lock.Unlock()
 
-	LEP, exist := C.EPMap[LID]
-	if !exist {
-		return errors.New("Invalid Local ID")
+	A.InUse[ID] = false
+	if ID < A.FreeID {
+		A.FreeID = ID
 	}
-	REP, exist := C.EPMap[RID]
-	if !exist {
-		return errors.New("Invalid Remote ID")
+}
+
+// Upper bound on allocated ID's.
+func (A *IDAllocator) limit() int {
+	A.Lock.Lock()
+	defer A.Lock.Unlock()
+
+	return len(A.InUse)
+}
+
+func (C *IPCContext) shard(ID int) *ContextShard {
+	return &C.Shards[uint(ID)%NUM_SHARDS]
+}
+
+// Lock the shards holding the two given endpoints, in order.
+func (C *IPCContext) lockShards(ID1, ID2 int) (*ContextShard, *ContextShard) {
+	S1, S2 := C.shard(ID1), C.shard(ID2)
+	if S1 == S2 {
+		S1.Lock.Lock()
+		return S1, S2
 	}
+	if uint(ID2)%NUM_SHARDS < uint(ID1)%NUM_SHARDS {
+		S2.Lock.Lock()
+		S1.Lock.Lock()
+	} else {
+		S1.Lock.Lock()
+		S2.Lock.Lock()
+	}
+	return S1, S2
+}
 
-	if LEP.Info != REP.Info {
-		return errors.New("Attempt to localize already localized FD?")
+func unlockShards(S1, S2 *ContextShard) {
+	S1.Lock.Unlock()
+	if S1 != S2 {
+		S2.Lock.Unlock()
 	}
-	if LEP.Info != nil {
-		// These have already been localized, with same endpoints.  All is well.
+}
+
+// Find registered endpoint with the given ID, nil if none.
+// Must hold the lock for its shard.
+func (C *IPCContext) getLocked(ID int) *EndPointInfo {
+	EPI := C.getReferenced(ID)
+	if EPI == nil || EPI.Expired {
 		return nil
 	}
+	return EPI
+}
 
-	// Okay, spawn connected pair of sockets for these
-	LFD, RFD, err := Socketpair(syscall.SOCK_STREAM)
+// Like getLocked, but also finds expired endpoints.
+func (C *IPCContext) getReferenced(ID int) *EndPointInfo {
+	EPI := C.Slab.find(ID)
+	if EPI == nil || !EPI.InUse {
+		return nil
+	}
+	return EPI
+}
+
+// Find endpoint with the given ID, nil if none.
+func (C *IPCContext) lookup(ID int) *EndPointInfo {
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	return C.getLocked(ID)
+}
+
+// Remove all pairing state for an endpoint being unregistered.
+func (C *IPCContext) forgetPairing(EPI *EndPointInfo) {
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	if EPI.Listening {
+		if C.Listeners[EPI.Src] == EPI.ID {
+			delete(C.Listeners, EPI.Src)
+		}
+	} else if EPI.Src.isValid() {
+		C.removeFromIndex(EPI)
+	}
+	if EPI.Inode != 0 && C.Inodes[EPI.Inode] == EPI.ID {
+		delete(C.Inodes, EPI.Inode)
+	}
+	if C.WaitingID == EPI.ID {
+		C.WaitingID = -1
+	}
+}
+
+// Must hold PairLock
+func (C *IPCContext) removeFromIndex(EPI *EndPointInfo) {
+	Key := PairKey{EPI.Src, EPI.Dst}
+	IDs := C.PairIndex[Key]
+	for i, v := range IDs {
+		if v == EPI.ID {
+			IDs[i] = IDs[len(IDs)-1]
+			IDs = IDs[:len(IDs)-1]
+			break
+		}
+	}
+	if len(IDs) == 0 {
+		delete(C.PairIndex, Key)
+	} else {
+		C.PairIndex[Key] = IDs
+	}
+}
+
+// Release an endpoint removed from its shard.
+// Its ID is freed last, so the slot isn't reused
+// while it can still be found by pairing.
+func (C *IPCContext) release(EPI *EndPointInfo, LocalFD int) {
+	// TODO: "Un-localize" endpoint?
+	if LocalFD != -1 {
+		syscall.Close(LocalFD)
+	}
+
+	C.forgetPairing(EPI)
+	C.IDs.free(int(EPI.ID))
+}
+
+func (C *IPCContext) register(PID, FD, Owner int) (int, error) {
+	if !C.Owners.admit(Owner, C.Config.MaxClientEndpoints) {
+		return -1, ErrBusy
+	}
+
+	ID, err := C.IDs.alloc()
+	if err != nil {
+		return ID, err
+	}
+
+	EPI := C.Slab.slot(ID)
+
+	S := C.shard(ID)
+	S.Lock.Lock()
+	Gen := EPI.Gen + 1
+	*EPI = EndPointInfo{EndPoint{PID, FD},
+		int32(Owner),
+		-1,            /* local fd */
+		NoRef,         /* local peer */
+		NoRef,         /* kludge pair */
+		0,             /* S_CRC */
+		0,             /* R_CRC */
+		false,         /* Offered */
+		false,         /* Drains */
+		0,             /* SentMark */
+		InvalidAddr(), /* Src */
+		InvalidAddr(), /* Dst*/
+		false,         /* IsAccept */
+		false,         /* Dgram */
+		false,         /* Unix */
+		false,         /* Ring */
+		true,          /* InUse */
+		false,         /* Listening */
+		false,         /* Fast */
+		FAST_NONE,     /* FastState */
+		false,         /* Skip */
+		false,         /* Learn */
+		ServiceKey{},  /* Service */
+		-1,            /* Rule */
+		0,             /* Inode */
+		0,             /* PeerInode */
+		false,         /* Expired */
+		0,             /* Start */
+		0,             /* End */
+		time.Now().UnixNano(),
+		1, /* refcnt */
+		int32(ID),
+		Gen}
+	S.Lock.Unlock()
+
+	C.Owners.addRef(Owner, EPRef{int32(ID), Gen})
+
+	return ID, nil
+}
+
+func (C *IPCContext) localize(LID, RID int) error {
+	// Get transport before taking any locks,
+	// it's returned to the pool if not needed.
+	// Datagram ones aren't pooled, they're the exception,
+	// as are those primed with a ring.
+	Dgram, Ring := C.transportFor(LID, RID)
+	var T Transport
+	var err error
+	if Dgram {
+		T, err = NewTransport(syscall.SOCK_SEQPACKET)
+	} else {
+		T, err = C.Transports.get()
+	}
 	if err != nil {
 		return err
 	}
+	if Ring {
+		if err := primeRing(T); err != nil {
+			log.Printf("Unable to set up ring, using socketpair: %s\n", err.Error())
+			T.Close()
+			if T, err = C.Transports.get(); err != nil {
+				return err
+			}
+			Ring = false
+		}
+	}
+	Used := false
+	defer func() {
+		if Used {
+			return
+		}
+		if Dgram || Ring {
+			T.Close()
+		} else {
+			C.Transports.put(T)
+		}
+	}()
+
+	LS, RS := C.lockShards(LID, RID)
+	defer unlockShards(LS, RS)
 
-	LEP_A, LEP_B := LocalizedEP{LEP, LFD}, LocalizedEP{REP, RFD}
-	if RID < LID {
-		LEP_B, LEP_A = LEP_A, LEP_B
+	LEP := C.getLocked(LID)
+	if LEP == nil {
+		return errors.New("Invalid Local ID")
+	}
+	REP := C.getLocked(RID)
+	if REP == nil {
+		return errors.New("Invalid Remote ID")
+	}
+	if LEP == REP {
+		return errors.New("Cannot localize endpoint with itself")
 	}
 
-	LI := &LocalInfo{LEP_A, LEP_B}
-	LEP.Info = LI
-	REP.Info = LI
+	if LEP.KludgePair.isValid() && LEP.KludgePair != REP.ref() {
+		return errors.New("Attempt to localize endpoint with other than its pair")
+	}
+	if LEP.LocalPeer.isValid() || REP.LocalPeer.isValid() {
+		if LEP.LocalPeer == REP.ref() && REP.LocalPeer == LEP.ref() {
+			// These have already been localized, with same endpoints.  All is well.
+			return nil
+		}
+		return errors.New("Attempt to localize already localized FD?")
+	}
+
+	// Okay, connect these using the transport
+	LEP.LocalFD, LEP.LocalPeer = T.A, REP.ref()
+	REP.LocalFD, REP.LocalPeer = T.B, LEP.ref()
+	LEP.Ring, REP.Ring = Ring, Ring
+	Used = true
 
 	return nil
 }
 
-func (C *IPCContext) getLocalFD(ID int) (*os.File, error) {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+// What transport pairs this endpoint with its remote:
+// SOCK_SEQPACKET for a (connected) UDP socket, otherwise what policy
+// says, or by default a ring for AF_UNIX sockets and connections
+// within one process.
+func (C *IPCContext) transportFor(LID, RID int) (Dgram, Ring bool) {
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	EPI := C.lookup(LID)
+	if EPI == nil || EPI.Dgram {
+		return EPI != nil, false
+	}
+	if R := C.Policy.rule(EPI.Rule); R != nil && R.Transport != TRANSPORT_DEFAULT {
+		return false, R.Transport == TRANSPORT_RING
+	}
+	if EPI.Unix {
+		return false, true
+	}
+	REP := C.lookup(RID)
+	return false, REP != nil && EPI.ownProcess() && REP.ownProcess() &&
+		REP.Owner == EPI.Owner
+}
+
+// Registered by the process it says it belongs to, as its
+// credentials show.  Clients registering on behalf of others
+// can't vouch for where the endpoint lives.
+func (EPI *EndPointInfo) ownProcess() bool {
+	return EPI.Owner > 0 && int(EPI.Owner) == EPI.EP.PID
+}
+
+// Was this endpoint localized over a ring?
+func (C *IPCContext) isRing(ID int) bool {
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
 
-	EP, exist := C.EPMap[ID]
-	if !exist {
-		return nil, errors.New("Invalid ID")
+	EPI := C.getLocked(ID)
+	return EPI != nil && EPI.Ring
+}
+
+// Localize endpoint with its remote, and hand out its local fd.
+func (C *IPCContext) localizeFD(LID, RID int) (int, error) {
+	if err := C.localize(LID, RID); err != nil {
+		return -1, err
 	}
+	return C.getLocalFD(LID)
+}
 
-	if EP.Info == nil {
-		return nil, errors.New("Requested local FD for non-localized Endpoint")
+// Hand out this endpoint's end of its localized socketpair.
+// The caller owns the returned descriptor.
+func (C *IPCContext) getLocalFD(ID int) (int, error) {
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	EP := C.getLocked(ID)
+	if EP == nil {
+		return -1, errors.New("Invalid ID")
 	}
 
-	if EP.Info.A.EP == EP {
-		return EP.Info.A.LocalFD, nil
+	if !EP.LocalPeer.isValid() {
+		return -1, errors.New("Requested local FD for non-localized Endpoint")
 	}
-	if EP.Info.B.EP == EP {
-		return EP.Info.B.LocalFD, nil
+	if EP.LocalFD == -1 {
+		return -1, errors.New("Local FD already retrieved")
 	}
 
-	return nil, errors.New("LocalInfo mismatch: Endpoint not found??")
+	FD := EP.LocalFD
+	EP.LocalFD = -1
+	return FD, nil
 }
 
-func (C *IPCContext) unregister(ID int) error {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+// Drop reference held by the calling process.
+func (C *IPCContext) unregister(ID, Caller int) error {
+	S := C.shard(ID)
+	S.Lock.Lock()
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
+	EPI := C.getReferenced(ID)
+	if EPI == nil {
+		S.Lock.Unlock()
 		return errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
-
-	EPI.RefCount--
-	if EPI.RefCount > 0 {
-		// More references, leave it registered
-		return nil
+	if !C.Owners.dropRef(Caller, EPI.ref()) {
+		S.Lock.Unlock()
+		return errors.New(fmt.Sprintf("Endpoint '%d' not owned by caller", ID))
 	}
 
-	// Remove enties from map
-	delete(C.EPMap, ID)
+	C.unrefLocked(S, EPI, 1)
+	return nil
+}
+
+// Drop references to the given registration of an endpoint,
+// if it's still around.
+func (C *IPCContext) unref(Ref EPRef, N int32) {
+	S := C.shard(int(Ref.ID))
+	S.Lock.Lock()
 
-	if ID < C.FreeID {
-		C.FreeID = ID
+	EPI := C.getReferenced(int(Ref.ID))
+	if EPI == nil || EPI.Gen != Ref.Gen {
+		S.Lock.Unlock()
+		return
 	}
 
-	// TODO: "Un-localize" endpoint?
-	if EPI.Info != nil {
-		// TODO: Close as part of handing to endpoints?
-		EPI.Info.A.LocalFD.Close()
-		EPI.Info.B.LocalFD.Close()
-	}
+	C.unrefLocked(S, EPI, N)
+}
 
-	if C.WaitingEPI == EPI {
-		C.WaitingEPI = nil
+// Drop references to an endpoint, removing it if none remain.
+// Must hold the lock for its shard, which is released.
+func (C *IPCContext) unrefLocked(S *ContextShard, EPI *EndPointInfo, N int32) {
+	EPI.RefCount -= N
+	if EPI.RefCount > 0 {
+		// More references, leave it registered
+		S.Lock.Unlock()
+		return
 	}
 
-	return nil
+	// Remove from table
+	EPI.InUse = false
+	LocalFD := EPI.LocalFD
+	EPI.LocalFD = -1
+	S.Lock.Unlock()
+
+	C.release(EPI, LocalFD)
 }
 
 func (C *IPCContext) removeall(PID int) int {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
-
-	count := 0
-
-	RemoveIDs := []int{}
 	RemoveEPIs := []*EndPointInfo{}
+	LocalFDs := []int{}
 
 	// TODO: reregistration means an endpoint could
 	// have multiple owning processes, handle this!
 	// This all really needs a do-over! O:)
-	for k, v := range C.EPMap {
-		if v.EP.PID == PID {
-			RemoveIDs = append(RemoveIDs, k)
-			RemoveEPIs = append(RemoveEPIs, v)
-			count++
+	Limit := C.IDs.limit()
+	for i := range C.Shards {
+		S := &C.Shards[i]
+		S.Lock.Lock()
+		for ID := i; ID < Limit; ID += NUM_SHARDS {
+			EPI := C.getReferenced(ID)
+			if EPI != nil && EPI.EP.PID == PID {
+				EPI.InUse = false
+				RemoveEPIs = append(RemoveEPIs, EPI)
+				LocalFDs = append(LocalFDs, EPI.LocalFD)
+				EPI.LocalFD = -1
+			}
 		}
+		S.Lock.Unlock()
 	}
 
-	for _, ID := range RemoveIDs {
-		delete(C.EPMap, ID)
+	for i, EPI := range RemoveEPIs {
+		C.release(EPI, LocalFDs[i])
 	}
-	for _, EPI := range RemoveEPIs {
-		if EPI.Info != nil {
-			// TODO: Close as part of handing to endpoints?
-			EPI.Info.A.LocalFD.Close()
-			EPI.Info.B.LocalFD.Close()
-		}
 
-		if C.WaitingEPI == EPI {
-			C.WaitingEPI = nil
-		}
-	}
+	return len(RemoveEPIs)
+}
+
+// Record that two endpoints are each other's pair.
+// Also takes their shard locks, so whether an endpoint
+// is paired can be checked without taking PairLock.
+// Must hold PairLock.
+func (C *IPCContext) setPair(A, B *EndPointInfo) {
+	SA, SB := C.lockShards(int(A.ID), int(B.ID))
+	A.KludgePair = B.ref()
+	B.KludgePair = A.ref()
+	unlockShards(SA, SB)
+}
 
-	return count
+// Has this endpoint been paired already?
+func (C *IPCContext) isPaired(ID int) bool {
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	EPI := C.getLocked(ID)
+	return EPI != nil && EPI.KludgePair.isValid()
 }
 
 func (C *IPCContext) pairkludge(ID int) (int, error) {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
+	EPI := C.lookup(ID)
+	if EPI == nil {
 		return ID, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
 
 	// If already kludge-paired this, return its kludge-pal
-	if EPI.KludgePair != nil {
-		return EPI.KludgePair.ID, nil
+	if EPI.KludgePair.isValid() {
+		return C.pairOf(EPI)
 	}
 
 	// Otherwise, is there a pair candidate waiting?
-	Waiting := C.WaitingEPI
+	Waiting := C.WaitingID
 
-	if Waiting != nil {
+	if Waiting != -1 {
 		if time.Since(C.WaitingTime) >= 100*time.Millisecond {
-			C.WaitingEPI = nil
-			Waiting = nil
+			C.WaitingID = -1
+			Waiting = -1
 		}
 	}
 
-	if Waiting != nil && Waiting != EPI {
-		EPI.KludgePair = Waiting
-		Waiting.KludgePair = EPI
-		C.WaitingEPI = nil
-		return Waiting.ID, nil
+	if Waiting != -1 && Waiting != EPI.ID {
+		if W := C.lookup(int(Waiting)); W != nil {
+			C.setPair(EPI, W)
+			C.WaitingID = -1
+			return int(Waiting), nil
+		}
 	}
 
 	// Nope, well track this in case someone
 	// comes looking for this unpaired endpoint:
 
-	C.WaitingEPI = EPI
+	C.WaitingID = EPI.ID
 	C.WaitingTime = time.Now()
 
 	return ID, nil
 }
 
-func (C *IPCContext) reregister(ID, PID, FD int) error {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+// Take reference on behalf of the caller's (soon to be) children,
+// which they claim using adopt().
+func (C *IPCContext) reregister(ID, PID, FD, Caller int) error {
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
+	EPI := C.getReferenced(ID)
+	if EPI == nil {
 		return errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
+	if !C.Owners.holds(Caller, EPI.ref()) {
+		return errors.New(fmt.Sprintf("Endpoint '%d' not owned by caller", ID))
+	}
 
 	EPI.RefCount++
+	C.Owners.addPending(Caller, EPI.ref())
 
 	return nil
 }
 
 func (C *IPCContext) crc_match(ID, S_CRC, R_CRC int, LastTry bool) (int, error) {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
+	EPI := C.lookup(ID)
+	if EPI == nil {
 		return ID, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
 
 	// If already kludge-paired this, return its kludge-pal
-	if EPI.KludgePair != nil {
-		return EPI.KludgePair.ID, nil
+	if EPI.KludgePair.isValid() {
+		return C.pairOf(EPI)
 	}
 
 	// TODO: Zero is a valid CRC value!
@@ -356,21 +820,28 @@ func (C *IPCContext) crc_match(ID, S_CRC, R_CRC int, LastTry bool) (int, error)
 	EPI.S_CRC = S_CRC
 	EPI.R_CRC = R_CRC
 
-	MatchID := -1
-	for k, v := range C.EPMap {
-		if k == ID {
-			continue
-		}
-		if v.KludgePair != nil {
-			continue
-		}
-		if v.S_CRC == R_CRC && v.R_CRC == S_CRC {
-			MatchID = k
-			break
+	var Match *EndPointInfo
+	Limit := C.IDs.limit()
+	for i := 0; i < NUM_SHARDS && Match == nil; i++ {
+		S := &C.Shards[i]
+		S.Lock.Lock()
+		for k := i; k < Limit; k += NUM_SHARDS {
+			if k == ID {
+				continue
+			}
+			v := C.getLocked(k)
+			if v == nil || v.KludgePair.isValid() {
+				continue
+			}
+			if v.S_CRC == R_CRC && v.R_CRC == S_CRC {
+				Match = v
+				break
+			}
 		}
+		S.Lock.Unlock()
 	}
 	// NOPAIR
-	if MatchID == -1 {
+	if Match == nil {
 		// If this is the last time the program
 		// will attempt to find its communication pair,
 		// remove the CRC information to prevent pairing.
@@ -381,38 +852,84 @@ func (C *IPCContext) crc_match(ID, S_CRC, R_CRC int, LastTry bool) (int, error)
 		return ID, nil
 	}
 
-	Match := C.EPMap[MatchID]
-	EPI.KludgePair = Match
-	Match.KludgePair = EPI
+	C.setPair(EPI, Match)
 
-	return MatchID, nil
+	return int(Match.ID), nil
 }
 
-func (C *IPCContext) endpoint_info(ID int, Src, Dst NetAddr, Start, End time.Time, IsAccept bool) error {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+// Socket lookup for TCP or UDP (Dgram), nil if there's none.
+func (C *IPCContext) sockLookup(Dgram bool) func(Src, Dst NetAddr) (uint32, error) {
+	if Dgram {
+		return C.DgramLookup
+	}
+	return C.SockLookup
+}
+
+// Record addresses and timings of an endpoint (owned by program Prog),
+// returning a hint for how to treat it: HINT_FAST if it's connected
+// to one of our listeners on this host, so can be paired before
+// sending anything (FIND_PAIR_FAST), HINT_SKIP if it isn't worth
+// tracking at all.  Dgram endpoints are for connected UDP sockets.
+func (C *IPCContext) endpoint_info(ID int, Src, Dst NetAddr, Start, End int64, IsAccept bool, Inode uint32, Dgram bool, Prog ProgName) (int, error) {
+	// Only trust the inode if the kernel agrees it's the
+	// socket with these addresses.  Asked before taking
+	// PairLock, so other pairing needn't wait on the kernel.
+	Verified := uint32(0)
+	PeerInode := uint32(0)
+	PeerLocal := false
+	if Lookup := C.sockLookup(Dgram); Inode != 0 && Lookup != nil {
+		if Got, err := Lookup(Src, Dst); err == nil && Got == Inode {
+			Verified = Inode
+			PeerInode, err = Lookup(Dst, Src)
+			PeerLocal = err == nil
+		}
+	}
+
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
 
 	// TODO: Access same clock ourselves to verify updates?
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
-		return errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return HINT_NONE, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
 
-	if EPI.KludgePair != nil {
-		return errors.New("Cannot update info for paired endpoint")
+	if EPI.KludgePair.isValid() {
+		return HINT_NONE, errors.New("Cannot update info for paired endpoint")
 	}
 
+	if EPI.Unix {
+		return HINT_NONE, errors.New("cannot change protocol")
+	}
 	if EPI.Src.isValid() || EPI.Dst.isValid() {
 		if EPI.Src != Src || EPI.Dst != Dst {
-			return errors.New("cannot change address")
+			return HINT_NONE, errors.New("cannot change address")
 		}
 		if EPI.IsAccept != IsAccept {
-			return errors.New("cannot change is_accept")
+			return HINT_NONE, errors.New("cannot change is_accept")
+		}
+		if EPI.Dgram != Dgram {
+			return HINT_NONE, errors.New("cannot change protocol")
 		}
 		if EPI.Start != Start || EPI.End != EPI.End {
-			return errors.New("cannot change timings")
+			return HINT_NONE, errors.New("cannot change timings")
 		}
+		// Nothing changed, already indexed.
+		return EPI.hint(), nil
+	}
+
+	Key := PairKey{Src, Dst}
+	C.PairIndex[Key] = append(C.PairIndex[Key], EPI.ID)
+	if Verified != 0 {
+		// Any endpoint still claiming this inode
+		// must be for a socket since closed.
+		if Old, ok := C.Inodes[Verified]; ok {
+			C.Slab.find(int(Old)).Inode = 0
+		}
+		C.Inodes[Verified] = EPI.ID
+		EPI.Inode = Verified
+		EPI.PeerInode = PeerInode
 	}
 
 	EPI.Src = Src
@@ -420,79 +937,236 @@ func (C *IPCContext) endpoint_info(ID int, Src, Dst NetAddr, Start, End time.Tim
 	EPI.Start = Start
 	EPI.End = End
 	EPI.IsAccept = IsAccept
+	EPI.Dgram = Dgram
+
+	// Without the kernel's word on who our peer is,
+	// there's nothing to check a pairing against.
+	// Nor is there anything listening for datagrams.
+	CanFast := false
+	if PeerLocal && !Dgram {
+		Server := Dst
+		if IsAccept {
+			Server = Src
+		}
+		CanFast = C.isListener(Server)
+	}
+	C.choosePolicy(EPI, CanFast, Prog)
+
+	return EPI.hint(), nil
+}
+
+// Record an endpoint for an AF_UNIX stream socket (owned by
+// program Prog), returning a hint as endpoint_info does.  There
+// are no addresses to go by: the kernel says who its peer is,
+// and if it can't, the endpoint isn't worth tracking.
+func (C *IPCContext) unix_info(ID int, Inode uint32, Prog ProgName) (int, error) {
+	// Asked before taking PairLock, as for endpoint_info.
+	Peer, err := uint32(0), ErrNoSocket
+	if C.UnixLookup != nil && Inode != 0 {
+		Peer, err = C.UnixLookup(Inode)
+	}
+
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return HINT_NONE, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+	}
+
+	if EPI.KludgePair.isValid() {
+		return HINT_NONE, errors.New("Cannot update info for paired endpoint")
+	}
+
+	if EPI.Unix {
+		if EPI.Inode != Inode && !EPI.Skip {
+			return HINT_NONE, errors.New("cannot change inode")
+		}
+		return EPI.hint(), nil
+	}
+	if EPI.Src.isValid() || EPI.Dst.isValid() || EPI.Listening {
+		return HINT_NONE, errors.New("cannot change protocol")
+	}
+
+	EPI.Unix = true
+	if err != nil || Peer == 0 {
+		EPI.Skip = true
+		return EPI.hint(), nil
+	}
+	if Old, ok := C.Inodes[Inode]; ok {
+		C.Slab.find(int(Old)).Inode = 0
+	}
+	C.Inodes[Inode] = EPI.ID
+	EPI.Inode = Inode
+	EPI.PeerInode = Peer
+	C.choosePolicy(EPI, false, Prog)
+
+	return EPI.hint(), nil
+}
+
+// Policy rule the endpoint was given, nil if none.
+func (C *IPCContext) endpointRule(ID int) *PolicyRule {
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return nil
+	}
+	return C.Policy.rule(EPI.Rule)
+}
+
+func (E *EndPointInfo) hint() int {
+	switch {
+	case E.Fast:
+		return HINT_FAST
+	case E.Skip:
+		return HINT_SKIP
+	}
+	return HINT_NONE
+}
+
+// Is there a listening endpoint for connections to this address?
+// Must hold PairLock.
+func (C *IPCContext) isListener(Addr NetAddr) bool {
+	return C.listenerFor(Addr) != -1
+}
 
+// Note endpoint is listening on the given address.
+func (C *IPCContext) listen(ID int, Addr NetAddr) error {
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+	}
+	if EPI.Listening {
+		if EPI.Src != Addr {
+			return errors.New("cannot change address")
+		}
+		return nil
+	}
+	if EPI.Src.isValid() {
+		return errors.New("cannot listen on connected endpoint")
+	}
+
+	EPI.Listening = true
+	EPI.Src = Addr
+	C.Listeners[Addr] = EPI.ID
 	return nil
 }
 
+// Inode of the peer of an endpoint with a verified inode:
+// zero if not known (or not yet accepted), ErrNoSocket if
+// the peer isn't a socket here.
+func (C *IPCContext) peerInode(ID int) (uint32, error) {
+	C.PairLock.Lock()
+	EPI := C.lookup(ID)
+	var Lookup func(Src, Dst NetAddr) (uint32, error)
+	if EPI != nil {
+		Lookup = C.sockLookup(EPI.Dgram)
+	}
+	if EPI == nil || EPI.Inode == 0 || EPI.PeerInode != 0 || Lookup == nil {
+		var Peer uint32
+		if EPI != nil {
+			Peer = EPI.PeerInode
+		}
+		C.PairLock.Unlock()
+		return Peer, nil
+	}
+	Src, Dst := EPI.Src, EPI.Dst
+	C.PairLock.Unlock()
+
+	return Lookup(Dst, Src)
+}
+
 func (C *IPCContext) find_pair(ID, S_CRC, R_CRC int, LastTry bool) (int, error) {
-	C.Lock.Lock()
-	defer C.Lock.Unlock()
+	Pair, _, err := C.find_pair_mark(ID, S_CRC, R_CRC, LastTry, -1)
+	return Pair, err
+}
 
-	EPI, exist := C.EPMap[ID]
-	if !exist {
-		return ID, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+// As find_pair, for endpoints that drain: Sent is how much
+// was sent over TCP so far (nothing more will be once paired),
+// and our pair's is returned along with it.
+// Sent of -1 means the endpoint doesn't drain.
+func (C *IPCContext) find_pair_mark(ID, S_CRC, R_CRC int, LastTry bool, Sent int64) (int, int64, error) {
+	Peer, PeerErr := C.peerInode(ID)
+
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return ID, 0, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
 	}
 
 	// If already kludge-paired this, return its kludge-pal
-	if EPI.KludgePair != nil {
-		return EPI.KludgePair.ID, nil
+	if EPI.KludgePair.isValid() {
+		Pair := C.deref(EPI.KludgePair)
+		if Pair == nil {
+			return ID, 0, ErrNoPeer
+		}
+		return int(Pair.ID), Pair.SentMark, nil
 	}
 
 	// XXX: Zero is a valid CRC value!!
 	// If we already received CRC information, ensure it's the same
 	if EPI.S_CRC != 0 || EPI.R_CRC != 0 {
 		if EPI.S_CRC != S_CRC && EPI.R_CRC != R_CRC {
-			return ID, errors.New("pairing attempted with changed CRC values")
+			return ID, 0, errors.New("pairing attempted with changed CRC values")
 		}
 	}
 
-	if !EPI.Src.isValid() || !EPI.Dst.isValid() {
-		return ID, errors.New("pairing without endpoint information")
+	if EPI.Unix {
+		if EPI.Inode == 0 {
+			// Its peer couldn't be found.
+			return ID, 0, ErrNoPeer
+		}
+	} else if !EPI.Src.isValid() || !EPI.Dst.isValid() {
+		return ID, 0, errors.New("pairing without endpoint information")
 	}
 
 	EPI.S_CRC = S_CRC
 	EPI.R_CRC = R_CRC
-
-	// Find matches ignoring timing information and crc
-	Matches := []int{}
-
-	for k, v := range C.EPMap {
-		if k == ID {
-			continue
-		}
-		if EPI.matchesWithoutCRC(v) {
-			Matches = append(Matches, k)
-		}
+	EPI.Offered = true
+	if Sent >= 0 {
+		EPI.Drains = true
+		EPI.SentMark = Sent
 	}
 
-	if len(Matches) > 1 {
-		return ID, errors.New("too many potential matches")
+	// If the kernel told us who our peer is, that's the only
+	// possible match.  Otherwise fall back to guessing
+	// from addresses and timings.
+	var Match *EndPointInfo
+	if EPI.Inode != 0 && PeerErr == ErrNoSocket {
+		return ID, 0, ErrNoPeer
 	}
-	if len(Matches) > 0 {
-		MatchID := Matches[0]
-		Match := C.EPMap[MatchID]
-		// Try to find endpoints that could
-		// be matched with our potential match.
-		Dups := []int{}
-		for k, v := range C.EPMap {
-			if k == ID {
-				continue
+	if EPI.Inode != 0 && PeerErr == nil {
+		// Peer not accepted yet (zero) can't have registered.
+		if Peer != 0 {
+			EPI.PeerInode = Peer
+			P := C.infoPeer(EPI)
+			if P != nil && P.Skip {
+				return ID, 0, ErrNoPeer
 			}
-			if Match.matchesWithoutCRC(v) {
-				Dups = append(Dups, k)
+			// An AF_UNIX peer using libipc registers as soon as
+			// it's accepted, before anything is sent to us.
+			if P == nil && EPI.Unix {
+				return ID, 0, ErrNoPeer
 			}
+			Match = C.matchByInode(EPI)
 		}
-
-		if len(Dups) > 0 {
-			return ID, errors.New("potential dup detected")
+	} else {
+		var err error
+		Match, err = C.matchByAddress(EPI)
+		if err != nil {
+			return ID, 0, err
 		}
+	}
 
-		// No dups! Let's check CRC:
-		if EPI.matches(Match) {
-			EPI.KludgePair = Match
-			Match.KludgePair = EPI
-			return MatchID, nil
-		}
+	if Match != nil {
+		C.setPair(EPI, Match)
+		return int(Match.ID), Match.SentMark, nil
 	}
 	// NOPAIR
 	// If this is the last time the program
@@ -501,6 +1175,194 @@ func (C *IPCContext) find_pair(ID, S_CRC, R_CRC int, LastTry bool) (int, error)
 	if LastTry {
 		EPI.S_CRC = 0
 		EPI.R_CRC = 0
+		EPI.Offered = false
+	}
+	return ID, 0, nil
+}
+
+// The endpoint for our peer's socket, if it has registered
+// and agrees on what was sent.  No ambiguity to worry about.
+// If both ends drain, what's still in flight is read once
+// paired, so there's nothing to agree on: CRC's are ignored.
+// Must hold PairLock.
+func (C *IPCContext) matchByInode(EPI *EndPointInfo) *EndPointInfo {
+	k, ok := C.Inodes[EPI.PeerInode]
+	if !ok {
+		return nil
+	}
+	v := C.lookup(int(k))
+	if v == nil || v.KludgePair.isValid() || !v.Offered {
+		return nil
+	}
+	if EPI.Drains && v.Drains {
+		return v
+	}
+	if EPI.S_CRC != v.R_CRC || EPI.R_CRC != v.S_CRC {
+		return nil
+	}
+	return v
+}
+
+// The endpoint a link is to, nil if none or it's gone
+// (even if its ID has been reused since).
+func (C *IPCContext) deref(Ref EPRef) *EndPointInfo {
+	if !Ref.isValid() {
+		return nil
+	}
+	S := C.shard(int(Ref.ID))
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	EPI := C.getLocked(int(Ref.ID))
+	if EPI == nil || EPI.Gen != Ref.Gen {
+		return nil
+	}
+	return EPI
+}
+
+// ID of a paired endpoint's pair, ErrNoPeer if it's gone.
+// Must hold PairLock.
+func (C *IPCContext) pairOf(EPI *EndPointInfo) (int, error) {
+	Pair := C.deref(EPI.KludgePair)
+	if Pair == nil {
+		return int(EPI.ID), ErrNoPeer
+	}
+	return int(Pair.ID), nil
+}
+
+// Matching endpoint with our addresses reversed, if there is
+// exactly one that could be it.
+// Must hold PairLock.
+func (C *IPCContext) matchByAddress(EPI *EndPointInfo) (*EndPointInfo, error) {
+	// Find matches ignoring timing information and crc.
+	// Only endpoints with our addresses reversed can match.
+	var Match *EndPointInfo
+	Matches := 0
+	for _, k := range C.PairIndex[PairKey{EPI.Dst, EPI.Src}] {
+		if v := C.lookup(int(k)); v != nil && EPI.matchesWithoutCRC(v) {
+			Match = v
+			Matches++
+		}
+	}
+
+	if Matches > 1 {
+		return nil, errors.New("too many potential matches")
+	}
+	if Matches == 0 {
+		return nil, nil
+	}
+	if Match.Skip {
+		// Won't be pairing at all.
+		return nil, ErrNoPeer
+	}
+	// Try to find endpoints that could
+	// be matched with our potential match.
+	// These share our addresses.
+	for _, k := range C.PairIndex[PairKey{EPI.Src, EPI.Dst}] {
+		if k == EPI.ID {
+			continue
+		}
+		if v := C.lookup(int(k)); v != nil && Match.matchesWithoutCRC(v) {
+			return nil, errors.New("potential dup detected")
+		}
+	}
+
+	if Match.KludgePair.isValid() || !Match.Offered {
+		// Not offered yet: its CRC's and sent mark aren't known,
+		// so can't be checked or drained up to.
+		return nil, nil
+	}
+	// No dups! Let's check CRC:
+	if EPI.matches(Match) {
+		return Match, nil
+	}
+	return nil, nil
+}
+
+// Pair endpoint connected to one of our listeners before
+// anything is sent, so it can use the local transport from
+// the very first byte.  Both ends offer to pair, the first
+// to arrive waits (asking again) for the other, until it
+// gives up (Done) and withdraws its offer.
+// ErrNoPeer means the other end won't be pairing this way.
+func (C *IPCContext) find_pair_fast(ID int, Done bool) (int, error) {
+	Peer, PeerErr := C.peerInode(ID)
+
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+
+	EPI := C.lookup(ID)
+	if EPI == nil {
+		return ID, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+	}
+
+	// Paired when our peer arrived
+	if EPI.KludgePair.isValid() {
+		return C.pairOf(EPI)
+	}
+
+	if !EPI.Fast || EPI.FastState == FAST_WITHDRAWN || PeerErr != nil {
+		EPI.FastState = FAST_WITHDRAWN
+		return ID, ErrNoPeer
+	}
+
+	if Peer != 0 {
+		EPI.PeerInode = Peer
+		if k, ok := C.Inodes[Peer]; ok {
+			v := C.lookup(int(k))
+			if v != nil && !v.KludgePair.isValid() {
+				if v.FastState == FAST_OFFERED {
+					C.setPair(EPI, v)
+					return int(v.ID), nil
+				}
+				if !v.Fast || v.FastState == FAST_WITHDRAWN {
+					EPI.FastState = FAST_WITHDRAWN
+					return ID, ErrNoPeer
+				}
+			}
+		}
+	}
+
+	if Done {
+		EPI.FastState = FAST_WITHDRAWN
+	} else {
+		EPI.FastState = FAST_OFFERED
 	}
 	return ID, nil
 }
+
+// Claim references taken for us by our parent before fork().
+func (C *IPCContext) adopt(Child, Parent int) int {
+	return C.Owners.adopt(Child, Parent)
+}
+
+// Stop considering endpoints registered before the given time
+// that still haven't sent ENDPOINT_INFO.  Their ID's remain
+// reserved until their owners unregister them (or exit),
+// so a late UNREGISTER can't affect a different endpoint.
+func (C *IPCContext) expireUnpaired(Before int64) {
+	Expired := 0
+	Limit := C.IDs.limit()
+	for i := range C.Shards {
+		C.PairLock.Lock()
+		S := &C.Shards[i]
+		S.Lock.Lock()
+		for ID := i; ID < Limit; ID += NUM_SHARDS {
+			EPI := C.getLocked(ID)
+			if EPI == nil || EPI.Src.isValid() || EPI.Unix || EPI.LocalPeer.isValid() ||
+				EPI.KludgePair.isValid() || EPI.Registered >= Before {
+				continue
+			}
+			EPI.Expired = true
+			if C.WaitingID == EPI.ID {
+				C.WaitingID = -1
+			}
+			Expired++
+		}
+		S.Lock.Unlock()
+		C.PairLock.Unlock()
+	}
+	if Expired > 0 {
+		log.Printf("Expired %d endpoint(s) without endpoint information\n", Expired)
+	}
+}
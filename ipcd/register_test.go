@@ -0,0 +1,824 @@
+package main
+
+// Unit tests for endpoint table.
+
+import (
+	"os"
+	"strings"
+	"syscall"
+	"testing"
+	"time"
+)
+
+// Registration shouldn't allocate once the slab has room.
+func TestRegisterNoAllocs(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	Owner := os.Getpid()
+	ID, err := C.register(1, 10, 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	allocs := testing.AllocsPerRun(100, func() {
+		ID, err := C.register(1, 11, Owner)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if err := C.unregister(ID, Owner); err != nil {
+			t.Fatal(err)
+		}
+	})
+	if allocs != 0 {
+		t.Fatalf("Registration allocated %v times per run", allocs)
+	}
+	C.unregister(ID, 0)
+}
+
+// Endpoints spanning several slab chunks are all reachable,
+// and freed slots are reused lowest-first.
+func TestSlabGrowth(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	const N = 3*SLAB_CHUNK_SIZE + 7
+	for i := 0; i < N; i++ {
+		if ID, _ := C.register(1, i, 0); ID != i {
+			t.Fatalf("Unexpected ID %d, expected %d", ID, i)
+		}
+	}
+	for _, ID := range []int{5, SLAB_CHUNK_SIZE + 1, N - 1} {
+		if EPI := C.lookup(ID); EPI == nil || EPI.EP.FD != ID {
+			t.Fatalf("Unable to find endpoint %d", ID)
+		}
+	}
+	C.unregister(SLAB_CHUNK_SIZE+1, 0)
+	if C.lookup(SLAB_CHUNK_SIZE+1) != nil {
+		t.Fatal("Found unregistered endpoint")
+	}
+	if ID, _ := C.register(2, 0, 0); ID != SLAB_CHUNK_SIZE+1 {
+		t.Fatalf("Unexpected ID %d after unregister", ID)
+	}
+	if Removed := C.removeall(1); Removed != N-1 {
+		t.Fatalf("Removed %d endpoints, expected %d", Removed, N-1)
+	}
+}
+
+// Only owners may drop references, and references
+// REREGISTER'd for children are released by whoever adopts them.
+func TestOwnership(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	const Parent, Child, Other = 100, 101, 102
+
+	ID, _ := C.register(1, 10, Parent)
+	if err := C.unregister(ID, Other); err == nil {
+		t.Fatal("Unregistered endpoint not owned by caller")
+	}
+	if err := C.reregister(ID, 1, 10, Other); err == nil {
+		t.Fatal("Reregistered endpoint not owned by caller")
+	}
+	if err := C.reregister(ID, 1, 10, Parent); err != nil {
+		t.Fatal(err)
+	}
+	if N := C.adopt(Child, Parent); N != 1 {
+		t.Fatalf("Adopted %d references, expected 1", N)
+	}
+
+	// Parent exits, child still holds its reference
+	C.reclaimProcess(Parent)
+	if C.lookup(ID) == nil {
+		t.Fatal("Endpoint removed while child still holds reference")
+	}
+	C.reclaimProcess(Child)
+	if C.lookup(ID) != nil {
+		t.Fatal("Endpoint not removed after all owners exited")
+	}
+}
+
+// Pending references of an exited process are kept
+// for its children to adopt, for a while.
+func TestAdoptAfterParentExit(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	const Parent, Child = 100, 101
+
+	ID, _ := C.register(1, 10, Parent)
+	C.reregister(ID, 1, 10, Parent)
+	C.reclaimProcess(Parent)
+	if C.lookup(ID) == nil {
+		t.Fatal("Endpoint with pending reference removed")
+	}
+	if N := C.adopt(Child, Parent); N != 1 {
+		t.Fatalf("Adopted %d references, expected 1", N)
+	}
+	if err := C.unregister(ID, Child); err != nil {
+		t.Fatal(err)
+	}
+	if C.lookup(ID) != nil {
+		t.Fatal("Endpoint not removed after last reference dropped")
+	}
+
+	// Never adopted: dropped once grace period expires.
+	ID, _ = C.register(1, 10, Parent)
+	C.reregister(ID, 1, 10, Parent)
+	C.reclaimProcess(Parent)
+	C.dropRefs(C.Owners.expirePending(time.Now().UnixNano()))
+	if C.lookup(ID) != nil {
+		t.Fatal("Endpoint not removed after grace period")
+	}
+}
+
+// Endpoints that never sent ENDPOINT_INFO are expired,
+// but their ID isn't reused until unregistered.
+func TestExpireUnpaired(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	ID, _ := C.register(1, 10, 0)
+	Paired, _ := C.register(1, 11, 0)
+	var IP [16]byte
+	C.endpoint_info(Paired, NetAddr{IP, 1}, NetAddr{IP, 2}, 0, 0, false, 0, false, ProgName{})
+
+	C.expireUnpaired(time.Now().UnixNano())
+	if C.lookup(ID) != nil {
+		t.Fatal("Unpaired endpoint not expired")
+	}
+	if C.lookup(Paired) == nil {
+		t.Fatal("Endpoint with information expired")
+	}
+	if New, _ := C.register(1, 12, 0); New == ID {
+		t.Fatal("Expired endpoint ID reused before unregister")
+	}
+	if err := C.unregister(ID, 0); err != nil {
+		t.Fatal(err)
+	}
+	if New, _ := C.register(1, 13, 0); New != ID {
+		t.Fatalf("Unexpected ID %d, expected %d", New, ID)
+	}
+}
+
+// Registration and pairing requests are refused when
+// too many are in progress, other requests aren't.
+func TestAdmission(t *testing.T) {
+	Config := DefaultConfig()
+	Config.MaxInFlight = 1
+	C := NewContext(Config)
+	CC := NewClientConn(nil)
+
+	Req := func(Line string) *ReqError {
+		return processRequest(C, CC, splitTokens([]byte(Line), CC.Tokens[:]))
+	}
+	if err := Req("REGISTER 1 10"); err != nil {
+		t.Fatal(err)
+	}
+
+	C.Admission.tryAcquire()
+	for _, Line := range []string{"REGISTER 1 11", "FIND_PAIR 0 1 2 0", "ENDPOINT_INFO 0 1.1.1.1 1 2.2.2.2 2 0 0 0 0 0"} {
+		if err := Req(Line); err == nil || err.Type != REQ_ERR_BUSY {
+			t.Fatalf("Request '%s' not refused while busy: %v", Line, err)
+		}
+	}
+	// Giving up on pairing always gets through.
+	if err := Req("FIND_PAIR 0 1 2 1"); err != nil && err.Type == REQ_ERR_BUSY {
+		t.Fatal("Last pairing attempt refused while busy")
+	}
+	if err := Req("UNREGISTER 0"); err != nil {
+		t.Fatal(err)
+	}
+	C.Admission.release()
+
+	if err := Req("REGISTER 1 10"); err != nil {
+		t.Fatal(err)
+	}
+}
+
+// Localizing uses pooled transports when available,
+// and returns them to the pool when not needed.
+func TestTransportPool(t *testing.T) {
+	Config := DefaultConfig()
+	Config.PoolSize = 2
+	C := NewContext(Config)
+	T, err := NewTransport(syscall.SOCK_STREAM)
+	if err != nil {
+		t.Fatal(err)
+	}
+	C.Transports.put(T)
+
+	A, _ := C.register(1, 10, 0)
+	B, _ := C.register(1, 11, 0)
+	if err := C.localize(A, B); err != nil {
+		t.Fatal(err)
+	}
+	if len(C.Transports.Ready) != 0 {
+		t.Fatal("Pooled transport not used")
+	}
+	if FD, _ := C.getLocalFD(A); FD != T.A {
+		t.Fatalf("Unexpected local fd %d, expected %d", FD, T.A)
+	}
+
+	// Already localized, transport goes back to the pool
+	if err := C.localize(B, A); err != nil {
+		t.Fatal(err)
+	}
+	if len(C.Transports.Ready) != 1 {
+		t.Fatal("Unused transport not returned to pool")
+	}
+
+	// Pool is refilled in the background
+	C.Transports.start()
+	C.Transports.get()
+	for i := 0; i < 100 && len(C.Transports.Ready) < 2; i++ {
+		time.Sleep(time.Millisecond)
+	}
+	if len(C.Transports.Ready) != 2 {
+		t.Fatal("Pool not refilled")
+	}
+}
+
+// With the kernel's help, endpoints pair with their true peer
+// even when addresses and timings can't tell them apart.
+func TestPairByInode(t *testing.T) {
+	var IP [16]byte
+	A, B, X := NetAddr{IP, 1}, NetAddr{IP, 2}, NetAddr{IP, 3}
+	Sockets := map[PairKey]uint32{{A, B}: 101, {B, A}: 201, {X, A}: 301}
+	Lookup := func(Src, Dst NetAddr) (uint32, error) {
+		if Inode, ok := Sockets[PairKey{Src, Dst}]; ok {
+			return Inode, nil
+		}
+		return 0, ErrNoSocket
+	}
+	Setup := func(C *IPCContext) (Client, Server, Remote int) {
+		Client, _ = C.register(1, 10, 0)
+		Stale, _ := C.register(1, 11, 0)
+		Server, _ = C.register(2, 10, 0)
+		Remote, _ = C.register(2, 11, 0)
+		C.endpoint_info(Client, A, B, 0, 0, false, 101, false, ProgName{})
+		// Same addresses, but not the socket the kernel knows
+		C.endpoint_info(Stale, A, B, 0, 0, false, 102, false, ProgName{})
+		C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{})
+		C.endpoint_info(Remote, X, A, 0, 0, false, 301, false, ProgName{})
+		return
+	}
+
+	// Without the kernel's help, that's ambiguous.
+	C := NewContext(DefaultConfig())
+	Client, Server, _ := Setup(C)
+	C.find_pair(Client, 2, 1, false)
+	if _, err := C.find_pair(Server, 1, 2, false); err == nil {
+		t.Fatal("Ambiguous pairing not refused")
+	}
+
+	C = NewContext(DefaultConfig())
+	C.SockLookup = Lookup
+	Client, Server, Remote := Setup(C)
+	if Pair, err := C.find_pair(Server, 1, 2, false); err != nil || Pair != Server {
+		t.Fatalf("Paired before peer sent CRC's: %d, %v", Pair, err)
+	}
+	if Pair, err := C.find_pair(Client, 2, 1, false); err != nil || Pair != Server {
+		t.Fatalf("Client not paired with server: %d, %v", Pair, err)
+	}
+	if Pair, err := C.find_pair(Server, 1, 2, false); err != nil || Pair != Client {
+		t.Fatalf("Server not paired with client: %d, %v", Pair, err)
+	}
+	if _, err := C.find_pair(Remote, 1, 2, false); err != ErrNoPeer {
+		t.Fatalf("Expected ErrNoPeer, got %v", err)
+	}
+
+	// Without the kernel's help, a peer that hasn't offered
+	// isn't paired with: there's nothing to check it against.
+	C = NewContext(DefaultConfig())
+	Client, _ = C.register(1, 10, 0)
+	Server, _ = C.register(2, 10, 0)
+	C.endpoint_info(Client, A, B, 0, 0, false, 0, false, ProgName{})
+	C.endpoint_info(Server, B, A, 0, 0, true, 0, false, ProgName{})
+	if Pair, _, err := C.find_pair_mark(Client, 0, 0, false, 0); err != nil || Pair != Client {
+		t.Fatalf("Paired before peer offered: %d, %v", Pair, err)
+	}
+	if Pair, _, err := C.find_pair_mark(Server, 0, 0, false, 100); err != nil || Pair != Client {
+		t.Fatalf("Server not paired with client: %d, %v", Pair, err)
+	}
+
+	// Ends that drain pair despite data in flight,
+	// learning how much the other sent.
+	C = NewContext(DefaultConfig())
+	C.SockLookup = Lookup
+	Client, Server, _ = Setup(C)
+	if Pair, _, err := C.find_pair_mark(Server, 1, 2, false, 70000); err != nil || Pair != Server {
+		t.Fatalf("Paired before peer offered: %d, %v", Pair, err)
+	}
+	if Pair, Sent, err := C.find_pair_mark(Client, 3, 1, false, 65536); err != nil || Pair != Server || Sent != 70000 {
+		t.Fatalf("Client not paired with server: %d, %d, %v", Pair, Sent, err)
+	}
+	if Pair, Sent, err := C.find_pair_mark(Server, 1, 2, false, 70000); err != nil || Pair != Client || Sent != 65536 {
+		t.Fatalf("Server not paired with client: %d, %d, %v", Pair, Sent, err)
+	}
+}
+
+// Once one of a pair is gone, the other's link to it doesn't
+// follow its ID to the endpoint reusing it.
+func TestPairGone(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	var IP [16]byte
+	A, B := NetAddr{IP, 1}, NetAddr{IP, 2}
+	Client, _ := C.register(1, 10, 0)
+	Server, _ := C.register(2, 10, 0)
+	C.endpoint_info(Client, A, B, 0, 0, false, 0, false, ProgName{})
+	C.endpoint_info(Server, B, A, 0, 0, true, 0, false, ProgName{})
+	C.find_pair_mark(Client, 1, 2, false, 10)
+	if Pair, _, err := C.find_pair_mark(Server, 2, 1, false, 20); err != nil || Pair != Client {
+		t.Fatalf("Not paired: %d, %v", Pair, err)
+	}
+
+	C.unregister(Client, 0)
+	if New, _ := C.register(3, 10, 0); New != Client {
+		t.Fatalf("Unexpected ID %d, expected %d", New, Client)
+	}
+	if Pair, Sent, err := C.find_pair_mark(Server, 2, 1, false, 20); err != ErrNoPeer {
+		t.Fatalf("Expected ErrNoPeer, got %d, %d, %v", Pair, Sent, err)
+	}
+	if err := C.localize(Server, Client); err == nil {
+		t.Fatal("Localized with endpoint reusing pair's ID")
+	}
+}
+
+// Connected UDP sockets pair with the one they're connected to,
+// not with TCP connections that happen to share their addresses,
+// over a transport that keeps datagrams whole.
+func TestPairDgram(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	var IP [16]byte
+	A, B := NetAddr{IP, 1}, NetAddr{IP, 2}
+	Client, _ := C.register(1, 10, 0)
+	Server, _ := C.register(2, 10, 0)
+	U1, _ := C.register(1, 11, 0)
+	U2, _ := C.register(2, 11, 0)
+	C.endpoint_info(Client, A, B, 0, 0, false, 0, false, ProgName{})
+	C.endpoint_info(Server, B, A, 0, 0, true, 0, false, ProgName{})
+	C.endpoint_info(U1, A, B, 0, 0, false, 0, true, ProgName{})
+	C.endpoint_info(U2, B, A, 0, 0, false, 0, true, ProgName{})
+
+	if Pair, _, err := C.find_pair_mark(U1, 1, 2, false, 3); err != nil || Pair != U1 {
+		t.Fatalf("Paired before peer offered: %d, %v", Pair, err)
+	}
+	if Pair, Sent, err := C.find_pair_mark(U2, 2, 1, false, 5); err != nil || Pair != U1 || Sent != 3 {
+		t.Fatalf("Datagram endpoints not paired: %d, %d, %v", Pair, Sent, err)
+	}
+	C.find_pair(Server, 1, 2, false)
+	if Pair, err := C.find_pair(Client, 2, 1, false); err != nil || Pair != Server {
+		t.Fatalf("Client not paired with server: %d, %v", Pair, err)
+	}
+
+	FD, err := C.localizeFD(U1, U2)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer syscall.Close(FD)
+	if Type, _ := syscall.GetsockoptInt(FD, syscall.SOL_SOCKET, syscall.SO_TYPE); Type != syscall.SOCK_SEQPACKET {
+		t.Fatalf("Datagram transport of type %d", Type)
+	}
+	if FD, err := C.getLocalFD(U2); err == nil {
+		syscall.Close(FD)
+	}
+}
+
+// Connections to our listeners pair before anything is sent,
+// once both ends have offered (when not learning what they carry).
+func TestPairFast(t *testing.T) {
+	Config := DefaultConfig()
+	Config.LearnThreshold = 0
+	C := NewContext(Config)
+	var IP [16]byte
+	IP[10], IP[11] = 0xff, 0xff
+	A, B, X := NetAddr{IP, 1}, NetAddr{IP, 2}, NetAddr{IP, 3}
+	Sockets := map[PairKey]uint32{{A, B}: 101, {B, A}: 201, {A, X}: 102, {X, A}: 301}
+	C.SockLookup = func(Src, Dst NetAddr) (uint32, error) {
+		if Inode, ok := Sockets[PairKey{Src, Dst}]; ok {
+			return Inode, nil
+		}
+		return 0, ErrNoSocket
+	}
+
+	Listener, _ := C.register(2, 10, 0)
+	if err := C.listen(Listener, NetAddr{Port: 2}); err != nil {
+		t.Fatal(err)
+	}
+	Client, _ := C.register(1, 10, 0)
+	Server, _ := C.register(2, 11, 0)
+	Other, _ := C.register(1, 11, 0)
+	if Hint, _ := C.endpoint_info(Client, A, B, 0, 0, false, 101, false, ProgName{}); Hint != HINT_FAST {
+		t.Fatal("Connection to listener not fast")
+	}
+	if Hint, _ := C.endpoint_info(Other, A, X, 0, 0, false, 102, false, ProgName{}); Hint == HINT_FAST {
+		t.Fatal("Connection without listener fast")
+	}
+	if _, err := C.find_pair_fast(Other, false); err != ErrNoPeer {
+		t.Fatalf("Expected ErrNoPeer, got %v", err)
+	}
+
+	if Pair, err := C.find_pair_fast(Client, false); err != nil || Pair != Client {
+		t.Fatalf("Paired before server offered: %d, %v", Pair, err)
+	}
+	if Hint, _ := C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{}); Hint != HINT_FAST {
+		t.Fatal("Accepted connection not fast")
+	}
+	if Pair, err := C.find_pair_fast(Server, true); err != nil || Pair != Client {
+		t.Fatalf("Server not paired with client: %d, %v", Pair, err)
+	}
+	if Pair, err := C.find_pair_fast(Client, true); err != nil || Pair != Server {
+		t.Fatalf("Client not paired with server: %d, %v", Pair, err)
+	}
+
+	// Once one end gives up, the other needn't wait.
+	C.unregister(Client, 0)
+	C.unregister(Server, 0)
+	Client, _ = C.register(1, 10, 0)
+	Server, _ = C.register(2, 11, 0)
+	C.endpoint_info(Client, A, B, 0, 0, false, 101, false, ProgName{})
+	C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{})
+	if Pair, err := C.find_pair_fast(Server, true); err != nil || Pair != Server {
+		t.Fatalf("Unexpected pairing: %d, %v", Pair, err)
+	}
+	if _, err := C.find_pair_fast(Client, false); err != ErrNoPeer {
+		t.Fatalf("Expected ErrNoPeer, got %v", err)
+	}
+}
+
+// IPv6 endpoints pair like IPv4 ones, and an AF_INET6 socket's
+// v4-mapped addresses match its AF_INET peer's.
+func TestPairIPv6(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	Addr := func(IP string, Port int) NetAddr {
+		Parsed, err := parseIP([]byte(IP))
+		if err != nil {
+			t.Fatal(err)
+		}
+		return NetAddr{Parsed, Port}
+	}
+	Pairs := []struct {
+		ClientSrc, ClientDst, ServerSrc, ServerDst NetAddr
+	}{
+		{Addr("::1", 1), Addr("::1", 2), Addr("::1", 2), Addr("::1", 1)},
+		{Addr("::ffff:127.0.0.1", 3), Addr("::ffff:127.0.0.1", 4), Addr("127.0.0.1", 4), Addr("127.0.0.1", 3)},
+		{Addr("127.0.0.1", 5), Addr("127.0.0.1", 6), Addr("::ffff:127.0.0.1", 6), Addr("::ffff:127.0.0.1", 5)},
+	}
+	for i, P := range Pairs {
+		Client, _ := C.register(1, 10+i, 0)
+		Server, _ := C.register(2, 10+i, 0)
+		C.endpoint_info(Client, P.ClientSrc, P.ClientDst, 0, 0, false, 0, false, ProgName{})
+		C.endpoint_info(Server, P.ServerSrc, P.ServerDst, 0, 0, true, 0, false, ProgName{})
+		C.find_pair(Server, 1, 2, false)
+		if Pair, err := C.find_pair(Client, 2, 1, false); err != nil || Pair != Server {
+			t.Errorf("Case %d: client not paired with server: %d, %v", i, Pair, err)
+		}
+	}
+
+	// in6addr_any listens for both, INADDR_ANY for IPv4 only.
+	Any6, _ := C.register(3, 10, 0)
+	Any4, _ := C.register(3, 11, 0)
+	C.listen(Any6, Addr("::", 7))
+	C.listen(Any4, Addr("0.0.0.0", 8))
+	C.PairLock.Lock()
+	defer C.PairLock.Unlock()
+	if !C.isListener(Addr("::1", 7)) || !C.isListener(Addr("127.0.0.1", 7)) {
+		t.Error("Connection to in6addr_any listener not found")
+	}
+	if !C.isListener(Addr("127.0.0.1", 8)) {
+		t.Error("Connection to INADDR_ANY listener not found")
+	}
+	if C.isListener(Addr("::1", 8)) {
+		t.Error("IPv6 connection to INADDR_ANY listener")
+	}
+}
+
+// AF_UNIX endpoints pair with the peer the kernel names, over
+// a transport carrying the ring's memory, one side on each end.
+func TestPairUnix(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	Peers := map[uint32]uint32{101: 201, 201: 101, 401: 501}
+	C.UnixLookup = func(Inode uint32) (uint32, error) {
+		if Peer, ok := Peers[Inode]; ok {
+			return Peer, nil
+		}
+		return 0, ErrNoSocket
+	}
+	Client, _ := C.register(1, 10, 0)
+	Server, _ := C.register(2, 10, 0)
+	Lost, _ := C.register(1, 11, 0)
+	if Hint, err := C.unix_info(Client, 101, ProgName{}); err != nil || Hint != HINT_NONE {
+		t.Fatalf("Client: %d, %v", Hint, err)
+	}
+	C.unix_info(Server, 201, ProgName{})
+	if Hint, err := C.unix_info(Lost, 301, ProgName{}); err != nil || Hint != HINT_SKIP {
+		t.Fatalf("Endpoint without peer not skipped: %d, %v", Hint, err)
+	}
+	var IP [16]byte
+	if _, err := C.endpoint_info(Client, NetAddr{IP, 1}, NetAddr{IP, 2}, 0, 0, false, 0, false, ProgName{}); err == nil {
+		t.Error("AF_UNIX endpoint given addresses")
+	}
+	C.expireUnpaired(time.Now().UnixNano() + 1)
+
+	if Pair, _, err := C.find_pair_mark(Client, 1, 2, false, 3); err != nil || Pair != Client {
+		t.Fatalf("Paired before peer offered: %d, %v", Pair, err)
+	}
+	if Pair, Sent, err := C.find_pair_mark(Server, 5, 6, false, 4); err != nil || Pair != Client || Sent != 3 {
+		t.Fatalf("AF_UNIX endpoints not paired: %d, %d, %v", Pair, Sent, err)
+	}
+	if _, _, err := C.find_pair_mark(Lost, 1, 2, false, 0); err != ErrNoPeer {
+		t.Errorf("Endpoint without peer: %v", err)
+	}
+	Alone, _ := C.register(1, 12, 0)
+	C.unix_info(Alone, 401, ProgName{})
+	if _, _, err := C.find_pair_mark(Alone, 1, 2, false, 0); err != ErrNoPeer {
+		t.Errorf("Endpoint with unregistered peer: %v", err)
+	}
+
+	Sides := ""
+	for _, ID := range []int{Client, Server} {
+		FD, err := C.localizeFD(ID, Client+Server-ID)
+		if err != nil {
+			t.Fatal(err)
+		}
+		defer syscall.Close(FD)
+		if !C.isRing(ID) {
+			t.Fatal("AF_UNIX endpoint not given a ring")
+		}
+		Side := make([]byte, 2)
+		OOB := make([]byte, syscall.CmsgSpace(4))
+		n, oobn, _, _, err := syscall.Recvmsg(FD, Side, OOB, syscall.MSG_DONTWAIT)
+		if err != nil || n != 1 {
+			t.Fatalf("No ring on local fd: %d, %v", n, err)
+		}
+		Msgs, _ := syscall.ParseSocketControlMessage(OOB[:oobn])
+		if len(Msgs) != 1 {
+			t.Fatal("Ring memory not sent")
+		}
+		FDs, _ := syscall.ParseUnixRights(&Msgs[0])
+		var St syscall.Stat_t
+		syscall.Fstat(FDs[0], &St)
+		syscall.Close(FDs[0])
+		if St.Size != 2*(RING_HEADER_SIZE+RING_SIZE) {
+			t.Errorf("Ring memory of size %d", St.Size)
+		}
+		Sides += string(Side[:1])
+	}
+	if Sides != "01" && Sides != "10" {
+		t.Errorf("Ring sides %q", Sides)
+	}
+}
+
+// A process connected to itself gets a ring, others don't
+// (unless policy says otherwise).  Which process registered an
+// endpoint goes by its credentials, agreeing with the PID it claims.
+func TestPairSameProcess(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	var IP [16]byte
+	A, B := NetAddr{IP, 1}, NetAddr{IP, 2}
+	Sockets := map[PairKey]uint32{{A, B}: 101, {B, A}: 201}
+	C.SockLookup = func(Src, Dst NetAddr) (uint32, error) {
+		if Inode, ok := Sockets[PairKey{Src, Dst}]; ok {
+			return Inode, nil
+		}
+		return 0, ErrNoSocket
+	}
+	for _, Case := range []struct {
+		PIDs, Owners [2]int
+		Policy       string
+		Ring         bool
+	}{
+		{[2]int{1, 2}, [2]int{1, 2}, "", false},
+		{[2]int{3, 3}, [2]int{3, 3}, "", true},
+		{[2]int{3, 3}, [2]int{0, 0}, "", false},
+		{[2]int{3, 3}, [2]int{3, 4}, "", false},
+		{[2]int{3, 3}, [2]int{5, 5}, "", false},
+		{[2]int{3, 3}, [2]int{3, 3}, "transport=unix", false},
+		{[2]int{1, 2}, [2]int{1, 2}, "transport=ring", true},
+	} {
+		var err error
+		if C.Policy, err = parsePolicy(strings.NewReader(Case.Policy)); err != nil {
+			t.Fatal(err)
+		}
+		PIDs := Case.PIDs
+		Client, _ := C.register(PIDs[0], 10, Case.Owners[0])
+		Server, _ := C.register(PIDs[1], 11, Case.Owners[1])
+		C.endpoint_info(Client, A, B, 0, 0, false, 101, false, ProgName{})
+		C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{})
+		C.find_pair(Client, 2, 1, false)
+		if Pair, err := C.find_pair(Server, 1, 2, false); err != nil || Pair != Client {
+			t.Fatalf("PIDs %v: not paired: %d, %v", PIDs, Pair, err)
+		}
+		FD, err := C.localizeFD(Client, Server)
+		if err != nil {
+			t.Fatal(err)
+		}
+		syscall.Close(FD)
+		if C.isRing(Client) != Case.Ring || C.isRing(Server) != Case.Ring {
+			t.Errorf("PIDs %v, owners %v, policy '%s': ring %v", PIDs, Case.Owners,
+				Case.Policy, !Case.Ring)
+		}
+		C.unregister(Client, 0)
+		C.unregister(Server, 0)
+	}
+}
+
+// Connections from a program to a listener that rarely carry much
+// stop being tracked, by both ends; ones that sometimes do are
+// left to pair at the threshold.
+func TestLearnedPolicy(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	var IP [16]byte
+	IP[10], IP[11] = 0xff, 0xff
+	A, B := NetAddr{IP, 1}, NetAddr{IP, 2}
+	Sockets := map[PairKey]uint32{{A, B}: 101, {B, A}: 201}
+	C.SockLookup = func(Src, Dst NetAddr) (uint32, error) {
+		if Inode, ok := Sockets[PairKey{Src, Dst}]; ok {
+			return Inode, nil
+		}
+		return 0, ErrNoSocket
+	}
+	Listener, _ := C.register(2, 10, 0)
+	if err := C.listen(Listener, NetAddr{Port: 2}); err != nil {
+		t.Fatal(err)
+	}
+
+	Small, Large := ProgName{'s'}, ProgName{'l'}
+	Connect := func(Prog ProgName) (int, int) {
+		Client, _ := C.register(1, 11, 0)
+		Server, _ := C.register(2, 11, 0)
+		CH, _ := C.endpoint_info(Client, A, B, 0, 0, false, 101, false, Prog)
+		SH, _ := C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{})
+		if CH != SH {
+			t.Fatalf("Ends of connection told %d and %d", CH, SH)
+		}
+		return Client, Server
+	}
+	Done := func(Client, Server int, Bytes int64) {
+		C.learn(Client, Bytes, 0, false)
+		C.unregister(Client, 0)
+		C.unregister(Server, 0)
+	}
+	Hint := func(ID int) int {
+		return C.lookup(ID).hint()
+	}
+
+	for i := 0; i < LEARN_MIN_CONNS; i++ {
+		Client, Server := Connect(Small)
+		if Hint(Client) != HINT_NONE {
+			t.Fatalf("Connection without history not left to threshold: %d", Hint(Client))
+		}
+		Done(Client, Server, 100)
+
+		Client, Server = Connect(Large)
+		Done(Client, Server, 1<<20)
+	}
+
+	Client, Server := Connect(Small)
+	if Hint(Client) != HINT_SKIP {
+		t.Fatalf("Small connection not skipped: %d", Hint(Client))
+	}
+	if _, err := C.find_pair(Server, 1, 2, true); err != ErrNoPeer {
+		t.Fatalf("Expected ErrNoPeer pairing with skipped peer, got %v", err)
+	}
+	Done(Client, Server, 1<<20)
+
+	// Still tracked now and then, in case things change.
+	Tracked := 0
+	for i := 0; i < LEARN_EXPLORE; i++ {
+		Client, Server := Connect(Small)
+		if Hint(Client) != HINT_SKIP {
+			Tracked++
+		}
+		Done(Client, Server, 100)
+	}
+	if Tracked != 1 {
+		t.Fatalf("Expected one tracked connection, got %d", Tracked)
+	}
+
+	Client, Server = Connect(Large)
+	if Hint(Client) != HINT_FAST {
+		t.Fatal("Large connection not fast")
+	}
+	Done(Client, Server, 100)
+	Client, Server = Connect(Large)
+	if Hint(Client) != HINT_NONE {
+		t.Fatalf("Connection of mixed size not left to threshold: %d", Hint(Client))
+	}
+	Done(Client, Server, 100)
+}
+
+func TestParsePolicy(t *testing.T) {
+	P, err := parsePolicy(strings.NewReader(`
+# Comment
+port=5432 threshold=4096 calls=8 age=100ms timeout=20ms  # Trailing comment
+net=10.1.0.0/16 port=8000-8099 off
+prog=backup on transport=ring
+`))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(P.Rules) != 3 {
+		t.Fatalf("Expected 3 rules, got %d", len(P.Rules))
+	}
+	Addr := func(IP string, Port int) NetAddr {
+		Parsed, err := parseIP([]byte(IP))
+		if err != nil {
+			t.Fatal(err)
+		}
+		return NetAddr{Parsed, Port}
+	}
+	Cases := []struct {
+		Server NetAddr
+		Prog   ProgName
+		Rule   int32
+	}{
+		{Addr("127.0.0.1", 5432), ProgName{}, 0},
+		{Addr("10.1.2.3", 8050), ProgName{}, 1},
+		{Addr("10.2.2.3", 8050), ProgName{}, -1},
+		{Addr("10.1.2.3", 8100), ProgName{'b', 'a', 'c', 'k', 'u', 'p'}, 2},
+		{Addr("::1", 80), ProgName{'b', 'a', 'c', 'k'}, -1},
+		{InvalidAddr(), ProgName{'b', 'a', 'c', 'k', 'u', 'p'}, 2},
+		{InvalidAddr(), ProgName{}, -1},
+	}
+	for _, C := range Cases {
+		if R := P.match(C.Server, C.Prog); R != C.Rule {
+			t.Errorf("Expected rule %d for %v, got %d", C.Rule, C, R)
+		}
+	}
+	if R := P.rule(0); R.Threshold != 4096 || R.PairTimeout != 20*time.Millisecond ||
+		R.Calls != 8 || R.Age != 100*time.Millisecond {
+		t.Errorf("Unexpected settings: %+v", R)
+	}
+	if R := P.rule(2); R.Transport != TRANSPORT_RING {
+		t.Errorf("Unexpected transport: %+v", R)
+	}
+
+	for _, Bad := range []string{"port=0", "port=9-8", "net=10.0.0.0", "threshold=0",
+		"timeout=1us", "calls=0", "age=1s2", "transport=carrier-pigeon", "color=red", "maybe"} {
+		if _, err := parsePolicy(strings.NewReader(Bad)); err == nil {
+			t.Errorf("Expected '%s' to be rejected", Bad)
+		}
+	}
+}
+
+// Policy rules decide over history, and both ends follow them.
+func TestPolicyRules(t *testing.T) {
+	C := NewContext(DefaultConfig())
+	var err error
+	C.Policy, err = parsePolicy(strings.NewReader("port=2 off\nport=3 on threshold=100\n"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	var IP [16]byte
+	IP[10], IP[11] = 0xff, 0xff
+	A := NetAddr{IP, 1}
+	Sockets := map[PairKey]uint32{}
+	C.SockLookup = func(Src, Dst NetAddr) (uint32, error) {
+		if Inode, ok := Sockets[PairKey{Src, Dst}]; ok {
+			return Inode, nil
+		}
+		return 0, ErrNoSocket
+	}
+	Connect := func(B NetAddr) (int, int) {
+		Sockets[PairKey{A, B}], Sockets[PairKey{B, A}] = 101, 201
+		Client, _ := C.register(1, 11, 0)
+		Server, _ := C.register(2, 11, 0)
+		CH, _ := C.endpoint_info(Client, A, B, 0, 0, false, 101, false, ProgName{})
+		SH, _ := C.endpoint_info(Server, B, A, 0, 0, true, 201, false, ProgName{})
+		if CH != SH || C.lookup(Client).Rule != C.lookup(Server).Rule {
+			t.Fatalf("Ends of connection told %d and %d", CH, SH)
+		}
+		return Client, Server
+	}
+	Done := func(Client, Server int) {
+		C.unregister(Client, 0)
+		C.unregister(Server, 0)
+	}
+
+	Client, Server := Connect(NetAddr{IP, 2})
+	if C.lookup(Client).hint() != HINT_SKIP {
+		t.Fatal("Connection not skipped")
+	}
+	Done(Client, Server)
+
+	// Learned to skip small connections, but policy says not to,
+	// and they're small by its threshold.
+	for i := 0; i < LEARN_MIN_CONNS; i++ {
+		C.Learner.record(ServiceKey{NetAddr{IP, 3}, ProgName{}}, false)
+	}
+	Listener, _ := C.register(2, 10, 0)
+	if err := C.listen(Listener, NetAddr{IP, 3}); err != nil {
+		t.Fatal(err)
+	}
+	Client, Server = Connect(NetAddr{IP, 3})
+	if C.lookup(Client).hint() == HINT_SKIP {
+		t.Fatal("Connection skipped despite policy")
+	}
+	if R := C.endpointRule(Server); R == nil || R.Threshold != 100 {
+		t.Fatalf("Unexpected rule %+v", R)
+	}
+	C.learn(Client, 150, 0, false)
+	if S := C.Learner.Services[ServiceKey{NetAddr{IP, 3}, ProgName{}}]; S.Large != 1 {
+		t.Fatalf("Connection not learned as large: %+v", S)
+	}
+	Done(Client, Server)
+
+	// Small, but got far enough to be paired otherwise.
+	Client, Server = Connect(NetAddr{IP, 3})
+	C.learn(Client, 10, 10, true)
+	if S := C.Learner.Services[ServiceKey{NetAddr{IP, 3}, ProgName{}}]; S.Large != 2 {
+		t.Fatalf("Connection due for pairing not learned as large: %+v", S)
+	}
+	Done(Client, Server)
+}
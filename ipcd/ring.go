@@ -0,0 +1,50 @@
+package main
+
+// Shared-memory rings for stream transports.  Where a pair is to
+// use one (AF_UNIX endpoints, a process connected to itself, or as
+// policy says), each end of its socketpair first carries a one-byte
+// message naming the side it's on ('0' or '1'), along with a file
+// of shared memory: a header page and RING_SIZE bytes of data for
+// each direction.  libipc maps it and copies data through it, the
+// socketpair then only carrying wakeups (see libipc/ring.cpp for
+// the layout).
+
+import (
+	"errors"
+	"os"
+	"syscall"
+)
+
+const (
+	RING_HEADER_SIZE = 4096
+	RING_SIZE        = 256 << 10
+)
+
+// Where the memory comes from: tmpfs if there is one.
+const RING_DIR = "/dev/shm"
+
+// Set up a ring for a transport not yet handed to anyone.
+func primeRing(T Transport) error {
+	F, err := os.CreateTemp(RING_DIR, "ipcd-ring")
+	if err != nil {
+		return err
+	}
+	os.Remove(F.Name())
+	defer F.Close()
+	if err := F.Truncate(2 * (RING_HEADER_SIZE + RING_SIZE)); err != nil {
+		return err
+	}
+
+	Rights := syscall.UnixRights(int(F.Fd()))
+	// What's sent on one end is received by whoever holds the other.
+	for i, FD := range []int{T.B, T.A} {
+		n, err := syscall.SendmsgN(FD, []byte{byte('0' + i)}, Rights, nil, syscall.MSG_DONTWAIT)
+		if err != nil {
+			return os.NewSyscallError("sendmsg", err)
+		}
+		if n != 1 {
+			return errors.New("short write priming ring")
+		}
+	}
+	return nil
+}
@@ -0,0 +1,125 @@
+package main
+
+// Virtual connections: connecting to a listener that has opted in
+// (VLISTEN) gives each end a local transport directly, with no
+// TCP connection ever being made.
+// Such listeners are given one end of an "accept queue",
+// over which ipcd sends their end of each new connection
+// along with the addresses it pretends to have.
+
+import (
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"strconv"
+	"syscall"
+)
+
+// Set up endpoint as virtual listener, returning the listener's
+// end of its accept queue.  Ours is kept in LocalFD.
+func (C *IPCContext) vlisten(ID int, Addr NetAddr) (int, error) {
+	FDs, err := syscall.Socketpair(syscall.AF_UNIX, syscall.SOCK_SEQPACKET|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		return -1, os.NewSyscallError("socketpair", err)
+	}
+	Queue := Transport{FDs[0], FDs[1]}
+	// Never wait on a listener that isn't keeping up.
+	if err := syscall.SetNonblock(Queue.A, true); err != nil {
+		Queue.Close()
+		return -1, err
+	}
+
+	if err := C.listen(ID, Addr); err != nil {
+		Queue.Close()
+		return -1, err
+	}
+
+	S := C.shard(ID)
+	S.Lock.Lock()
+	defer S.Lock.Unlock()
+
+	EPI := C.getLocked(ID)
+	if EPI == nil || EPI.LocalFD != -1 {
+		Queue.Close()
+		return -1, errors.New("cannot queue connections for endpoint")
+	}
+	EPI.LocalFD = Queue.A
+	return Queue.B, nil
+}
+
+// Find listener for connections to the given address, -1 if none.
+// Must hold PairLock.
+func (C *IPCContext) listenerFor(Addr NetAddr) int32 {
+	if ID, ok := C.Listeners[Addr]; ok {
+		return ID
+	}
+	// Bound to in6addr_any, which (dual-stack) takes IPv4 too,
+	// or for IPv4 to INADDR_ANY.
+	Any := NetAddr{Port: Addr.Port}
+	if ID, ok := C.Listeners[Any]; ok {
+		return ID
+	}
+	if !isV4Mapped(Addr.IP) {
+		return -1
+	}
+	Any.IP[10], Any.IP[11] = 0xff, 0xff
+	if ID, ok := C.Listeners[Any]; ok {
+		return ID
+	}
+	return -1
+}
+
+func appendAddr(B []byte, A NetAddr) []byte {
+	B = append(B, net.IP(A.IP[:]).String()...)
+	B = append(B, ' ')
+	return strconv.AppendInt(B, int64(A.Port), 10)
+}
+
+// Connect endpoint to the virtual listener for Dst, returning our
+// end of the new connection.  The listener is sent the other end,
+// with "<src ip> <src port> <dst ip> <dst port>".
+// ErrNoPeer if there's no such listener, ErrBusy if its queue is full.
+func (C *IPCContext) vconnect(ID int, Src, Dst NetAddr) (int, error) {
+	if C.lookup(ID) == nil {
+		return -1, errors.New(fmt.Sprintf("Invalid Endpoint ID '%d'", ID))
+	}
+
+	C.PairLock.Lock()
+	L := C.listenerFor(Dst)
+	C.PairLock.Unlock()
+	if L == -1 {
+		return -1, ErrNoPeer
+	}
+
+	T, err := C.Transports.get()
+	if err != nil {
+		return -1, err
+	}
+	Msg := appendAddr(nil, Src)
+	Msg = append(Msg, ' ')
+	Msg = appendAddr(Msg, Dst)
+
+	// Hold the listener's shard lock so its queue
+	// isn't closed (and the fd reused) meanwhile.
+	S := C.shard(int(L))
+	S.Lock.Lock()
+	LEP := C.getLocked(int(L))
+	if LEP == nil || LEP.LocalFD == -1 {
+		err = ErrNoPeer
+	} else {
+		err = syscall.Sendmsg(LEP.LocalFD, Msg, syscall.UnixRights(T.B), nil, syscall.MSG_DONTWAIT)
+	}
+	S.Lock.Unlock()
+
+	switch {
+	case err == syscall.EAGAIN:
+		C.Transports.put(T)
+		return -1, ErrBusy
+	case err != nil:
+		C.Transports.put(T)
+		return -1, err
+	}
+	syscall.Close(T.B)
+	return T.A, nil
+}
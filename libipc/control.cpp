@@ -19,8 +19,10 @@
 #include "ipcd.h"
 #include "ipcreg_internal.h"
 #include "real.h"
+#include "ring.h"
 
 #include <algorithm>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 
@@ -28,7 +30,8 @@ int do_ipc_shutdown(int sockfd, int how) {
   ipc_info &i = getInfo(getEP(sockfd));
   assert(i.state != STATE_INVALID);
 
-  int ret = __real_shutdown(sockfd, how);
+  // A virtual listener's fd is an epoll instance, not the socket.
+  int ret = __real_shutdown(real_socket_fd(sockfd), how);
 
   // Do similar shutdown operation on local fd, if exists:
   if (i.state == STATE_OPTIMIZED) {
@@ -50,18 +53,39 @@ int do_ipc_poll(struct pollfd fds[], nfds_t nfds, int timeout) {
 
   memcpy(newfds, fds, sizeof(fds[0]) * nfds);
 
+  // Rings with data we weren't woken for are readable already
+  // (see ring.cpp), so only check the rest.
+  const short READ_EVENTS = POLLIN | POLLRDNORM;
+  bool ready[MAX_POLL_FDS] = {};
+  bool any_ready = false;
   for (nfds_t i = 0; i < nfds; ++i) {
     int fd = newfds[i].fd;
-    if (!is_optimized_socket_safe(fd))
+    if (!is_drained_socket_safe(fd))
       continue;
     newfds[i].fd = getInfo(getEP(fd)).localfd;
+    if (newfds[i].events & READ_EVENTS)
+      any_ready |= ready[i] = ring_will_wait(newfds[i].fd, NULL);
   }
-  int ret = __real_poll(newfds, nfds, timeout);
+  int ret = __real_poll(newfds, nfds, any_ready ? 0 : timeout);
 
   // Copy 'revents' back out from newfds,
   // as written by 'poll':
   for (nfds_t i = 0; i < nfds; ++i) {
     fds[i].revents = newfds[i].revents;
+    if (!ready[i] || ret == -1)
+      continue;
+    if (!fds[i].revents)
+      ++ret;
+    fds[i].revents |= fds[i].events & READ_EVENTS;
+  }
+
+  // Did any non-blocking connect()'s complete?
+  if (ret > 0) {
+    int saved_errno = errno;
+    for (nfds_t i = 0; i < nfds; ++i)
+      if (fds[i].revents)
+        check_connect(fds[i].fd);
+    errno = saved_errno;
   }
 
   return ret;
@@ -82,7 +106,7 @@ fd_set *copy_if_needed(fd_set *src, fd_set *copy, int &nfds) {
   for (int fd = 0; fd < maxfd; ++fd) {
     if (!FD_ISSET(fd, src))
       continue;
-    if (!is_optimized_socket_safe(fd))
+    if (!is_drained_socket_safe(fd))
       continue;
 
     need_copy = true;
@@ -99,7 +123,7 @@ fd_set *copy_if_needed(fd_set *src, fd_set *copy, int &nfds) {
   for (int fd = 0; fd < maxfd; ++fd) {
     if (!FD_ISSET(fd, src))
       continue;
-    if (!is_optimized_socket_safe(fd)) {
+    if (!is_drained_socket_safe(fd)) {
       assert(!FD_ISSET(fd, copy));
       FD_SET(fd, copy);
     } else {
@@ -135,7 +159,7 @@ void select__copy_to_output(fd_set *out, fd_set*givenout, int nfds) {
     if (!FD_ISSET(fd, givenout))
       continue;
     int equiv_fd = fd;
-    if (is_optimized_socket_safe(fd))
+    if (is_drained_socket_safe(fd))
       equiv_fd = getInfo(getEP(fd)).localfd;
 
     // If the equivalent (local if exists) fd
@@ -145,21 +169,80 @@ void select__copy_to_output(fd_set *out, fd_set*givenout, int nfds) {
   }
 }
 
+// Find the fd's in 'readfds' whose rings have data we weren't
+// woken for (see ring.cpp), readable without waiting.
+bool select__rings_ready(fd_set *readfds, fd_set *ready, int nfds) {
+  int maxfd = std::min<int>(FD_SETSIZE, TABLE_SIZE);
+  maxfd = std::min<int>(maxfd, nfds);
+
+  if (readfds == NULL)
+    return false;
+
+  bool any = false;
+  FD_ZERO(ready);
+  for (int fd = 0; fd < maxfd; ++fd) {
+    if (!FD_ISSET(fd, readfds) || !is_drained_socket_safe(fd))
+      continue;
+    if (ring_will_wait(getInfo(getEP(fd)).localfd, NULL)) {
+      FD_SET(fd, ready);
+      any = true;
+    }
+  }
+  return any;
+}
+
+// Add those to what select() returned, 'ret'.
+int select__add_ready(fd_set *readfds, fd_set *ready, int nfds, int ret) {
+  int maxfd = std::min<int>(FD_SETSIZE, TABLE_SIZE);
+  maxfd = std::min<int>(maxfd, nfds);
+
+  for (int fd = 0; fd < maxfd; ++fd) {
+    if (FD_ISSET(fd, ready) && !FD_ISSET(fd, readfds)) {
+      FD_SET(fd, readfds);
+      ++ret;
+    }
+  }
+  return ret;
+}
+
+// Check for completed non-blocking connect()'s among the
+// fd's select() said were writable (or had an error).
+void select__check_connects(fd_set *writefds, fd_set *errorfds, int nfds) {
+  int maxfd = std::min<int>(FD_SETSIZE, TABLE_SIZE);
+  maxfd = std::min<int>(maxfd, nfds);
+
+  int saved_errno = errno;
+  for (int fd = 0; fd < maxfd; ++fd) {
+    if ((writefds && FD_ISSET(fd, writefds)) ||
+        (errorfds && FD_ISSET(fd, errorfds)))
+      check_connect(fd);
+  }
+  errno = saved_errno;
+}
+
 int do_ipc_pselect(int nfds, fd_set *readfds, fd_set *writefds,
                    fd_set *errorfds, const struct timespec *timeout,
                    const sigset_t *sigmask) {
   assert(nfds >= 0);
 
-  fd_set rcopy, wcopy, ecopy;
+  fd_set rcopy, wcopy, ecopy, ready;
+  int orig_nfds = nfds;
+  bool any_ready = select__rings_ready(readfds, &ready, nfds);
+  const struct timespec now = {0, 0};
 
   fd_set *r = copy_if_needed(readfds, &rcopy, nfds);
   fd_set *w = copy_if_needed(writefds, &wcopy, nfds);
   fd_set *e = copy_if_needed(errorfds, &ecopy, nfds);
 
-  int ret = __real_pselect(nfds, r, w, e, timeout, sigmask);
+  int ret =
+      __real_pselect(nfds, r, w, e, any_ready ? &now : timeout, sigmask);
   select__copy_to_output(r, readfds, nfds);
   select__copy_to_output(w, writefds, nfds);
   select__copy_to_output(e, errorfds, nfds);
+  if (any_ready && ret != -1)
+    ret = select__add_ready(readfds, &ready, orig_nfds, ret);
+  if (ret > 0)
+    select__check_connects(writefds, errorfds, nfds);
 
   return ret;
 }
@@ -167,17 +250,24 @@ int do_ipc_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds,
                   struct timeval *timeout) {
   assert(nfds >= 0);
 
-  fd_set rcopy, wcopy, ecopy;
+  fd_set rcopy, wcopy, ecopy, ready;
+  int orig_nfds = nfds;
+  bool any_ready = select__rings_ready(readfds, &ready, nfds);
+  struct timeval now = {0, 0};
 
   fd_set *r = copy_if_needed(readfds, &rcopy, nfds);
   fd_set *w = copy_if_needed(writefds, &wcopy, nfds);
   fd_set *e = copy_if_needed(errorfds, &ecopy, nfds);
 
-  int ret = __real_select(nfds, r, w, e, timeout);
+  int ret = __real_select(nfds, r, w, e, any_ready ? &now : timeout);
 
   select__copy_to_output(r, readfds, nfds);
   select__copy_to_output(w, writefds, nfds);
   select__copy_to_output(e, errorfds, nfds);
+  if (any_ready && ret != -1)
+    ret = select__add_ready(readfds, &ready, orig_nfds, ret);
+  if (ret > 0)
+    select__check_connects(writefds, errorfds, nfds);
 
   return ret;
 }
@@ -230,7 +320,8 @@ int do_ipc_fcntl(int fd, int cmd, void *arg) {
 }
 int do_ipc_setsockopt(int socket, int level, int option_name,
                       const void *option_value, socklen_t option_len) {
-  int ret = __real_setsockopt(socket, level, option_name, option_value, option_len);
+  int ret = __real_setsockopt(real_socket_fd(socket), level, option_name,
+                              option_value, option_len);
 
   // TODO: ... what options do we care about?
 
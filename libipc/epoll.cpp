@@ -19,8 +19,10 @@
 #include "ipcopt.h"
 #include "ipcreg_internal.h"
 #include "real.h"
+#include "ring.h"
 
 #include <algorithm>
+#include <errno.h>
 
 int __internal_epoll_create(int size) {
   // ipclog("epoll_create(size=%d)\n", size);
@@ -69,6 +71,38 @@ epoll_entry *find_epoll_entry(int epfd, int fd) {
 }
 
 
+// Disable a one-shot entry, having reported it.
+static void disarm(int epfd, epoll_entry &entry) {
+  entry.event.events &= EPOLLONESHOT | EPOLLET;
+  int ret = __real_epoll_ctl(epfd, EPOLL_CTL_MOD, entry.fd, &entry.event);
+  assert(ret == 0);
+}
+
+// Fold the 'count' events epoll returned, following the 'ready'
+// we found, into those, noting one-shot entries epoll disabled.
+// Entries are told apart by their data.
+static int merge_events(int epfd, struct epoll_event *events, int ready,
+                        int count) {
+  epoll_info &ei = getEpollInfo(epfd);
+  int total = ready;
+  for (int j = ready; j < ready + count; ++j) {
+    uint64_t data = events[j].data.u64;
+    for (unsigned i = 0; i < ei.count; ++i) {
+      epoll_entry &entry = ei.entries[i];
+      if ((entry.event.events & EPOLLONESHOT) && entry.event.data.u64 == data)
+        entry.event.events &= EPOLLONESHOT | EPOLLET;
+    }
+    int k = 0;
+    while (k < ready && events[k].data.u64 != data)
+      ++k;
+    if (k < ready)
+      events[k].events |= events[j].events;
+    else
+      events[total++] = events[j];
+  }
+  return total;
+}
+
 int __internal_epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
                            int timeout, const sigset_t *sigmask) {
 
@@ -79,7 +113,7 @@ int __internal_epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
 
   for (unsigned i = 0; i < ei.count; ++i) {
     int fd = ei.entries[i].fd;
-    if (is_optimized_socket_safe(fd)) {
+    if (is_drained_socket_safe(fd)) {
       // Replace with localfd!
       int ret = __real_epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
       assert(ret == 0);
@@ -93,14 +127,55 @@ int __internal_epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
     }
   }
 
-  return __real_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+  // Rings with data we weren't woken for are readable already
+  // (see ring.cpp), so only check the rest.  Edge-triggered, for
+  // data beyond what they were told of, and one-shot ones are
+  // then disabled as epoll would.
+  int ready = 0;
+  bool oneshot = false;
+  for (unsigned i = 0; i < ei.count; ++i) {
+    epoll_entry &entry = ei.entries[i];
+    uint32_t want = entry.event.events;
+    oneshot |= want & EPOLLONESHOT;
+    if (ready == maxevents || !(want & EPOLLIN))
+      continue;
+    if (!ring_will_wait(entry.fd, (want & EPOLLET) ? &entry.ring_seen : NULL))
+      continue;
+    events[ready].events = EPOLLIN;
+    events[ready].data = entry.event.data;
+    ++ready;
+    if (want & EPOLLONESHOT)
+      disarm(epfd, entry);
+  }
+
+  int ret = 0;
+  if (ready < maxevents) {
+    ret = __real_epoll_pwait(epfd, events + ready, maxevents - ready,
+                             ready ? 0 : timeout, sigmask);
+    if (ret == -1 && ready)
+      ret = 0;
+  }
+  if (ret > 0 && (ready || oneshot))
+    ret = merge_events(epfd, events, ready, ret);
+  else if (ret != -1)
+    ret += ready;
+
+  // Events carry the application's data, not fd's, so check
+  // any non-blocking connect()'s in this set for completion.
+  if (ret > 0) {
+    int saved_errno = errno;
+    for (unsigned i = 0; i < ei.count; ++i)
+      check_connect(ei.entries[i].fd);
+    errno = saved_errno;
+  }
+  return ret;
 }
 
 int __internal_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
   epoll_info &ei = getEpollInfo(epfd);
   assert(ei.valid);
 
-  int localfd = is_optimized_socket_safe(fd) ? getInfo(getEP(fd)).localfd : -1;
+  int localfd = is_drained_socket_safe(fd) ? getInfo(getEP(fd)).localfd : -1;
   epoll_entry *unopt_entry = find_epoll_entry(epfd, fd);
   epoll_entry *opt_entry =
       (localfd != -1) ? find_epoll_entry(epfd, localfd) : NULL;
@@ -137,6 +212,7 @@ int __internal_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
         epoll_entry &new_entry = ei.entries[ei.count++];
         new_entry.fd = addfd;
         new_entry.event = *event;
+        new_entry.ring_seen = 0;
 
         assert(ei.count <= MAX_EPOLL_ENTRIES);
       } else {
@@ -156,6 +232,8 @@ int __internal_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
     int ret = __real_epoll_ctl(epfd, op, modfd, event);
     if (ret == 0) {
       entry->event = *event;
+      // Like epoll, tell of what's there again.
+      entry->ring_seen = 0;
     }
     return ret;
   }
@@ -186,3 +264,20 @@ int __internal_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
   assert((ret == -1) && "Expected epoll_ctl() call to fail, but didn't");
   return ret;
 }
+
+// Have every epoll set watching 'from' watch 'to' instead,
+// for the same events.
+void epoll_replace_fd(int from, int to) {
+  for (unsigned epfd = 0; epfd < TABLE_SIZE; ++epfd) {
+    if (!getEpollInfo(epfd).valid)
+      continue;
+    epoll_entry *entry = find_epoll_entry(epfd, from);
+    if (!entry)
+      continue;
+    int ret = __real_epoll_ctl(epfd, EPOLL_CTL_DEL, from, NULL);
+    assert(ret == 0);
+    ret = __real_epoll_ctl(epfd, EPOLL_CTL_ADD, to, &entry->event);
+    assert(ret == 0);
+    entry->fd = to;
+  }
+}
@@ -24,4 +24,6 @@ int __internal_epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
                            int timeout, const sigset_t *sigmask);
 int __internal_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
 
+void epoll_replace_fd(int from, int to);
+
 #endif // _EPOLL_H_
@@ -15,7 +15,9 @@
 
 #include <unistd.h>
 
+#include "ipcd.h"
 #include "ipcopt.h"
+#include "ring.h"
 
 #include "debug.h"
 #include "getfromlibc.h"
@@ -30,7 +32,8 @@ pid_t __internal_fork(void) {
   // passing to children.
   // This is bad, but makes it easy to avoid
   // racing child's reregistration against our closing them.
-  register_inherited_fds();
+  unsigned inherited = register_inherited_fds();
+  pid_t parent = getpid();
   pid_t p = __real_fork();
 
   switch (p) {
@@ -39,9 +42,14 @@ pid_t __internal_fork(void) {
     break;
   case 0:
     // child
+    ring_forked();
 #if USE_DEBUG_LOGGER
     ipclog("FORK! Parent is: %d\n", getppid());
 #endif
+    // Claim the references our parent took for us,
+    // so ipcd releases them when we exit.
+    if (inherited)
+      ipcd_adopt(parent);
     break;
   default:
     // parent
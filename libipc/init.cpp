@@ -31,11 +31,13 @@ void __ipc_init() {
   // First, let's ensure we have our logger:
   ipclog("Init\n");
 
-  // Next, let's initialize the libipc state:
-  __ipcopt_init();
-
-  // Finally, attempt connection to ipcd:
+  // Next, find out if we should talk to ipcd at all
+  // (connecting is left until we need to):
   __ipcd_init();
+
+  // Finally, restore any libipc state we inherited,
+  // which may already involve ipcd:
+  __ipcopt_init();
 }
 
 void __ensure_init_started() {
@@ -19,21 +19,42 @@
 #include "ipcd.h"
 #include "ipcreg_internal.h"
 #include "real.h"
+#include "ring.h"
 
 #include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/ioctl.h>
+
+// Pairing is tried once an endpoint has carried this many bytes
+// (either way), made this many I/O calls, or been connected this
+// long (ms), whichever comes first.  Calls in a row in the same
+// direction count as one: both ends then agree on the count,
+// however they split up what they read and write, so they get
+// there together.  The last two only matter for connections that
+// carry little, so are only checked when the direction changes.
 const size_t TRANS_THRESHOLD = 1ULL << 16;
+const size_t TRANS_CALLS = 64;
+const size_t TRANS_AGE = 2000;
 const size_t MAX_SYNC_ATTEMPTS = 20;
 const size_t MILLIS_IN_MICROSECONDS = 1000;
 const size_t IPCD_SYNC_DELAY = 100 * MILLIS_IN_MICROSECONDS;
 const size_t ATTEMPT_SLEEP_INTERVAL = IPCD_SYNC_DELAY / MAX_SYNC_ATTEMPTS;
+// accept() only waits briefly for the connecting end to offer,
+// it's usually there first.
+const size_t MAX_FAST_ACCEPT_ATTEMPTS = 8;
+const size_t FAST_ACCEPT_SLEEP_INTERVAL = 200;
+// Pairing that fails (peer not there in time, ipcd busy) is
+// retried when any of the above reach twice the last try's,
+// and so on.
+const uint8_t MAX_PAIR_TRIES = 8;
 
 void copy_bufsize(int src, int dst, int buftype) {
   int bufsize;
@@ -57,36 +78,104 @@ size_t &get_byte_counter(ipc_info &i, bool send) {
   return send ? i.bytes_sent : i.bytes_recv;
 }
 
+// ipcd's policy may override these defaults.
+static size_t pair_threshold(const ipc_info &i) {
+  return i.threshold ? i.threshold : TRANS_THRESHOLD;
+}
+static size_t pair_calls(const ipc_info &i) {
+  return i.pair_calls ? i.pair_calls : TRANS_CALLS;
+}
+static size_t pair_age(const ipc_info &i) {
+  return i.pair_age ? i.pair_age : TRANS_AGE;
+}
+static size_t max_sync_attempts(ipc_info &i) {
+  if (!i.pair_timeout)
+    return MAX_SYNC_ATTEMPTS;
+  return std::max(size_t(1), i.pair_timeout * MILLIS_IN_MICROSECONDS /
+                                 ATTEMPT_SLEEP_INTERVAL);
+}
+
+// Byte count at which pairing is (next) attempted.
+static size_t pair_checkpoint(ipc_info &i) {
+  return pair_threshold(i) << i.pair_tries;
+}
+
+// Milliseconds since connect() or accept() completed.
+static size_t connected_for(const ipc_info &i) {
+  if (!i.connect_end.tv_sec && !i.connect_end.tv_nsec)
+    return 0;
+  struct timespec now = get_time();
+  return (now.tv_sec - i.connect_end.tv_sec) * 1000 +
+         (now.tv_nsec - i.connect_end.tv_nsec) / 1000000;
+}
+
+// Calls or age at which pairing is (next) attempted reached?
+static bool pair_checkpoint_slow(const ipc_info &i, uint8_t tries) {
+  return i.io_calls >= pair_calls(i) << tries ||
+         connected_for(i) >= pair_age(i) << tries;
+}
+
+bool pairing_was_due(const ipc_info &i) {
+  return std::max(i.bytes_sent, i.bytes_recv) >= pair_threshold(i) ||
+         pair_checkpoint_slow(i, 0);
+}
+
 char get_threshold_indicator_char(ipc_info &i, bool send) {
   size_t bytes = get_byte_counter(i, send);
-  if (bytes > TRANS_THRESHOLD)
+  if (bytes > pair_threshold(i))
     return '>';
-  if (bytes < TRANS_THRESHOLD)
+  if (bytes < pair_threshold(i))
     return '<';
   return '=';
 }
 
-void update_stats(int fd, bool send, const void*buf, ssize_t cnt) {
-  ipc_info &i = getInfo(getEP(fd));
+// UDP endpoints also count datagrams, what's sent before
+// pairing being drained by the datagram.
+static void count_datagram(int fd, ipc_info &i, bool send) {
+  size_t &msgs = send ? i.msgs_sent : i.msgs_recv;
+  ++msgs;
+  if (!send && i.recv_mark && msgs == i.recv_mark)
+    ipclog("Drained fd=%d at %zu datagrams, reading from local fd\n", fd,
+           msgs);
+}
+
+static void update_bytes(int fd, ipc_info &i, bool send, const void *buf,
+                         ssize_t cnt) {
   size_t &bytes = get_byte_counter(i, send);
   if (cnt > 0) {
-    if (bytes < TRANS_THRESHOLD) {
+    size_t window = pair_threshold(i);
+    if (bytes < window) {
+      // Only bytes up to the threshold are checked,
+      // however the two ends happened to split them up.
+      size_t crc_cnt = std::min(size_t(cnt), window - bytes);
       if (send) {
-        i.crc_sent.process_bytes(buf, cnt);
+        i.crc_sent.process_bytes(buf, crc_cnt);
       } else {
-        i.crc_recv.process_bytes(buf, cnt);
+        i.crc_recv.process_bytes(buf, crc_cnt);
       }
     }
     bytes += cnt;
+    if (!send && !i.dgram && i.recv_mark && bytes == i.recv_mark)
+      ipclog("Drained fd=%d at %zu bytes, reading from local fd\n", fd, bytes);
   }
 }
+
+void update_stats(int fd, bool send, const void*buf, ssize_t cnt) {
+  ipc_info &i = getInfo(getEP(fd));
+  if (i.dgram && cnt >= 0)
+    count_datagram(fd, i, send);
+  update_bytes(fd, i, send, buf, cnt);
+}
 void update_stats_vec(int fd, bool send, const struct iovec *vec,
                       ssize_t cnt) {
+  ipc_info &i = getInfo(getEP(fd));
+  if (i.dgram && cnt >= 0)
+    count_datagram(fd, i, send);
   int index = 0;
   while (cnt > 0) {
     int bytes = std::min(size_t(cnt), vec[index].iov_len);
 
-    update_stats(fd, send, vec[index].iov_base, bytes);
+    update_bytes(fd, i, send, vec[index].iov_base, bytes);
 
     cnt -= bytes;
     ++index;
@@ -94,63 +183,330 @@ void update_stats_vec(int fd, bool send, const struct iovec *vec,
 }
 
 
-void attempt_optimization(int fd, bool send) {
+// Switch endpoint over to the local transport ipcd gave us,
+// and the ring it carries if 'ring'.  False if we can't: closing
+// our end tells our peer we're gone, as if we'd exited, so both
+// ends carry on over the original socket.
+static bool use_local_transport(int fd, ipc_info &i, int localfd, bool ring) {
+  int memfd = -1;
+  if (ring && !ring_attach(getEP(fd), localfd, memfd, i.ring_side)) {
+    __real_close(localfd);
+    return false;
+  }
+  i.localfd = track_localfd(localfd);
+  i.state = STATE_OPTIMIZED;
+  i.ring = ring;
+
+  // Configure localfd, whose buffers only matter without a ring.
+  // It arrives close-on-exec, but must survive exec() as long as
+  // the socket does (see scan_for_cloexec), as must the ring.
+  __real_fcntl_int(localfd, F_SETFD, 0);
+  if (ring) {
+    i.auxfd = track_localfd(memfd);
+    __real_fcntl_int(memfd, F_SETFD, 0);
+  } else {
+    copy_bufsizes(fd, i.localfd);
+  }
+  set_local_nonblocking(fd, i.non_blocking);
+  return true;
+}
+
+// Pair with our peer, called once either byte counter crosses
+// a checkpoint.  Both ends stop sending over TCP once paired
+// and tell each other (through ipcd) how much they sent,
+// so whatever is still in flight is read from TCP first
+// and the switch can happen at any offset.
+void attempt_optimization(int fd) {
+  // If we're here, we definitely should have already submitted info.
+  // XXX: This happens if first IO operation causes us to cross our
+  // threshold.  This fixes it for now, but should be done earlier.
+  submit_info_if_needed(fd);
+  if (!is_registered_socket(fd))
+    return;
+
   endpoint ep = getEP(fd);
-  assert(valid_ep(ep));
   ipc_info &i = getInfo(ep);
-  assert(i.state != STATE_INVALID);
-
-  if (get_byte_counter(i, send) == TRANS_THRESHOLD) {
-    ipclog("Completed partial operation to sync at THRESHOLD for fd=%d!\n", fd);
+  if (i.state != STATE_UNOPT)
+    return;
+
+  // TODO: Async!
+  endpoint remote = EP_INVALID;
+  size_t attempts = 0;
+
+  pairing_info pi;
+  pi.s_crc = i.crc_sent.checksum();
+  pi.r_crc = i.crc_recv.checksum();
+  pi.sent = i.dgram ? i.msgs_sent : i.bytes_sent;
+  pi.peer_sent = 0;
+
+  // Once paired, ipcd hands us our local fd with the pairing
+  // response (the remote gets its own the same way).
+  int localfd = -1;
+  bool ring = false;
+  bool nopeer = false, busy = false;
+  while (true) {
+    bool last = busy || (++attempts >= max_sync_attempts(i) + 3);
+    remote =
+        ipcd_find_pair_fd(ep, pi, last, localfd, ring);
+    if (remote == EP_NOPEER) {
+      // Our peer isn't local: proceed without optimization.
+      remote = EP_INVALID;
+      nopeer = true;
+      break;
+    }
+    if (remote == EP_BUSY) {
+      // ipcd is overloaded: give up for now, saying so
+      // (that's never refused) in case we were offered.
+      remote = EP_INVALID;
+      if (last)
+        break;
+      busy = true;
+      continue;
+    }
+    if (remote != EP_INVALID)
+      break;
+    if (last)
+      break;
+    if (attempts > 3) {
+      sched_yield();
+      usleep(ATTEMPT_SLEEP_INTERVAL);
+    }
+  }
 
-    // If we're here, we definitely should have already submitted info.
-    // XXX: This happens if first IO operation causes us to cross our
-    // threshold.  This fixes it for now, but should be done earlier.
-    submit_info_if_needed(fd);
+  if (valid_ep(remote)) {
+    ipclog("Found remote endpoint! Local=%d, Remote=%d Attempts=%zu!\n", ep,
+           remote, attempts);
+    ipclog("Send counter %zu%c (%x), recv: %zu%c (%x), peer sent: %zu\n",
+           i.bytes_sent, get_threshold_indicator_char(i, true),
+           i.crc_sent.checksum(), i.bytes_recv,
+           get_threshold_indicator_char(i, false), i.crc_recv.checksum(),
+           pi.peer_sent);
+
+    if (!use_local_transport(fd, i, localfd, ring)) {
+      retire_socket(fd);
+      return;
+    }
+    i.recv_mark = pi.peer_sent;
+    return;
+  }
 
+  // Unless there's no point, try again at the next checkpoints
+  // we're not past.  Only bytes up to the threshold each way
+  // are checked, so by then both ends will likely agree.
+  size_t bytes = std::max(i.bytes_sent, i.bytes_recv);
+  bool retry = !nopeer;
+  while (retry) {
+    retry = ++i.pair_tries < MAX_PAIR_TRIES;
+    if (pair_checkpoint(i) > bytes && !pair_checkpoint_slow(i, i.pair_tries))
+      break;
+  }
+  if (!retry) {
+    retire_socket(fd);
+    return;
+  }
+  ipclog("Pairing fd=%d failed, retrying at %zu bytes, %zu calls or %zu ms\n",
+         fd, pair_checkpoint(i), pair_calls(i) << i.pair_tries,
+         pair_age(i) << i.pair_tries);
+}
 
-    // TODO: Async!
-    endpoint remote = EP_INVALID;
-    size_t attempts = 0;
+// After I/O over TCP, try pairing if it took us past a checkpoint.
+static void after_tcp_io(int fd, bool send, size_t before) {
+  submit_info_if_needed(fd);
+  if (!is_registered_socket(fd))
+    return;
+  ipc_info &i = getInfo(getEP(fd));
+  bool turned = i.io_calls == 0 || i.last_send != send;
+  if (turned) {
+    ++i.io_calls;
+    i.last_send = send;
+  }
+  size_t at = pair_checkpoint(i);
+  if ((before < at && get_byte_counter(i, send) >= at) ||
+      (turned && pair_checkpoint_slow(i, i.pair_tries)))
+    attempt_optimization(fd);
+}
 
-    pairing_info pi;
-    pi.s_crc = i.crc_sent.checksum();
-    pi.r_crc = i.crc_recv.checksum();
+// Connections to listeners using libipc on this host can use
+// the local transport from the very first byte, if both ends
+// agree to before either sends anything.  Called once connect()
+// or accept() completes; the connecting end waits (a while)
+// for the accepting end to get there.
+void attempt_fast_optimization(int fd, bool wait) {
+  submit_info_if_needed(fd);
+  if (!is_registered_socket(fd))
+    return;
 
-    while (true) {
-      bool last = (++attempts >= MAX_SYNC_ATTEMPTS + 3);
-      remote =
-          ipcd_find_pair(ep, pi, last);
-      if (remote != EP_INVALID)
-        break;
-      if (last)
-        break;
-      if (attempts > 3) {
-        sched_yield();
-        usleep(ATTEMPT_SLEEP_INTERVAL);
-      }
+  endpoint ep = getEP(fd);
+  ipc_info &i = getInfo(ep);
+  if (i.state != STATE_UNOPT || !i.fast)
+    return;
+
+  size_t max_attempts =
+      wait ? max_sync_attempts(i) + 3 : MAX_FAST_ACCEPT_ATTEMPTS;
+  endpoint remote = EP_INVALID;
+  size_t attempts = 0;
+  int localfd = -1;
+  bool ring = false;
+  while (true) {
+    bool last = (++attempts >= max_attempts);
+    remote = ipcd_find_pair_fast(ep, last, localfd, ring);
+    if (remote == EP_BUSY || remote == EP_NOPEER) {
+      remote = EP_INVALID;
+      break;
     }
-
-    if (valid_ep(remote)) {
-      ipclog("Found remote endpoint! Local=%d, Remote=%d Attempts=%zu!\n", ep,
-             remote, attempts);
-      ipclog("Send counter %zu%c (%x), recv: %zu%c (%x)\n", i.bytes_sent,
-             get_threshold_indicator_char(i, true), i.crc_sent.checksum(),
-             i.bytes_recv, get_threshold_indicator_char(i, false),
-             i.crc_recv.checksum());
-
-      bool success = ipcd_localize(ep, remote);
-      assert(success && "Failed to localize! Sadtimes! :(");
-      i.localfd = getlocalfd(fd);
-      i.state = STATE_OPTIMIZED;
-
-      // Configure localfd
-      copy_bufsizes(fd, i.localfd);
-      set_local_nonblocking(fd, i.non_blocking);
-    } else {
-      i.state = STATE_NOOPT;
+    if (remote != EP_INVALID || last)
+      break;
+    if (attempts > 3) {
+      sched_yield();
+      usleep(wait ? ATTEMPT_SLEEP_INTERVAL : FAST_ACCEPT_SLEEP_INTERVAL);
     }
   }
+
+  if (valid_ep(remote)) {
+    ipclog("Paired before first byte! Local=%d, Remote=%d Attempts=%zu!\n", ep,
+           remote, attempts);
+    if (!use_local_transport(fd, i, localfd, ring))
+      retire_socket(fd);
+  }
+  // Otherwise carry on as usual, pairing at the threshold.
+}
+
+// Did our peer close its end of the local transport?  That's
+// what exiting, crashing or closing the connection does, while
+// shutdown() leaves it open the other way (and shows up just the
+// same on TCP, so there's nothing to reconcile).
+static bool local_peer_gone(int localfd) {
+  pollfd p = {localfd, 0, 0};
+  return __real_poll(&p, 1, 0) == 1 && (p.revents & POLLHUP);
+}
+
+// I/O on the local transport returned 'ret'.  If that's the end
+// of it, return true: the operation is to be redone on TCP, which
+// is in the same state, so the application sees what it would
+// have seen without us.  Reads get there once they hit EOF with
+// our peer gone: TCP has whatever's left, then its EOF.  (A reset,
+// our peer having left data unread, is reported as TCP would.)
+// Sends get there on EPIPE, having used MSG_NOSIGNAL so SIGPIPE
+// only comes from TCP, if at all.
+// The local transport is dropped (demote_socket) once our peer's
+// gone and there's nothing left on it to read.
+static bool local_io_lost(int fd, ssize_t ret, bool send) {
+  if (send ? (ret != -1 || errno != EPIPE) : ret != 0)
+    return false;
+  int saved_errno = errno;
+  int localfd = getInfo(getEP(fd)).localfd;
+  int pending = 0;
+  bool gone = local_peer_gone(localfd);
+  if (gone && send)
+    gone = ioctl(localfd, FIONREAD, &pending) == 0 && pending == 0;
+  if (gone)
+    demote_socket(fd);
+  errno = saved_errno;
+  return send || gone;
+}
+
+// I/O through the ring instead of the local transport, setting
+// 'ret'.  Returns true when it's to be redone on the original
+// socket, as local_io_lost does: sending once our peer's gone
+// or we've moved on (see ring.cpp), receiving once our peer has
+// and we've read all it sent through the ring.  Urgent data only
+// goes over the original socket, and everything after it.
+static bool ring_io(int fd, ipc_info &i, const struct iovec *vec, int count,
+                    int flags, bool send, ssize_t &ret) {
+  endpoint ep = getEP(fd);
+  if (flags & MSG_OOB) {
+    if (send)
+      ring_move(ep, i.localfd);
+    return true;
+  }
+  bool nonblock = i.non_blocking || (flags & MSG_DONTWAIT);
+  bool lost;
+  ret = send ? ring_send(ep, i.localfd, vec, count, nonblock, lost)
+             : ring_recv(ep, i.localfd, vec, count, flags, nonblock, lost);
+  if (!lost)
+    return !send && local_io_lost(fd, ret, false);
+  int saved_errno = errno;
+  if (send) {
+    ring_move(ep, i.localfd);
+    if (ring_empty(ep) && local_peer_gone(i.localfd))
+      demote_socket(fd);
+  } else {
+    demote_socket(fd);
+  }
+  errno = saved_errno;
+  return true;
+}
+
+// Datagrams our peer sent over UDP before pairing are read first,
+// but not waited for: on loopback they've arrived (or were dropped,
+// our buffer being full) by the time they're sent.  So once none
+// are waiting, draining is over.  Always false for TCP.
+bool dgram_drain_over(int fd, ipc_info &i) {
+  if (!i.dgram || !i.draining())
+    return false;
+  pollfd p = {fd, POLLIN, 0};
+  if (__real_poll(&p, 1, 0) == 1)
+    return false;
+  ipclog("Drained fd=%d at %zu of %zu datagrams, reading from local fd\n", fd,
+         i.msgs_recv, i.recv_mark);
+  i.recv_mark = i.msgs_recv;
+  return true;
+}
+
+// Over UDP, datagrams that don't fit in the receiver's buffer
+// are dropped rather than waited for: so are the local
+// transport's, where sending them would say EAGAIN.
+static ssize_t dgram_sent(ipc_info &i, ssize_t ret, size_t count) {
+  if (i.dgram && ret == -1 && errno == EAGAIN)
+    return count;
+  return ret;
+}
+
+// Is this the address a (connected) socket's peer has?
+static bool is_peer_addr(int fd, const struct sockaddr *addr, socklen_t len) {
+  sockaddr_storage peer;
+  socklen_t peer_len = sizeof(peer);
+  if (__real_getpeername(fd, (sockaddr *)&peer, &peer_len) != 0 ||
+      addr->sa_family != peer.ss_family)
+    return false;
+  if (peer.ss_family == AF_INET) {
+    const sockaddr_in *in = (const sockaddr_in *)addr;
+    const sockaddr_in *p = (const sockaddr_in *)&peer;
+    return len >= sizeof(sockaddr_in) && in->sin_port == p->sin_port &&
+           in->sin_addr.s_addr == p->sin_addr.s_addr;
+  }
+  const sockaddr_in6 *in6 = (const sockaddr_in6 *)addr;
+  const sockaddr_in6 *p6 = (const sockaddr_in6 *)&peer;
+  return len >= sizeof(sockaddr_in6) && in6->sin6_port == p6->sin6_port &&
+         IN6_ARE_ADDR_EQUAL(&in6->sin6_addr, &p6->sin6_addr);
+}
+
+// Where what was read came from, as recvfrom() and recvmsg() say:
+// a connected UDP socket only hears from its peer, TCP says nothing.
+static void received_from(int fd, bool dgram, struct sockaddr *address,
+                          socklen_t *address_len) {
+  if (!address)
+    return;
+  if (!dgram || __real_getpeername(fd, address, address_len) != 0)
+    *address_len = 0;
+}
+
+// Total length of an iovec, what recvmsg() with MSG_TRUNC may
+// return more than.
+static size_t iov_length(const struct iovec *vec, size_t count) {
+  size_t len = 0;
+  for (size_t n = 0; n < count; ++n)
+    len += vec[n].iov_len;
+  return len;
+}
+
+// writev() on the local transport, without raising SIGPIPE.
+static ssize_t local_writev(int localfd, const struct iovec *vec, int count) {
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec *>(vec);
+  msg.msg_iovlen = count;
+  return __real_sendmsg(localfd, &msg, MSG_NOSIGNAL);
 }
 
 typedef ssize_t (*IOFunc)(...);
@@ -162,74 +518,57 @@ ssize_t do_ipc_io(int fd, buf_t buf, size_t count, int flags, IOFunc IO,
   ipc_info &i = getInfo(ep);
   assert(i.state != STATE_INVALID);
 
-  // If localized, just use fast socket:
-  if (i.state == STATE_OPTIMIZED) {
-    assert(i.sent_info);
-    ssize_t ret = IO(i.localfd, buf, count, flags);
-    if (!(flags & MSG_PEEK)) {
-      update_stats(fd, send, buf, ret);
-    }
-    return ret;
+  // Non-blocking connect() may have completed since:
+  // finish up, after which this may no longer be ours.
+  if (i.connecting) {
+    check_connect(fd);
+    if (!is_registered_socket(fd))
+      return IO(fd, buf, count, flags);
   }
 
-  if (i.state == STATE_NOOPT)
-    return IO(fd, buf, count, flags);
-
-  // Otherwise, use original fd:
-  size_t &bytes = get_byte_counter(i, send);
-  ssize_t rem = (TRANS_THRESHOLD - bytes);
-  if (rem > 0 && size_t(rem) <= count) {
-    ssize_t ret = IO(fd, buf, rem, flags);
-
-    if (ret == -1 || (flags & MSG_PEEK)) {
+  // If localized, just use fast socket
+  // (once we've read what was sent over TCP):
+  if (i.state == STATE_OPTIMIZED) {
+    assert(i.sent_info);
+    if (!send && i.draining() && !dgram_drain_over(fd, i)) {
+      if (!i.dgram)
+        count = std::min(count, i.recv_mark - i.bytes_recv);
+      ssize_t ret = IO(fd, buf, count, flags);
+      if (!(flags & MSG_PEEK)) {
+        update_stats(fd, send, buf, std::min(ret, ssize_t(count)));
+      }
       return ret;
     }
-
-    update_stats(fd, send, buf, ret);
-    assert(bytes <= TRANS_THRESHOLD);
-
-    attempt_optimization(fd, send);
-
-    // Did we truncate a blocking operation?
-
-    // Only continue operation if socket is blocking
-    // (otherwise the app definitely should be okay with short ops)
-    bool continue_partial_op = !i.non_blocking;
-    // Did we truncate from originally requested amount?
-    assert(count >= size_t(ret));
-    size_t left = count - size_t(ret);
-    continue_partial_op &= (left > 0);
-    // Did we receive the full amount requested?
-    // If not, requesting the original amount
-    // instead would have similarly returned a shorter amount.
-    continue_partial_op &= (ret == rem);
-
-    if (continue_partial_op) {
-      ipclog("Attempting to continue partial op...fd=%d, count=%zu, left=%zu\n",
-             fd, count, left);
-      buf_t buf2 = buf_t(uintptr_t(buf) + ret);
-      // Use MSG_DONTWAIT to get data already in buffer, no more.
-      // Reasoning: original blocking call returned for some reason,
-      // and we're only interested in patching around the reason
-      // being that we requested fewer bytes than were available.
-      ssize_t ret2 = do_ipc_io(fd, buf2, left, flags | MSG_DONTWAIT, IO, send);
-      if (ret2 != -1) {
-        ret += ret2;
-      }
+    ssize_t ret;
+    if (i.ring) {
+      iovec vec = {(void *)buf, count};
+      if (ring_io(fd, i, &vec, 1, flags, send, ret))
+        return IO(fd, buf, count, flags);
+    } else {
+      ret = IO(i.localfd, buf, count, send ? flags | MSG_NOSIGNAL : flags);
+      if (local_io_lost(fd, ret, send))
+        return IO(fd, buf, count, flags);
+    }
+    if (send)
+      ret = dgram_sent(i, ret, count);
+    if (!(flags & MSG_PEEK)) {
+      update_stats(fd, send, buf, std::min(ret, ssize_t(count)));
     }
-
     return ret;
   }
 
+  // Otherwise, use original fd:
   assert(i.state == STATE_UNOPT);
 
+  size_t before = get_byte_counter(i, send);
   ssize_t ret = IO(fd, buf, count, flags);
+  if (ret == -1)
+    return ret;
 
   if (!(flags & MSG_PEEK)) {
-    update_stats(fd, send, buf, ret);
+    update_stats(fd, send, buf, std::min(ret, ssize_t(count)));
   }
-  if (ret != -1)
-    submit_info_if_needed(fd);
+  after_tcp_io(fd, send, before);
 
   return ret;
 }
@@ -243,36 +582,31 @@ ssize_t do_ipc_recv(int fd, void *buf, size_t count, int flags) {
 }
 
 ssize_t do_ipc_sendto(int fd, const void *message, size_t length, int flags,
-                      const struct sockaddr *dest_addr,
-                      socklen_t /* unused */) {
-  // if (dest_addr)
-  //  return __real_sendto(fd, message, length, flags, dest_addr, dest_len);
-  // Hardly safe, but if it's non-NULL there's a chance
-  // the caller might want us to write something there.
-  assert(!dest_addr);
-
-  // As a bonus from the above check, we can forward to plain send()
+                      const struct sockaddr *dest_addr, socklen_t dest_len) {
+  // Connected TCP ignores the address, as does UDP sending
+  // to its peer.  UDP sending elsewhere isn't ours to track.
+  if (dest_addr && is_dgram_socket(fd) &&
+      !is_peer_addr(fd, dest_addr, dest_len))
+    return __real_sendto(fd, message, length, flags, dest_addr, dest_len);
   return do_ipc_send(fd, message, length, flags);
 }
 ssize_t do_ipc_recvfrom(int fd, void *buffer, size_t length, int flags,
-                        struct sockaddr *address, socklen_t * /* unused */) {
-  // if (address)
-  //  return __real_recvfrom(fd, buffer, length, flags, address, address_len);
-  // Hardly safe, but if it's non-NULL there's a chance
-  // the caller might want us to write something there.
-  assert(!address);
-
-  // As a bonus from the above check, we can forward to plain recv()
-  return do_ipc_recv(fd, buffer, length, flags);
+                        struct sockaddr *address, socklen_t *address_len) {
+  bool dgram = is_dgram_socket(fd);
+  ssize_t ret = do_ipc_recv(fd, buffer, length, flags);
+  if (ret != -1)
+    received_from(fd, dgram, address, address_len);
+  return ret;
 }
 
+// Limit iovec to its first 'bytes' bytes, if it has that many.
 int truncate_iov(struct iovec newvec[100], const struct iovec *vec,
                  size_t bytes, int count) {
   assert(100 > count);
 
   int newcount = 0;
   for (; newcount < count &&bytes != 0; ++newcount) {
-    int copy = std::min(bytes, vec[newcount].iov_len);
+    size_t copy = std::min(bytes, vec[newcount].iov_len);
 
     // Put this iov into our newvec
     newvec[newcount].iov_base = vec[newcount].iov_base;
@@ -280,7 +614,6 @@ int truncate_iov(struct iovec newvec[100], const struct iovec *vec,
 
     bytes -= copy;
   }
-  assert(bytes == 0);
 
   return newcount;
 }
@@ -293,58 +626,53 @@ ssize_t do_ipc_iov(int fd, const struct iovec *vec, int count, IOVFunc IO,
   ipc_info &i = getInfo(getEP(fd));
   assert(i.state != STATE_INVALID);
 
-  // If localized, just use fast socket!
-  if (i.state == STATE_OPTIMIZED) {
-    ssize_t ret = IO(i.localfd, vec, count);
-    update_stats_vec(fd, send, vec, ret);
-    return ret;
-  }
-
-  if (i.state == STATE_NOOPT) {
-    return IO(fd, vec, count);
-  }
-
-  size_t bytes = 0;
-  for (int i = 0; i < count; ++i) {
-    // Overflow check...
-    if (SSIZE_MAX - bytes < vec[i].iov_len) {
-      // We could try to set errno here,
-      // but easier to just let actual writev/readv do this:
+  if (i.connecting) {
+    check_connect(fd);
+    if (!is_registered_socket(fd))
       return IO(fd, vec, count);
-    }
-
-    bytes += vec[i].iov_len;
   }
 
-  size_t &bytes_stat = get_byte_counter(i, send);
-  ssize_t rem = (TRANS_THRESHOLD - bytes_stat);
-  if (rem > 0 && size_t(rem) <= bytes) {
-
-    // Need to construct alternate iovec!
-    iovec newvec[100];
-    int newcount = truncate_iov(newvec, vec, size_t(rem), count);
-
-    ssize_t ret = IO(fd, newvec, newcount);
-
-    if (ret == -1)
+  // If localized, just use fast socket!
+  if (i.state == STATE_OPTIMIZED) {
+    if (!send && i.draining() && !dgram_drain_over(fd, i)) {
+      if (i.dgram) {
+        ssize_t ret = IO(fd, vec, count);
+        update_stats_vec(fd, send, vec, ret);
+        return ret;
+      }
+      iovec newvec[100];
+      int newcount =
+          truncate_iov(newvec, vec, i.recv_mark - i.bytes_recv, count);
+      ssize_t ret = IO(fd, newvec, newcount);
+      update_stats_vec(fd, send, newvec, ret);
       return ret;
-
-    update_stats_vec(fd, send, newvec, ret);
-    assert(bytes_stat <= TRANS_THRESHOLD);
-
-    attempt_optimization(fd, send);
-
+    }
+    ssize_t ret;
+    if (i.ring) {
+      if (ring_io(fd, i, vec, count, 0, send, ret))
+        return IO(fd, vec, count);
+    } else {
+      ret = send ? local_writev(i.localfd, vec, count)
+                 : IO(i.localfd, vec, count);
+      if (local_io_lost(fd, ret, send))
+        return IO(fd, vec, count);
+    }
+    if (send)
+      ret = dgram_sent(i, ret, iov_length(vec, count));
+    update_stats_vec(fd, send, vec, ret);
     return ret;
   }
 
   // We don't handle other states yet
   assert(i.state == STATE_UNOPT);
 
+  size_t before = get_byte_counter(i, send);
   ssize_t ret = IO(fd, vec, count);
+  if (ret == -1)
+    return ret;
 
   update_stats_vec(fd, send, vec, ret);
-  if (ret != -1)
-    submit_info_if_needed(fd);
+  after_tcp_io(fd, send, before);
   return ret;
 }
 
@@ -360,125 +688,139 @@ ssize_t do_ipc_sendmsg(int socket, const struct msghdr *message, int flags) {
   ipc_info &i = getInfo(getEP(socket));
   assert(i.state != STATE_INVALID);
 
+  if (i.connecting) {
+    check_connect(socket);
+    if (!is_registered_socket(socket))
+      return __real_sendmsg(socket, message, flags);
+  }
+
+  // UDP to somewhere other than our peer (as for sendto()).
+  if (i.dgram && message->msg_name &&
+      !is_peer_addr(socket, (const sockaddr *)message->msg_name,
+                    message->msg_namelen))
+    return __real_sendmsg(socket, message, flags);
+
   // If optimized, simply perform operation on local socket
   if (i.state == STATE_OPTIMIZED) {
     struct msghdr tmp = *message;
     tmp.msg_name = 0;
     tmp.msg_namelen = 0;
-    ssize_t ret = __real_sendmsg(i.localfd, &tmp, flags);
+    ssize_t ret;
+    if (i.ring) {
+      // The ring only carries data: anything else goes over the
+      // original socket, and everything after it.
+      if (message->msg_controllen > 0) {
+        ring_move(getEP(socket), i.localfd);
+        return __real_sendmsg(socket, message, flags);
+      }
+      if (ring_io(socket, i, tmp.msg_iov, tmp.msg_iovlen, flags, true, ret))
+        return __real_sendmsg(socket, message, flags);
+    } else {
+      ret = __real_sendmsg(i.localfd, &tmp, flags | MSG_NOSIGNAL);
+      if (local_io_lost(socket, ret, true))
+        return __real_sendmsg(socket, message, flags);
+    }
+    ret = dgram_sent(i, ret, iov_length(tmp.msg_iov, tmp.msg_iovlen));
     update_stats_vec(socket, true, tmp.msg_iov, ret);
     return ret;
   }
 
-  size_t bytes = 0;
-  int count = message->msg_iovlen;
-  for (int i = 0; i < count; ++i) {
-    // Overflow check...
-    if (SSIZE_MAX - bytes < message->msg_iov[i].iov_len) {
-      // We could try to set errno here,
-      // but easier to just let actual handler do this:
-      return __real_sendmsg(socket, message, flags);
-    }
+  size_t before = get_byte_counter(i, true);
+  ssize_t ret = __real_sendmsg(socket, message, flags);
+  if (ret == -1)
+    return ret;
 
-    bytes += message->msg_iov[i].iov_len;
-  }
+  update_stats_vec(socket, true, message->msg_iov, ret);
+  after_tcp_io(socket, true, before);
+
+  return ret;
+}
 
-  size_t &bytes_stat = get_byte_counter(i, true);
-  ssize_t rem = (TRANS_THRESHOLD - bytes_stat);
-  if (rem > 0 && size_t(rem) <= bytes) {
+ssize_t do_ipc_recvmsg(int socket, struct msghdr *message, int flags) {
+  ipc_info &i = getInfo(getEP(socket));
+  assert(i.state != STATE_INVALID);
 
+  if (i.connecting) {
+    check_connect(socket);
+    if (!is_registered_socket(socket))
+      return __real_recvmsg(socket, message, flags);
+  }
+
+  // Read what was sent over TCP before switching,
+  // without going past it.
+  if (i.draining() && !dgram_drain_over(socket, i)) {
+    if (i.dgram) {
+      ssize_t ret = __real_recvmsg(socket, message, flags);
+      if (ret != -1 && !(flags & MSG_PEEK)) {
+        update_stats_vec(socket, false, message->msg_iov,
+                         std::min(size_t(ret), iov_length(message->msg_iov,
+                                                          message->msg_iovlen)));
+      }
+      return ret;
+    }
     iovec newvec[100];
-    int newcount = truncate_iov(newvec, message->msg_iov, size_t(rem), count);
+    int newcount = truncate_iov(newvec, message->msg_iov,
+                                i.recv_mark - i.bytes_recv,
+                                message->msg_iovlen);
 
     struct msghdr newmsg = *message;
     newmsg.msg_iov = newvec;
     newmsg.msg_iovlen = newcount;
-    ssize_t ret = __real_sendmsg(socket, &newmsg, flags);
-
-    if (ret == -1) {
+    ssize_t ret = __real_recvmsg(socket, &newmsg, flags);
+    if (ret == -1)
       return ret;
-    }
-
-    update_stats_vec(socket, true, newvec, ret);
-    assert(bytes_stat <= TRANS_THRESHOLD);
-
-    attempt_optimization(socket, true);
 
+    message->msg_namelen = newmsg.msg_namelen;
+    message->msg_controllen = newmsg.msg_controllen;
+    message->msg_flags = newmsg.msg_flags;
+    if (!(flags & MSG_PEEK)) {
+      update_stats_vec(socket, false, newvec, ret);
+    }
     return ret;
   }
 
-  ssize_t ret = __real_sendmsg(socket, message, flags);
-
-  if (ret != -1) {
-    update_stats_vec(socket, true, message->msg_iov, ret);
-  }
-
-  return ret;
-}
-
-ssize_t do_ipc_recvmsg(int socket, struct msghdr *message, int flags) {
-  ipc_info &i = getInfo(getEP(socket));
-  assert(i.state != STATE_INVALID);
-
   // If optimized, simply perform operation on local socket
   if (i.state == STATE_OPTIMIZED) {
     struct msghdr tmp = *message;
     tmp.msg_name = 0;
     tmp.msg_namelen = 0;
-    ssize_t ret = __real_recvmsg(i.localfd, &tmp, flags);
+    ssize_t ret;
+    if (i.ring) {
+      if (ring_io(socket, i, tmp.msg_iov, tmp.msg_iovlen, flags, false, ret))
+        return __real_recvmsg(socket, message, flags);
+      tmp.msg_controllen = 0;
+      tmp.msg_flags = 0;
+    } else {
+      ret = __real_recvmsg(i.localfd, &tmp, flags);
+      if (local_io_lost(socket, ret, false))
+        return __real_recvmsg(socket, message, flags);
+    }
+    size_t len = iov_length(tmp.msg_iov, tmp.msg_iovlen);
     if (!(flags & MSG_PEEK)) {
-      update_stats_vec(socket, false, tmp.msg_iov, ret);
+      update_stats_vec(socket, false, tmp.msg_iov,
+                       ret == -1 ? ret : std::min(size_t(ret), len));
     }
     if (ret != -1) {
+      tmp.msg_name = message->msg_name;
+      tmp.msg_namelen = message->msg_namelen;
+      received_from(socket, i.dgram, (sockaddr *)tmp.msg_name,
+                    &tmp.msg_namelen);
       *message = tmp;
     }
     return ret;
   }
 
-  size_t bytes = 0;
-  int count = message->msg_iovlen;
-  for (int i = 0; i < count; ++i) {
-    // Overflow check...
-    if (SSIZE_MAX - bytes < message->msg_iov[i].iov_len) {
-      // We could try to set errno here,
-      // but easier to just let actual handler do this:
-      return __real_recvmsg(socket, message, flags);
-    }
-
-    bytes += message->msg_iov[i].iov_len;
-  }
-
-  size_t &bytes_stat = get_byte_counter(i, false);
-  ssize_t rem = (TRANS_THRESHOLD - bytes_stat);
-  if (rem > 0 && size_t(rem) <= bytes) {
-    iovec newvec[100];
-    int newcount = truncate_iov(newvec, message->msg_iov, rem, count);
-
-    struct msghdr newmsg = *message;
-    newmsg.msg_iov = newvec;
-    newmsg.msg_iovlen = newcount;
-    ssize_t ret = __real_recvmsg(socket, &newmsg, flags);
-
-    if (ret == -1)
-      return ret;
-    if (flags & MSG_PEEK)
-      return ret;
-
-    // Copy message out to reader
-    *message = newmsg;
-
-    update_stats_vec(socket, false, newvec, ret);
-    assert(bytes_stat <= TRANS_THRESHOLD);
-
-    attempt_optimization(socket, false);
-
+  size_t before = get_byte_counter(i, false);
+  ssize_t ret = __real_recvmsg(socket, message, flags);
+  if (ret == -1)
     return ret;
-  }
 
-  ssize_t ret = __real_recvmsg(socket, message, flags);
   if (!(flags & MSG_PEEK)) {
-    update_stats_vec(socket, false, message->msg_iov, ret);
+    update_stats_vec(socket, false, message->msg_iov,
+                     std::min(size_t(ret), iov_length(message->msg_iov,
+                                                      message->msg_iovlen)));
   }
+  after_tcp_io(socket, false, before);
 
   return ret;
 }
@@ -17,29 +17,40 @@
 
 #include "debug.h"
 #include "real.h"
-#include "rename_fd.h"
 #include "magic_socket_nums.h"
 #include "lock.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 static int ipcd_socket = 0;
 static int mypid = 0;
+// When we last failed to connect, zero if we didn't.
+static struct timespec connect_failed;
 
 // Must match that used by server,
 // currently defined in ipcd/clients.go
 const char *SOCK_PATH = "/tmp/ipcd.sock";
 const char *IPCD_BIN_PATH = "/bin/ipcd";
+// Held by a running ipcd, see LOCKFILE in ipcd/lock.go
+const char *IPCD_PID_PATH = "/tmp/ipcd.pid";
+// Held while starting ipcd, so only one process does.
+const char *IPCD_START_LOCK_PATH = "/tmp/ipcd.start";
 
 const useconds_t SLEEP_AFTER_IPCD_START_INTERVAL = 10 * 1000; // 10ms?
+// Seconds before connecting again after failing to.
+const time_t IPCD_RECONNECT_INTERVAL = 1;
 
 SimpleLock &getConnectLock() {
   static SimpleLock ConnectLock;
@@ -69,98 +80,165 @@ void check_if_we_are_ipcd() {
   we_are_ipcd = strcmp("ipcd", program_invocation_short_name) == 0;
 }
 
-void start_ipcd() {
+// In the child of fork_ipcd(): _exit() on failure, as exit() would run
+// our destructors with the connect lock we forked holding still held.
+void start_ipcd(int listen_fd) {
   int d = daemon(0, 0);
   if (d == -1) {
     perror("Failed to daemonize");
-    exit(1);
+    _exit(1);
+  }
+
+  // Hand ipcd the socket clients are already connecting to.
+  char buf[16];
+  sprintf(buf, "%d", listen_fd);
+  if (__real_fcntl_int(listen_fd, F_SETFD, 0) == -1 ||
+      setenv("IPCD_LISTEN_FD", buf, 1) == -1) {
+    perror("Failed to pass listening socket to ipcd");
+    _exit(1);
   }
 
   execl(IPCD_BIN_PATH, IPCD_BIN_PATH, (char *)NULL);
   perror("Failed to exec ipcd");
-  exit(1);
+  _exit(1);
 }
 
-void fork_ipcd() {
+void fork_ipcd(int listen_fd) {
   switch (__real_fork()) {
   case -1:
     break;
   case 0:
     // Child
-    start_ipcd();
+    start_ipcd(listen_fd);
     assert(0 && "Exec failed?");
     break;
   default:
-    // Wait for ipcd to start :P
     ipclog("Starting ipcd...\n");
   }
 }
 
-void connect_to_ipcd() {
+// Is some ipcd running (or starting), holding its lock file?
+static bool ipcd_running() {
+  int fd = open(IPCD_PID_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  bool running = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+  __real_close(fd);
+  return running;
+}
+
+// Create and bind the socket ipcd will accept clients on,
+// before starting it (as with socket activation): we can connect
+// right away, our requests waiting until ipcd is up to serve them.
+static int listen_for_ipcd(struct sockaddr_un &addr, int len) {
+  int fd = __real_socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  // daemon() replaces stdin/out/err, keep clear of them.
+  if (fd <= STDERR_FILENO) {
+    int newfd = __real_fcntl_int(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    __real_close(fd);
+    if (newfd == -1)
+      return -1;
+    fd = newfd;
+  }
+
+  unlink(SOCK_PATH);
+  if (__real_bind(fd, (struct sockaddr *)&addr, len) == -1 ||
+      chmod(SOCK_PATH, 0777) == -1 || __real_listen(fd, SOMAXCONN) == -1) {
+    perror("Failed to create ipcd socket");
+    __real_close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool connect_with_retries(int s, struct sockaddr_un &remote, int len) {
+  for (int attempts = 0; attempts < 10; ++attempts) {
+    usleep(SLEEP_AFTER_IPCD_START_INTERVAL);
+    if (__real_connect(s, (struct sockaddr *)&remote, len) != -1)
+      return true;
+  }
+  return false;
+}
+
+// Connect to ipcd, starting it if needed.  False if we can't:
+// requests then fail, leaving sockets to TCP, and connecting is
+// tried again later (see connect_if_needed).
+bool connect_to_ipcd() {
   int s, len;
   struct sockaddr_un remote;
 
   if ((s = __real_socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
     perror("socket");
-    exit(1);
+    return false;
+  }
+  // Move it out of the application's way.  We connect lazily, so
+  // MAGIC_SOCKET_FD may be taken by now: take the lowest free fd
+  // above it instead, or failing that any past stdin/out/err
+  // (ipcd_socket being 0 means we aren't connected).
+  int highfd = __real_fcntl_int(s, F_DUPFD_CLOEXEC, MAGIC_SOCKET_FD);
+  if (highfd == -1)
+    highfd = __real_fcntl_int(s, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+  if (highfd != -1) {
+    __real_close(s);
+    s = highfd;
   }
-  bool rename_success = rename_fd(s, MAGIC_SOCKET_FD, /* cloexec */ true);
-  assert(rename_success);
-  s = MAGIC_SOCKET_FD;
 
   remote.sun_family = AF_UNIX;
   strcpy(remote.sun_path, SOCK_PATH);
   len = strlen(remote.sun_path) + sizeof(remote.sun_family);
   if (__real_connect(s, (struct sockaddr *)&remote, len) == -1) {
-    // XXX: Super kludge!
-    // If we can't connect to daemon, assume it hasn't been
-    // started yet and attempt to run it ourselves.
-    // This code is terrible, and is likely to break
-    // badly in many situations, but works for now.
+    bool connected;
     if (errno == ENOENT || errno == ECONNREFUSED) {
-      fork_ipcd();
-
-      int attempts = 0;
-      const int MAX_ATTEMPTS = 10;
-      while (attempts < MAX_ATTEMPTS) {
-        usleep(SLEEP_AFTER_IPCD_START_INTERVAL);
-        if (__real_connect(s, (struct sockaddr *)&remote, len) != -1)
-          break;
-        ++attempts;
-      }
-      if (attempts == MAX_ATTEMPTS) {
-        perror("Unable to connect to ipcd after attempting to start it");
-        exit(1);
+      // If we can't connect to daemon, assume it hasn't been
+      // started yet and run it ourselves.  Processes getting
+      // here at once take turns, all but the first finding
+      // it running (or at least listening) by their turn.
+      int lock =
+          open(IPCD_START_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+      if (lock != -1)
+        flock(lock, LOCK_EX);
+      connected = __real_connect(s, (struct sockaddr *)&remote, len) != -1;
+      if (!connected && !ipcd_running()) {
+        int listen_fd = listen_for_ipcd(remote, len);
+        if (listen_fd != -1) {
+          fork_ipcd(listen_fd);
+          __real_close(listen_fd);
+          connected =
+              __real_connect(s, (struct sockaddr *)&remote, len) != -1;
+        }
       }
+      if (lock != -1)
+        __real_close(lock);
+
+      // Otherwise an ipcd not started by us is on its way.
+      connected = connected || connect_with_retries(s, remote, len);
     } else {
       // Race with socket creation and permissions, maybe?
       ipclog("Connect failed, attempting a few more times...\n");
-      int attempts = 0;
-      const int MAX_ATTEMPTS = 10;
-      while (attempts < MAX_ATTEMPTS) {
-        usleep(SLEEP_AFTER_IPCD_START_INTERVAL);
-        if (__real_connect(s, (struct sockaddr *)&remote, len) != -1)
-          break;
-        ++attempts;
-      }
-      if (attempts == MAX_ATTEMPTS) {
-        perror("Connect to ipcd socket");
-        ipclog("Error connecting to ipcd?\n");
-        exit(1);
-      }
+      connected = connect_with_retries(s, remote, len);
+    }
+    if (!connected) {
+      ipclog("Unable to connect to ipcd: %s\n", strerror(errno));
+      __real_close(s);
+      clock_gettime(CLOCK_MONOTONIC, &connect_failed);
+      return false;
     }
   }
 
   ipclog("Connected to IPCD, fd=%d\n", s);
   mypid = getpid();
   ipcd_socket = s;
+  connect_failed.tv_sec = 0;
+  return true;
 }
 
 void __ipcd_init() {
   assert(ipcd_socket == 0);
   check_if_we_are_ipcd();
-  if (ipcd_enabled())
-    connect_to_ipcd();
+  // We connect (and start ipcd, if needed) on first request,
+  // see connect_if_needed(): most processes never make one.
 }
 
 void __attribute__((destructor)) ipcd_dtor() {
@@ -200,11 +278,10 @@ void __attribute__((destructor)) ipcd_dtor() {
     return;
   }
   err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  assert(err > 5);
 
   const char *match = "200 REMOVED ";
   size_t matchlen = strlen(match);
-  if (size_t(err) < matchlen) {
+  if (err < 0 || size_t(err) < matchlen) {
     ipclog("Error receiving response from ipcd in dtor: %s\n", strerror(errno));
     return;
   }
@@ -218,15 +295,112 @@ void __attribute__((destructor)) ipcd_dtor() {
     ipclog("Failed to remove all fd's\n");
 }
 
+// Connect unless we are already, or failed to only just now:
+// while ipcd can't be reached, each request would otherwise
+// wait for it again.
 void connect_if_needed() {
   if (mypid == getpid())
     return;
 
-  ipclog("Reconnecting to ipcd in child...\n");
-  __real_close(ipcd_socket);
+  // Not connected yet, or connected by our parent before fork.
+  if (ipcd_socket != 0) {
+    ipclog("Reconnecting to ipcd in child...\n");
+    __real_close(ipcd_socket);
+    ipcd_socket = 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (connect_failed.tv_sec &&
+      now.tv_sec - connect_failed.tv_sec < IPCD_RECONNECT_INTERVAL)
+    return;
   connect_to_ipcd();
 }
 
+// Give up on our connection to ipcd, to connect again
+// on a later request.
+static void disconnect_from_ipcd() {
+  __real_close(ipcd_socket);
+  ipcd_socket = 0;
+  mypid = 0;
+}
+
+// Receive response that may have a descriptor attached,
+// setting 'fd' to it (or -1 if none).
+static int recv_with_fd(char *buf, size_t len, int &fd) {
+  struct iovec iov[1];
+  struct msghdr msg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  fd = -1;
+  int ret = __real_recvmsg(ipcd_socket, &msg, MSG_NOSIGNAL | MSG_CMSG_CLOEXEC);
+  if (ret <= 0)
+    return ret;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  return ret;
+}
+
+// Times a request is tried, reconnecting in between.
+const unsigned IPCD_REQUEST_ATTEMPTS = 3;
+
+// Send request (the first 'len' bytes of 'buf') and receive the
+// response into 'buf', NUL-terminated, along with its descriptor
+// if 'fd' is given (-1 if none).  Returns length of the response.
+// If ipcd went away, as when restarting (see ipcd/handoff.go),
+// reconnect and try again: ipcd answers all requests it has read
+// before leaving, so none is done twice.  'buf' is only written
+// once a response arrives.  Returns -1 if none does, it's too short
+// to be one (as is only the byte carrying a descriptor), or we
+// aren't connected: callers fail the request, leaving the socket
+// to TCP.
+// Must hold connect lock.
+static int ipcd_request(char *buf, int len, size_t size, int *fd) {
+  if (fd)
+    *fd = -1;
+  if (ipcd_socket == 0)
+    return -1;
+  for (unsigned attempt = 1;; ++attempt) {
+    int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
+    if (err >= 0) {
+      if (fd)
+        err = recv_with_fd(buf, size - 1, *fd);
+      else
+        err = __real_recv(ipcd_socket, buf, size - 1, MSG_NOSIGNAL);
+      if (err > 5 || (err > 0 && fd && *fd != -1)) {
+        buf[err] = 0;
+        return err;
+      }
+      if (err > 0) {
+        // Can't tell what we're reading any more.
+        buf[err] = 0;
+        ipclog("Bad response from ipcd: '%s'\n", buf);
+        disconnect_from_ipcd();
+        return -1;
+      }
+    }
+    ipclog("Lost connection to ipcd: %s\n", strerror(errno));
+    disconnect_from_ipcd();
+    if (attempt == IPCD_REQUEST_ATTEMPTS || !connect_to_ipcd())
+      return -1;
+  }
+}
+
 endpoint ipcd_register_socket(int fd) {
   ScopedLock L(getConnectLock());
   connect_if_needed();
@@ -235,22 +409,19 @@ endpoint ipcd_register_socket(int fd) {
   int len = sprintf(buf, "REGISTER %d %d\n", getpid(), fd);
   ASSERT_WITH_LOCK(len > 5);
 
-  ASSERT_WITH_LOCK(ipcd_socket);
   // ipclog("REGISTER %d -->\n", fd);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-
-  // ipclog("REGISTER %d <--\n", fd);
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return EP_INVALID;
 
   buf[err] = 0;
   int id;
   int n = sscanf(buf, "200 ID %d\n", &id);
-  ASSERT_WITH_LOCK(n == 1);
+  if (n != 1) {
+    // Most likely ipcd is busy, leave this socket alone.
+    ipclog("Unable to register fd=%d: %s", fd, buf);
+    return EP_INVALID;
+  }
 
   // ipclog("Registered and got endpoint id=%d\n", id);
 
@@ -264,13 +435,9 @@ bool ipcd_localize(endpoint local, endpoint remote) {
   char buf[100];
   int len = sprintf(buf, "LOCALIZE %d %d\n", local, remote);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
 
   return strncmp(buf, "200 OK\n", err) == 0;
 }
@@ -283,67 +450,42 @@ int ipcd_getlocalfd(endpoint local) {
   char buf[100];
   int len = sprintf(buf, "GETLOCALFD %d\n", local);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-
+  // Descriptor comes first, with a byte of its own.
   int fd;
-  {
-    // Lots of magic
-    const size_t CONTROLLEN = CMSG_LEN(sizeof(int));
-    struct iovec iov[1];
-    struct msghdr msg;
-    struct cmsghdr *cmsg;
-    char cmsg_buf[CONTROLLEN];
-    cmsg = (struct cmsghdr *)cmsg_buf;
-
-    memset(&msg, 0, sizeof(msg));
-
-    iov[0].iov_base = buf;
-    iov[0].iov_len = sizeof(buf);
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cmsg;
-    msg.msg_controllen = CONTROLLEN;
-
-    int ret = __real_recvmsg(ipcd_socket, &msg, MSG_NOSIGNAL);
-    if (ret <= 0) {
-      perror("recvmsg");
-      ASSERT_WITH_LOCK(0);
-    }
-
-    // TODO: Understand and fix mismatch between
-    // CONTROLLEN and msg.msg_controllen after recvmsg()!
-    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
-    ipclog("received local fd %d for endpoint %d\n", fd, local);
+  int err = ipcd_request(buf, len, sizeof(buf), &fd);
+  if (err == -1)
+    return -1;
+  if (fd == -1) {
+    ipclog("No local fd for endpoint %d: %s", local, buf);
+    return -1;
   }
+  ipclog("received local fd %d for endpoint %d\n", fd, local);
 
   err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
-
-  bool success = strncmp(buf, "200 OK\n", err) == 0;
-  ASSERT_WITH_LOCK(success);
-
-  return fd;
+  if (err <= 0) {
+    ipclog("Lost connection to ipcd: %s\n", strerror(errno));
+    disconnect_from_ipcd();
+  } else if (strncmp(buf, "200 OK\n", err) == 0) {
+    return fd;
+  } else {
+    buf[err] = 0;
+    ipclog("Unexpected response for local fd %d: %s", fd, buf);
+  }
+  __real_close(fd);
+  return -1;
 }
 
 // UNREGISTER
-bool ipcd_unregister_socket(endpoint ep) {
+bool ipcd_unregister_socket(endpoint ep, size_t sent, size_t recv, bool due) {
   ScopedLock L(getConnectLock());
   connect_if_needed();
 
   char buf[100];
-  int len = sprintf(buf, "UNREGISTER %d\n", ep);
+  int len = sprintf(buf, "UNREGISTER %d %zu %zu %d\n", ep, sent, recv, due);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
 
   return strncmp(buf, "200 OK\n", err) == 0;
 }
@@ -356,17 +498,31 @@ bool ipcd_reregister_socket(endpoint ep, int fd) {
   char buf[100];
   int len = sprintf(buf, "REREGISTER %d %d %d\n", ep, getpid(), fd);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
 
   return strncmp(buf, "200 OK\n", err) == 0;
 }
 
+// ADOPT
+bool ipcd_adopt(pid_t parent) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "ADOPT %d\n", parent);
+  ASSERT_WITH_LOCK(len > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
+
+  buf[err] = 0;
+  int count;
+  ipclog("adopt(%d) = %s\n", parent, buf);
+  return sscanf(buf, "200 ADOPTED %d\n", &count) == 1;
+}
+
 endpoint ipcd_endpoint_kludge(endpoint local) {
   ScopedLock L(getConnectLock());
   connect_if_needed();
@@ -374,13 +530,9 @@ endpoint ipcd_endpoint_kludge(endpoint local) {
   char buf[100];
   int len = sprintf(buf, "ENDPOINT_KLUDGE %d\n", local);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return EP_INVALID;
 
   buf[err] = 0;
   int id;
@@ -402,13 +554,9 @@ endpoint ipcd_crc_kludge(endpoint local, uint32_t s_crc, uint32_t r_crc,
   int len = sprintf(buf, "THRESH_CRC_KLUDGE %d %d %d %d\n", local, s_crc, r_crc,
                     last ? 1 : 0);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return EP_INVALID;
 
   buf[err] = 0;
   int id;
@@ -421,25 +569,70 @@ endpoint ipcd_crc_kludge(endpoint local, uint32_t s_crc, uint32_t r_crc,
   return EP_INVALID;
 }
 
-bool ipcd_endpoint_info(endpoint local, endpoint_info &ei) {
+// How ipcd says to treat an endpoint (ENDPOINT_INFO, UNIX_INFO).
+static bool parse_policy(const char *buf, endpoint_policy &policy) {
+  char hint[8];
+  unsigned long threshold = 0;
+  unsigned timeout = 0, calls = 0, age = 0;
+  int n = sscanf(buf, "200 %7s %lu %u %u %u\n", hint, &threshold, &timeout,
+                 &calls, &age);
+  if (n < 1)
+    return false;
+  bool tuned = n == 5;
+  policy.fast = strcmp(hint, "FAST") == 0;
+  policy.skip = strcmp(hint, "SKIP") == 0;
+  policy.threshold = tuned ? threshold : 0;
+  policy.pair_timeout = tuned ? timeout : 0;
+  policy.pair_calls = tuned ? calls : 0;
+  policy.pair_age = tuned ? age : 0;
+  return policy.fast || policy.skip || strcmp(hint, "OK") == 0;
+}
+
+bool ipcd_endpoint_info(endpoint local, endpoint_info &ei,
+                        endpoint_policy &policy) {
   ScopedLock L(getConnectLock());
   connect_if_needed();
 
   char buf[300];
   int len =
-      sprintf(buf, "ENDPOINT_INFO %d %s %d %s %d %ld %ld %ld %ld %d\n", local,
-              ei.src.addr, ei.src.port, ei.dst.addr, ei.dst.port,
+      sprintf(buf, "ENDPOINT_INFO %d %s %d %s %d %ld %ld %ld %ld %d %lu %d\n",
+              local, ei.src.addr, ei.src.port, ei.dst.addr, ei.dst.port,
               ei.connect_start.tv_sec, ei.connect_start.tv_nsec,
-              ei.connect_end.tv_sec, ei.connect_end.tv_nsec, ei.is_accept);
+              ei.connect_end.tv_sec, ei.connect_end.tv_nsec, ei.is_accept,
+              ei.inode, ei.dgram);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
 
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  return parse_policy(buf, policy);
+}
+
+bool ipcd_unix_info(endpoint local, unsigned long inode,
+                    endpoint_policy &policy) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "UNIX_INFO %d %lu\n", local, inode);
+  ASSERT_WITH_LOCK(len > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
+
+  return parse_policy(buf, policy);
+}
+
+bool ipcd_listen(endpoint local, netaddr &addr) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "LISTEN %d %s %d\n", local, addr.addr, addr.port);
+  ASSERT_WITH_LOCK(len > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return false;
 
   return strncmp(buf, "200 OK\n", err) == 0;
 }
@@ -452,13 +645,9 @@ endpoint ipcd_find_pair(endpoint local, pairing_info &pi, bool last) {
   int len = sprintf(buf, "FIND_PAIR %d %d %d %d\n", local, pi.s_crc, pi.r_crc,
                     last ? 1 : 0);
   ASSERT_WITH_LOCK(len > 5);
-  int err = __real_send(ipcd_socket, buf, len, MSG_NOSIGNAL);
-  if (err < 0) {
-    perror("write");
-    ASSERT_WITH_LOCK(0);
-  }
-  err = __real_recv(ipcd_socket, buf, 50, MSG_NOSIGNAL);
-  ASSERT_WITH_LOCK(err > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), NULL);
+  if (err == -1)
+    return EP_INVALID;
 
   buf[err] = 0;
   int id;
@@ -467,12 +656,129 @@ endpoint ipcd_find_pair(endpoint local, pairing_info &pi, bool last) {
   if (n == 1) {
     return id;
   }
+  if (strncmp(buf, "200 NOPEER\n", err) == 0) {
+    return EP_NOPEER;
+  }
+  if (strncmp(buf, "304 ", 4) == 0) {
+    return EP_BUSY;
+  }
+
+  return EP_INVALID;
+}
+
+// Interpret pairing response that comes with our local fd,
+// closing the fd (if any) unless paired.  'ring' if the fd
+// carries a shared-memory ring for us (see ring.cpp).
+static endpoint parse_pair_fd(const char *buf, int len, int &localfd,
+                              bool &ring) {
+  int id;
+  int n = sscanf(buf, "200 PAIR %d\n", &id);
+  ring = false;
+  if (n == 1 && localfd != -1) {
+    ring = strstr(buf, " RING") != NULL;
+    return id;
+  }
+  if (localfd != -1) {
+    __real_close(localfd);
+    localfd = -1;
+  }
+  if (strncmp(buf, "200 NOPEER\n", len) == 0) {
+    return EP_NOPEER;
+  }
+  if (strncmp(buf, "304 ", 4) == 0) {
+    return EP_BUSY;
+  }
 
   return EP_INVALID;
 }
 
+endpoint ipcd_find_pair_fd(endpoint local, pairing_info &pi, bool last,
+                           int &localfd, bool &ring) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "FIND_PAIR_FD %d %d %d %d %zu\n", local, pi.s_crc,
+                    pi.r_crc, last ? 1 : 0, pi.sent);
+  ASSERT_WITH_LOCK(len > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), &localfd);
+  if (err == -1)
+    return EP_INVALID;
+
+  buf[err] = 0;
+  ipclog("find_pair_fd(%d, %d, %d) = %s (fd=%d)\n", local, pi.s_crc, pi.r_crc,
+         buf, localfd);
+  endpoint remote = parse_pair_fd(buf, err, localfd, ring);
+  if (localfd != -1 &&
+      sscanf(buf, "200 PAIR %*d %zu\n", &pi.peer_sent) != 1) {
+    ipclog("Pairing response without sent mark: %s", buf);
+    __real_close(localfd);
+    localfd = -1;
+    return EP_INVALID;
+  }
+  return remote;
+}
+
+endpoint ipcd_find_pair_fast(endpoint local, bool last, int &localfd,
+                             bool &ring) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "FIND_PAIR_FAST %d %d\n", local, last ? 1 : 0);
+  ASSERT_WITH_LOCK(len > 5);
+  int err = ipcd_request(buf, len, sizeof(buf), &localfd);
+  if (err == -1)
+    return EP_INVALID;
+
+  buf[err] = 0;
+  ipclog("find_pair_fast(%d) = %s (fd=%d)\n", local, buf, localfd);
+  return parse_pair_fd(buf, err, localfd, ring);
+}
+
+int ipcd_vlisten(endpoint local, netaddr &addr) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[100];
+  int len = sprintf(buf, "VLISTEN %d %s %d\n", local, addr.addr, addr.port);
+  ASSERT_WITH_LOCK(len > 5);
+  int queue;
+  int err = ipcd_request(buf, len, sizeof(buf), &queue);
+  if (err == -1)
+    return -1;
+
+  if (strncmp(buf, "200 OK\n", err) != 0 && queue != -1) {
+    __real_close(queue);
+    queue = -1;
+  }
+  return queue;
+}
+
+int ipcd_vconnect(endpoint local, netaddr &src, netaddr &dst) {
+  ScopedLock L(getConnectLock());
+  connect_if_needed();
+
+  char buf[200];
+  int len = sprintf(buf, "VCONNECT %d %s %d %s %d\n", local, src.addr,
+                    src.port, dst.addr, dst.port);
+  ASSERT_WITH_LOCK(len > 5);
+  int fd;
+  int err = ipcd_request(buf, len, sizeof(buf), &fd);
+  if (err == -1)
+    return -1;
+
+  buf[err] = 0;
+  ipclog("vconnect(%d) = %s (fd=%d)\n", local, buf, fd);
+  if (strncmp(buf, "200 OK\n", err) != 0 && fd != -1) {
+    __real_close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
 bool ipcd_is_protected(int fd) {
-  return fd == ipcd_socket;
+  return ipcd_socket != 0 && fd == ipcd_socket;
 }
 
 bool ipcd_enabled() {
@@ -18,10 +18,15 @@
 
 #include <stdint.h>
 #include <arpa/inet.h> // For INET6_ADDRSTRLEN :/
+#include <sys/types.h>
 
 typedef uint32_t endpoint;
 
 const endpoint EP_INVALID = ~endpoint(0);
+// ipcd is overloaded, don't try again for now
+const endpoint EP_BUSY = EP_INVALID - 1;
+// Peer isn't a local socket, don't bother trying again
+const endpoint EP_NOPEER = EP_INVALID - 2;
 
 typedef struct {
   char addr[INET6_ADDRSTRLEN];
@@ -31,6 +36,9 @@ typedef struct {
 typedef struct {
   uint32_t s_crc;
   uint32_t r_crc;
+  // Bytes we've sent over TCP, and (once paired) our peer has.
+  size_t sent;
+  size_t peer_sent;
 } pairing_info;
 
 typedef struct {
@@ -39,8 +47,25 @@ typedef struct {
   struct timespec connect_end;
   netaddr src;
   netaddr dst;
+  // Socket inode, lets ipcd find our peer from the kernel (0 if unknown)
+  unsigned long inode;
+  // Connected UDP socket?
+  bool dgram;
 } endpoint_info;
 
+// How ipcd says to treat an endpoint
+typedef struct {
+  bool fast;
+  bool skip;
+  // Set by ipcd's policy, 0 for our defaults: bytes carried, calls
+  // made or time connected (ms) before pairing is first tried,
+  // and how long each try waits (ms).
+  size_t threshold;
+  unsigned pair_timeout;
+  unsigned pair_calls;
+  unsigned pair_age;
+} endpoint_policy;
+
 // Initialize connection
 void __ipcd_init();
 
@@ -48,6 +73,7 @@ void __ipcd_init();
 bool ipcd_enabled();
 
 // REGISTER
+// Returns EP_INVALID if ipcd refused.
 endpoint ipcd_register_socket(int fd);
 
 // LOCALIZE
@@ -57,11 +83,19 @@ bool ipcd_localize(endpoint local, endpoint remote);
 int ipcd_getlocalfd(endpoint local);
 
 // UNREGISTER
-bool ipcd_unregister_socket(endpoint ep);
+// Byte counts, and whether it got far enough to be paired ('due'),
+// let ipcd learn which connections are worth optimizing.
+bool ipcd_unregister_socket(endpoint ep, size_t sent, size_t recv, bool due);
 
 // REREGISTER
 bool ipcd_reregister_socket(endpoint ep, int fd);
 
+// ADOPT
+bool ipcd_adopt(pid_t parent);
+
+// LISTEN
+bool ipcd_listen(endpoint local, netaddr &addr);
+
 // ENDPOINT_KLUDGE
 endpoint ipcd_endpoint_kludge(endpoint local);
 
@@ -70,11 +104,51 @@ endpoint ipcd_crc_kludge(endpoint local, uint32_t s_crc, uint32_t r_crc,
                          bool last);
 
 // FIND_PAIR
+// Returns EP_BUSY if ipcd is overloaded,
+// EP_NOPEER if ipcd knows our peer isn't local.
 endpoint ipcd_find_pair(endpoint local, pairing_info &pi, bool last);
 
+// FIND_PAIR_FD
+// Like ipcd_find_pair, but once paired also localizes the pair
+// and sets 'localfd' to our end of it (-1 if not paired), 'ring'
+// if it carries a shared-memory ring to send data through instead.
+// Exchanges 'sent' for our peer's, so data still in flight
+// over TCP can be drained after switching.
+endpoint ipcd_find_pair_fd(endpoint local, pairing_info &pi, bool last,
+                           int &localfd, bool &ring);
+
+// FIND_PAIR_FAST
+// Pair before anything is sent, for endpoints ipcd said are 'fast'.
+// Like ipcd_find_pair_fd, and returns EP_NOPEER once pairing
+// this way is no longer possible.
+endpoint ipcd_find_pair_fast(endpoint local, bool last, int &localfd,
+                             bool &ring);
+
+// VLISTEN
+// Like ipcd_listen, also accepting virtual connections.
+// Returns the accept queue they arrive on, or -1.
+int ipcd_vlisten(endpoint local, netaddr &addr);
+
+// VCONNECT
+// Connect to virtual listener at 'dst', returning
+// our end of the connection or -1 if there isn't one.
+int ipcd_vconnect(endpoint local, netaddr &src, netaddr &dst);
+
 // Does ipcd need the specified fd?
 bool ipcd_is_protected(int fd);
 
-bool ipcd_endpoint_info(endpoint local, endpoint_info &ei);
+// ENDPOINT_INFO
+// Sets 'fast' if the endpoint is connected to a local listener
+// and can be paired right away using ipcd_find_pair_fast,
+// 'skip' if it isn't worth tracking (going by similar connections
+// or ipcd's policy), and whatever else the policy says.
+bool ipcd_endpoint_info(endpoint local, endpoint_info &ei,
+                        endpoint_policy &policy);
+
+// UNIX_INFO
+// Like ipcd_endpoint_info, for AF_UNIX stream sockets: ipcd
+// finds their peer by 'inode', there being no addresses.
+bool ipcd_unix_info(endpoint local, unsigned long inode,
+                    endpoint_policy &policy);
 
 #endif // _IPCD_H_
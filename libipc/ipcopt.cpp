@@ -14,30 +14,33 @@
 //===----------------------------------------------------------------------===//
 
 #include "debug.h"
+#include "epoll.h"
 #include "ipcd.h"
 #include "ipcopt.h"
 #include "ipcreg_internal.h"
 #include "real.h"
+#include "ring.h"
 #include "shm.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
 
 // TODO: This table is presently not used thread-safe at all!
 libipc_state state;
-libipc_state::libipc_state() {
-  for (unsigned i = 0; i < TABLE_SIZE; ++i) {
-    FDMap[i] = fd_info();
-    EndpointInfo[i] = ipc_info();
-  }
-}
+// Set once we have endpoints, walking the table before then
+// would only fault in pages we otherwise never touch.
+static bool have_endpoints = false;
 
 void scan_for_cloexec() {
   for (unsigned i = 0; i < TABLE_SIZE; ++i) {
     fd_info &f = getFDInfo(i);
-    if ((valid_ep(f.EP) || f.epoll.valid) && f.close_on_exec) {
+    bool tracked = valid_ep(f.EP) || f.epoll.valid || f.is_virtual;
+    if (tracked && f.close_on_exec) {
       // This fd is actually already closed!
 
       // Unregister it, closing localfd as needed...
@@ -46,26 +49,46 @@ void scan_for_cloexec() {
   }
 }
 
+// Map the rings of endpoints we kept across exec() again.  Any we
+// can't we give up on, our peer carrying on over the original
+// socket once it's read what's left in the ring.
+void reattach_rings() {
+  for (unsigned i = 0; i < TABLE_SIZE; ++i) {
+    endpoint ep = getFDInfo(i).EP;
+    if (!valid_ep(ep) || !getInfo(ep).ring)
+      continue;
+    ipc_info &info = getInfo(ep);
+    if (!ring_reattach(ep, info.localfd, info.auxfd, info.ring_side))
+      demote_socket(i);
+  }
+}
+
 void dump_registered_fds() {
   for (unsigned i = 0; i < TABLE_SIZE; ++i) {
     fd_info &f = getFDInfo(i);
     if (valid_ep(f.EP)) {
       ipc_info &info = getInfo(f.EP);
-      ipclog("Inherited known fd: %d -> (endpoint: %d, localfd: %d)\n", i, f.EP,
-             info.localfd);
+      ipclog("Inherited known fd: %d -> (endpoint: %d, localfd: %d)\n", i,
+             endpoint(f.EP), info.localfd);
     }
   }
 }
 
 void __ipcopt_init() {
-  state = libipc_state();
-  shm_state_restore();
+  // Nothing to do unless we inherited state across exec,
+  // our table is ready as-is.
+  if (!shm_state_restore())
+    return;
+  have_endpoints = true;
   scan_for_cloexec();
+  reattach_rings();
   dump_registered_fds();
 }
 
 void __attribute__((destructor)) ipcopt_fini() {
   ipclog("ipcopt_fini()!\n");
+  if (!have_endpoints)
+    return;
   for (unsigned i = 0; i < TABLE_SIZE; ++i)
     if (is_registered_socket(i)) {
       endpoint ep = getEP(i);
@@ -88,8 +111,10 @@ void __attribute__((destructor)) ipcopt_fini() {
       // only to let IPCD know we're done with it.
 
       endpoint ep = getEP(i);
-      if (--getInfo(ep).ref_count == 0) {
-        bool success = ipcd_unregister_socket(ep);
+      ipc_info &info = getInfo(ep);
+      if (--info.ref_count == 0) {
+        bool success = ipcd_unregister_socket(
+            ep, info.bytes_sent, info.bytes_recv, pairing_was_due(info));
         if (!success) {
           ipclog("Failure unregistering socket in destructor!\n");
         }
@@ -104,15 +129,24 @@ void invalidate(endpoint ep) {
   i.reset();
 }
 
-void register_inet_socket(int fd, bool is_accept) {
+bool register_inet_socket(int fd, bool is_accept) {
   if (!ipcd_enabled())
-    return;
+    return false;
   // Freshly created socket
   ipclog("Registering socket fd=%d\n", fd);
-  endpoint &ep = getEP(fd);
+  ep_slot &ep = getEP(fd);
   // We better not think we already have an endpoint ID for this fd
   assert(ep == EP_INVALID);
-  ep = ipcd_register_socket(fd);
+  endpoint id = ipcd_register_socket(fd);
+  if (!valid_ep(id)) {
+    // Refused by ipcd, or beyond what we can track:
+    // just use the socket as-is.
+    if (id != EP_INVALID)
+      ipcd_unregister_socket(id, 0, 0, false);
+    return false;
+  }
+  ep = id;
+  have_endpoints = true;
 
   ipc_info &i = getInfo(ep);
   assert(i.ref_count == 0);
@@ -122,6 +156,7 @@ void register_inet_socket(int fd, bool is_accept) {
   i.ref_count++;
   i.is_accept = is_accept;
   i.state = STATE_UNOPT;
+  return true;
 }
 
 void unregister_inet_socket(int fd) {
@@ -134,6 +169,8 @@ void unregister_inet_socket(int fd) {
   // Closing epoll fd makes it no longer valid epoll fd.
   fd_info &f = getFDInfo(fd);
   f.epoll.valid = false;
+  f.is_virtual = false;
+  f.unix_listener = false;
 
   endpoint ep = getEP(fd);
   // Allow attempt to unregister fd's we don't
@@ -153,14 +190,22 @@ void unregister_inet_socket(int fd) {
   if (--i.ref_count == 0) {
     // Last reference to this endpoint,
     // tell ipcd we're done with it.
-    bool success = ipcd_unregister_socket(ep);
+    bool success = ipcd_unregister_socket(ep, i.bytes_sent, i.bytes_recv,
+                                          pairing_was_due(i));
     if (!success) {
       ipclog("ipcd_unregister_socket(%d) failed!\n", ep);
     }
 
     // Close local fd if exists
+    if (i.auxfd) {
+      assert(i.state == STATE_VLISTEN || i.ring);
+      __real_close(i.auxfd);
+      is_local(i.auxfd) = false;
+    }
     if (i.localfd) {
-      assert(i.state == STATE_OPTIMIZED);
+      assert(i.state == STATE_OPTIMIZED || i.state == STATE_VLISTEN);
+      if (i.ring)
+        ring_detach(ep);
       __real_close(i.localfd);
 
       ipclog("Closing opt. endpt : ep=%d, fd=%d, localfd=%d, S: %zu R: %zu\n",
@@ -182,6 +227,147 @@ void unregister_inet_socket(int fd) {
   }
 }
 
+// Give up on optimizing this fd's endpoint: tell ipcd we're done
+// with it, and stop tracking every fd referring to it, so their
+// I/O goes straight to libc as if we weren't here.
+void retire_socket(int fd) {
+  endpoint ep = getEP(fd);
+  assert(valid_ep(ep));
+  ipc_info &i = getInfo(ep);
+  assert(i.state == STATE_UNOPT);
+  ipclog("Retiring ep=%d (fd=%d), S: %zu R: %zu\n", ep, fd, i.bytes_sent,
+         i.bytes_recv);
+
+  if (!ipcd_unregister_socket(ep, i.bytes_sent, i.bytes_recv,
+                              pairing_was_due(i))) {
+    ipclog("ipcd_unregister_socket(%d) failed!\n", ep);
+  }
+  for (unsigned f = 0; f < TABLE_SIZE && i.ref_count > 0; ++f) {
+    fd_info &fi = getFDInfo(f);
+    if (fi.EP != ep)
+      continue;
+    fi.EP = EP_INVALID;
+    fi.close_on_exec = false;
+    --i.ref_count;
+  }
+  assert(i.ref_count == 0);
+  invalidate(ep);
+}
+
+// Our peer's gone, and the local transport with it: drop that
+// and retire the endpoint, leaving TCP (which the peer closed
+// as well) to report how the connection ended.  Also once our
+// peer moved on from its ring to the original socket, as we then
+// do as well.
+void demote_socket(int fd) {
+  endpoint ep = getEP(fd);
+  ipc_info &i = getInfo(ep);
+  assert(i.state == STATE_OPTIMIZED);
+  ipclog("Peer of ep=%d (fd=%d) gone, demoting, S: %zu R: %zu\n", ep, fd,
+         i.bytes_sent, i.bytes_recv);
+
+  if (i.ring) {
+    ring_move(ep, i.localfd);
+    ring_detach(ep);
+    __real_close(i.auxfd);
+    is_local(i.auxfd) = false;
+    i.auxfd = 0;
+    i.ring = false;
+  }
+
+  epoll_replace_fd(i.localfd, fd);
+  __real_close(i.localfd);
+  is_local(i.localfd) = false;
+  i.localfd = 0;
+  i.state = STATE_UNOPT;
+  retire_socket(fd);
+}
+
+static bool is_loopback(const struct sockaddr *addr) {
+  if (addr->sa_family == AF_INET)
+    return (ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr) >>
+            24) == IN_LOOPBACKNET;
+  const struct in6_addr &a = ((const struct sockaddr_in6 *)addr)->sin6_addr;
+  return IN6_IS_ADDR_LOOPBACK(&a) ||
+         (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == IN_LOOPBACKNET);
+}
+
+// A UDP socket was connected to 'addr': track it from now on, it
+// has a peer to be paired with.  Unconnected ones aren't tracked,
+// what they send (and where) is left alone, and neither are those
+// connected off this host (the resolver's, say), sparing them
+// talking to ipcd.
+void register_dgram_socket(int fd, const struct sockaddr *addr) {
+  if (!ipcd_enabled() || !inbounds_fd(fd) || !is_loopback(addr))
+    return;
+  int proto;
+  socklen_t len = sizeof(proto);
+  if (__real_getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) != 0 ||
+      proto != IPPROTO_UDP)
+    return;
+  if (!register_inet_socket(fd, false))
+    return;
+  getInfo(getEP(fd)).dgram = true;
+  set_nonblocking(fd, __real_fcntl_int(fd, F_GETFL, 0) & O_NONBLOCK);
+  set_cloexec(fd, __real_fcntl_int(fd, F_GETFD, 0) & FD_CLOEXEC);
+  struct timespec now = get_time();
+  set_time(fd, now, now);
+  submit_info_if_needed(fd);
+}
+
+// A tracked UDP socket is connecting elsewhere, or disconnecting:
+// whatever it was paired with is no longer its peer.
+void release_dgram_socket(int fd) {
+  if (getInfo(getEP(fd)).state == STATE_OPTIMIZED)
+    demote_socket(fd);
+  else
+    retire_socket(fd);
+}
+
+static bool is_unix_stream(int fd) {
+  int domain, type;
+  socklen_t len = sizeof(domain);
+  if (__real_getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0)
+    return false;
+  len = sizeof(type);
+  return domain == AF_UNIX &&
+         __real_getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+         type == SOCK_STREAM;
+}
+
+// An AF_UNIX stream socket was connected, or accepted from a
+// listener we know of: track it, ipcd finding its peer by inode.
+// Those created otherwise (socketpair()) have no peer to find.
+void register_unix_socket(int fd, bool is_accept) {
+  if (!ipcd_enabled() || !inbounds_fd(fd) || !is_unix_stream(fd))
+    return;
+  if (!register_inet_socket(fd, is_accept))
+    return;
+  getInfo(getEP(fd)).af_unix = true;
+  set_nonblocking(fd, __real_fcntl_int(fd, F_GETFL, 0) & O_NONBLOCK);
+  set_cloexec(fd, __real_fcntl_int(fd, F_GETFD, 0) & FD_CLOEXEC);
+  struct timespec now = get_time();
+  set_time(fd, now, now);
+  submit_info_if_needed(fd);
+}
+
+// Listening AF_UNIX stream sockets aren't registered themselves,
+// only marked so what they accept is.
+void register_unix_listener(int fd) {
+  if (!ipcd_enabled() || !inbounds_fd(fd) || is_registered_socket(fd) ||
+      !is_unix_stream(fd))
+    return;
+  getFDInfo(fd).unix_listener = true;
+}
+
+bool is_unix_listener(int fd) {
+  return inbounds_fd(fd) && getFDInfo(fd).unix_listener;
+}
+
+char is_dgram_socket(int fd) {
+  return is_registered_socket(fd) && getInfo(getEP(fd)).dgram;
+}
+
 char is_registered_socket(int fd) {
   return inbounds_fd(fd) && (getEP(fd) != EP_INVALID);
 }
@@ -197,10 +383,20 @@ char is_optimized_socket_safe(int fd) {
   return getInfo(ep).state == STATE_OPTIMIZED;
 }
 
+// Optimized and done draining, so readiness comes from the localfd.
+char is_drained_socket_safe(int fd) {
+  if (!is_optimized_socket_safe(fd))
+    return false;
+  ipc_info &i = getInfo(getEP(fd));
+  return !i.draining() || dgram_drain_over(fd, i);
+}
+
 int getlocalfd(int fd) {
   assert(is_registered_socket(fd));
-  int local = ipcd_getlocalfd(getEP(fd));
+  return track_localfd(ipcd_getlocalfd(getEP(fd)));
+}
 
+int track_localfd(int local) {
   bool &isLocal = is_local(local);
   assert(!isLocal);
   assert(getEP(local) == EP_INVALID);
@@ -237,7 +433,10 @@ char is_protected_fd(int fd) {
   return false;
 }
 
-void register_inherited_fds() {
+unsigned register_inherited_fds() {
+  unsigned count = 0;
+  if (!have_endpoints)
+    return count;
   for (unsigned ep = 0; ep < TABLE_SIZE; ++ep) {
     ipc_info &i = getInfo(ep);
     if (i.state != STATE_INVALID) {
@@ -245,9 +444,12 @@ void register_inherited_fds() {
       bool ret = ipcd_reregister_socket(ep, 0 /* XXX */);
       if (!ret) {
         ipclog("Failed to reregister endpoint '%d'\n", ep);
+      } else {
+        ++count;
       }
     }
   }
+  return count;
 }
 
 void dup_inet_socket(int fd1, int fd2) {
@@ -256,6 +458,15 @@ void dup_inet_socket(int fd1, int fd2) {
   // Ensure fd2 is closed if we didn't already think so.
   unregister_inet_socket(fd2);
 
+  if (is_virtual_socket(fd1)) {
+    fd_info &f1 = getFDInfo(fd1);
+    fd_info &f2 = getFDInfo(fd2);
+    f2.is_virtual = true;
+    f2.virt_local = f1.virt_local;
+    f2.virt_peer = f1.virt_peer;
+    return;
+  }
+
   if (!is_registered_socket(fd1)) {
     return;
   }
@@ -320,9 +531,9 @@ bool get_netaddr(int fd, netaddr &na, bool local) {
   socklen_t len = sizeof(addr);
   int ret;
   if (local)
-    ret = getsockname(fd, (struct sockaddr *)&addr, &len);
+    ret = __real_getsockname(fd, (struct sockaddr *)&addr, &len);
   else
-    ret = getpeername(fd, (struct sockaddr *)&addr, &len);
+    ret = __real_getpeername(fd, (struct sockaddr *)&addr, &len);
   if (ret != 0) {
     perror("get_netaddr getsockname/getpeername");
     return false;
@@ -361,29 +572,116 @@ void set_time(int fd, struct timespec start, struct timespec end) {
   assert(!i.sent_info);
 }
 
+// Non-blocking connect() in progress: the end time
+// (and everything else) waits until it completes.
+void set_connecting(int fd, struct timespec start) {
+  endpoint ep = getEP(fd);
+  assert(valid_ep(ep));
+
+  ipc_info &i = getInfo(ep);
+  assert(!i.sent_info && !i.connecting);
+  i.connect_start = start;
+  i.connecting = true;
+}
+
+char is_connecting_socket(int fd) {
+  return is_registered_socket(fd) && getInfo(getEP(fd)).connecting;
+}
+
+// Has a non-blocking connect() completed?  If so, finish up as
+// connect() itself would have.  Checked without consuming
+// SO_ERROR, that's for the application to read.
+void check_connect(int fd) {
+  if (!is_connecting_socket(fd))
+    return;
+  struct pollfd p = {fd, POLLOUT, 0};
+  if (__real_poll(&p, 1, 0) != 1)
+    return;
+
+  ipc_info &i = getInfo(getEP(fd));
+  i.connecting = false;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (__real_getpeername(fd, (struct sockaddr *)&addr, &len) != 0) {
+    // Connecting failed, nothing to optimize.
+    ipclog("async connect() failed, fd=%d\n", fd);
+    retire_socket(fd);
+    return;
+  }
+  i.connect_end = get_time();
+  ipclog("async connect() completed, fd=%d\n", fd);
+  submit_info_if_needed(fd);
+  attempt_fast_optimization(fd, false);
+}
+
 void submit_info_if_needed(int fd) {
   if (!is_registered_socket(fd))
     return;
   endpoint ep = getEP(fd);
 
   ipc_info &i = getInfo(ep);
-  if (i.state != STATE_UNOPT)
+  if (i.state != STATE_UNOPT || i.connecting)
     return;
 
   if (i.sent_info)
     return;
 
-  endpoint_info ei;
-  ei.is_accept = i.is_accept;
-  ei.connect_start = i.connect_start;
-  ei.connect_end = i.connect_end;
-
-  if (!get_netaddr(fd, ei.src, true) ||
-      !get_netaddr(fd, ei.dst, false)) {
-    ipclog("Unable to gather info for fd=%d, ep=%d\n", fd, ep);
+  endpoint_policy policy;
+  struct stat st;
+  if (i.af_unix) {
+    // Nothing to go by but the inode, which ipcd finds our peer by.
+    if (fstat(fd, &st) != 0) {
+      ipclog("Unable to gather info for fd=%d, ep=%d\n", fd, ep);
+      return;
+    }
+    i.sent_info = ipcd_unix_info(ep, st.st_ino, policy);
+  } else {
+    endpoint_info ei;
+    ei.is_accept = i.is_accept;
+    ei.dgram = i.dgram;
+    ei.connect_start = i.connect_start;
+    ei.connect_end = i.connect_end;
+
+    if (!get_netaddr(fd, ei.src, true) ||
+        !get_netaddr(fd, ei.dst, false)) {
+      ipclog("Unable to gather info for fd=%d, ep=%d\n", fd, ep);
+      return;
+    }
+    ei.inode =
+        (fstat(fd, &st) == 0 && st.st_ino <= UINT32_MAX) ? st.st_ino : 0;
+    i.sent_info = ipcd_endpoint_info(ep, ei, policy);
+  }
+  if (!i.sent_info) {
+    // ipcd may have expired this endpoint, don't bother optimizing it.
+    ipclog("Failed to submit info for fd=%d, ep=%d\n", fd, ep);
+    retire_socket(fd);
+    return;
+  }
+  if (policy.skip) {
+    // Connections like this rarely get far enough to pay off.
+    ipclog("Not tracking fd=%d, ep=%d\n", fd, ep);
+    retire_socket(fd);
     return;
   }
-  i.sent_info = ipcd_endpoint_info(ep, ei);
-  assert(i.sent_info);
+  i.fast = policy.fast;
+  i.threshold = policy.threshold;
+  i.pair_calls = policy.pair_calls;
+  i.pair_age = policy.pair_age;
+  i.pair_timeout = policy.pair_timeout;
   ipclog("submitted info for fd=%d, ep=%d\n", fd, ep);
 }
+
+// virtual.cpp
+bool virtual_listen(int fd, netaddr &na);
+
+void register_listener(int fd) {
+  if (!is_registered_socket(fd))
+    return;
+  endpoint ep = getEP(fd);
+
+  netaddr na;
+  if (!get_netaddr(fd, na, true))
+    return;
+  if (!virtual_listen(fd, na) && !ipcd_listen(ep, na))
+    ipclog("Failed to register listener fd=%d, ep=%d\n", fd, ep);
+}
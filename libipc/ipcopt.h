@@ -31,11 +31,20 @@ extern "C" {
 void __ipcopt_init();
 
 // FD registration
-void register_inet_socket(int fd, bool accept);
+bool register_inet_socket(int fd, bool accept);
 char is_registered_socket(int fd);
 char is_optimized_socket_safe(int fd);
+char is_drained_socket_safe(int fd);
 void unregister_inet_socket(int fd);
+void retire_socket(int fd);
+void demote_socket(int fd);
 void dup_inet_socket(int fd, int fd2);
+void register_dgram_socket(int fd, const struct sockaddr *addr);
+void release_dgram_socket(int fd);
+char is_dgram_socket(int fd);
+void register_unix_socket(int fd, bool accept);
+void register_unix_listener(int fd);
+bool is_unix_listener(int fd);
 
 bool is_accept(int fd);
 
@@ -46,14 +55,36 @@ void set_local_nonblocking(int fd, bool nonblocking);
 void set_cloexec(int fd, bool cloexec);
 
 int getlocalfd(int fd);
-void register_inherited_fds();
+int track_localfd(int local);
+unsigned register_inherited_fds();
 char is_protected_fd(int fd);
 
 // Timing
 struct timespec get_time();
 void set_time(int fd, struct timespec start, struct timespec end);
+void set_connecting(int fd, struct timespec start);
+char is_connecting_socket(int fd);
+void check_connect(int fd);
 void submit_info_if_needed(int fd);
 
+// Pairing at connect/accept time
+void register_listener(int fd);
+void attempt_fast_optimization(int fd, bool wait);
+
+// Virtual connections
+char is_virtual_socket(int fd);
+bool is_virtual_listener(int fd);
+int real_socket_fd(int fd);
+bool virtual_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int virtual_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                    int flags, bool &is_virtual);
+int virtual_getname(int fd, struct sockaddr *address, socklen_t *address_len,
+                    bool local);
+int virtual_getsockopt(int fd, int level, int option_name, void *option_value,
+                       socklen_t *option_len);
+int virtual_setsockopt(int fd, int level, int option_name,
+                       const void *option_value, socklen_t option_len);
+
 // R/W operations using best available transport
 ssize_t do_ipc_send(int fd, const void *buf, size_t count, int flags);
 ssize_t do_ipc_recv(int fd, void *buf, size_t count, int flags);
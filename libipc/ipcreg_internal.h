@@ -39,12 +39,15 @@ enum EndpointState {
   STATE_UNOPT,
   STATE_ID_EXCHANGE,
   STATE_OPTIMIZED,
-  STATE_NOOPT
+  // Listener also accepting virtual connections
+  STATE_VLISTEN
 };
 
 struct epoll_entry {
   int fd;
   epoll_event event;
+  // Edge-triggered on a ring: how far it was told of (ring.cpp).
+  uint64_t ring_seen;
 };
 
 struct epoll_info {
@@ -53,39 +56,107 @@ struct epoll_info {
   epoll_entry entries[MAX_EPOLL_ENTRIES];
 };
 
+// Endpoint ID, stored off by one so that EP_INVALID is zero:
+// tables start out zeroed (untouched), with no endpoints.
+struct ep_slot {
+  endpoint stored;
+  operator endpoint() const { return stored - 1; }
+  ep_slot &operator=(endpoint ep) {
+    stored = ep + 1;
+    return *this;
+  }
+};
+
+// boost::crc_32_type without its constructor, which would
+// otherwise have to run over every entry of our table.
+struct running_crc {
+  boost::crc_32_type::value_type rem;
+  void reset() { rem = boost::crc_32_type().get_interim_remainder(); }
+  void process_bytes(const void *buf, size_t count) {
+    boost::crc_32_type crc(rem);
+    crc.process_bytes(buf, count);
+    rem = crc.get_interim_remainder();
+  }
+  boost::crc_32_type::value_type checksum() const {
+    return boost::crc_32_type(rem).checksum();
+  }
+};
+
+// Zeroed means unused, see libipc_state.
 struct fd_info {
   // Does this FD have an EP to go with it?
-  endpoint EP;
+  ep_slot EP;
   // Is it set to close-on-exec?
   bool close_on_exec;
   // Local?
   bool is_local;
   // epoll information, if applicible...
   epoll_info epoll;
-
-  fd_info() : EP(EP_INVALID), close_on_exec(false), is_local(false), epoll() {}
+  // Virtual connection, addresses it pretends to have
+  bool is_virtual;
+  sockaddr_in virt_local;
+  sockaddr_in virt_peer;
+  // AF_UNIX stream listener, tracking what it accepts
+  bool unix_listener;
 };
 
 struct ipc_info {
   // Bytes transmitted through this endpoint
   size_t bytes_sent;
   size_t bytes_recv;
-  boost::crc_32_type crc_sent;
-  boost::crc_32_type crc_recv;
+  running_crc crc_sent;
+  running_crc crc_recv;
   // XXX: We don't really need to store this...
   struct timespec connect_start;
   struct timespec connect_end;
   // Does this endpoint have a local fd?
+  // (For virtual listeners, the real listening socket)
   int localfd;
+  // Virtual listener's accept queue, or the memory of the ring
+  // (kept open to map it again after exec())
+  int auxfd;
   uint16_t ref_count;
   EndpointState state;
   // Non-blocking is descriptor-specific
   bool non_blocking;
   // Was this created with accept()?
   bool is_accept;
+  // Connected UDP socket, its local transport keeping
+  // datagrams whole.  Draining then counts datagrams.
+  bool dgram;
+  size_t msgs_sent;
+  size_t msgs_recv;
+  // AF_UNIX stream socket, paired by inode, and whether its
+  // data goes through a shared-memory ring (ring.cpp), and
+  // which half of it we write.
+  bool af_unix;
+  bool ring;
+  uint8_t ring_side;
   bool sent_info;
-
-  ipc_info() { reset(); }
+  // Connected to a local listener, can be paired right away
+  bool fast;
+  // Non-blocking connect() still in progress
+  bool connecting;
+  // How much our peer sent over TCP before switching to the
+  // local transport: received data comes from TCP until then.
+  // (Datagrams, for UDP.)
+  size_t recv_mark;
+  // Failed attempts at pairing, each putting off the next.
+  uint8_t pair_tries;
+  // I/O calls over TCP, those in a row in the same direction
+  // counting once, and the direction of the last.
+  uint32_t io_calls;
+  bool last_send;
+  // Bytes carried, calls made or time connected (ms) before
+  // pairing is first tried, and how long (ms) each try waits for
+  // our peer, as ipcd's policy says (0 for the defaults, see io.cpp).
+  size_t threshold;
+  uint32_t pair_calls;
+  unsigned pair_age;
+  unsigned pair_timeout;
+
+  // Unused (STATE_INVALID) entries are zeroed instead,
+  // and reset when put to use.
   void reset() {
     bytes_sent = 0;
     bytes_recv = 0;
@@ -94,22 +165,52 @@ struct ipc_info {
     crc_sent.reset();
     crc_recv.reset();
     localfd = 0;
+    auxfd = 0;
     ref_count = 0;
     state = STATE_INVALID;
     non_blocking = false;
     is_accept = false;
+    dgram = false;
+    msgs_sent = 0;
+    msgs_recv = 0;
+    af_unix = false;
+    ring = false;
+    ring_side = 0;
     sent_info = false;
+    fast = false;
+    connecting = false;
+    recv_mark = 0;
+    pair_tries = 0;
+    io_calls = 0;
+    last_send = false;
+    threshold = 0;
+    pair_calls = 0;
+    pair_age = 0;
+    pair_timeout = 0;
+  }
+
+  // Optimized, but still reading what was in flight over TCP?
+  bool draining() const {
+    return state == STATE_OPTIMIZED &&
+           (dgram ? msgs_recv : bytes_recv) < recv_mark;
   }
 };
 
+// Statically zeroed, so pages are only faulted in once used:
+// processes that never touch the network don't pay for it.
 struct libipc_state {
   fd_info FDMap[TABLE_SIZE];
   ipc_info EndpointInfo[TABLE_SIZE];
-  libipc_state();
 };
 
 extern libipc_state state;
 
+// Has the endpoint carried, made or lasted enough (io.cpp)?
+// Tells ipcd whether it was worth optimizing.
+bool pairing_was_due(const ipc_info &i);
+// Done reading datagrams sent over UDP before pairing (io.cpp)?
+bool dgram_drain_over(int fd, ipc_info &i);
+
 static inline char inbounds_fd(int fd) { return (unsigned)fd < TABLE_SIZE; }
 static inline char valid_ep(endpoint ep) { return (unsigned)ep < TABLE_SIZE; }
 
@@ -128,7 +229,7 @@ static inline bool &is_local(int fd) {
 
 static inline epoll_info &getEpollInfo(int fd) { return getFDInfo(fd).epoll; }
 
-static inline endpoint &getEP(int fd) { return getFDInfo(fd).EP; }
+static inline ep_slot &getEP(int fd) { return getFDInfo(fd).EP; }
 
 static inline ipc_info &getInfo(endpoint ep) {
   assert(valid_ep(ep));
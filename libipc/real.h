@@ -63,6 +63,10 @@ static inline int __real_fcntl_int(int fd, int cmd, int arg) {
 }
 EXTERN_C int __real_getsockopt(int socket, int level, int option_name,
                                void *option_value, socklen_t *option_len);
+EXTERN_C int __real_getsockname(int socket, struct sockaddr *address,
+                                socklen_t *address_len);
+EXTERN_C int __real_getpeername(int socket, struct sockaddr *address,
+                                socklen_t *address_len);
 EXTERN_C int __real_dup(int fd);
 EXTERN_C int __real_dup2(int fd1, int fd2);
 EXTERN_C int __real_poll(struct pollfd fds[], nfds_t nfds, int timeout);
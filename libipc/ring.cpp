@@ -0,0 +1,549 @@
+//===-- ring.cpp ----------------------------------------------------------===//
+//
+// Slipstream: Automatic Interprocess Communication Optimization
+//
+// Copyright (c) 2015, Will Dietz <w@wdtz.org>
+// This file is distributed under the ISC license, see LICENSE for details.
+//
+// http://wdtz.org/slipstream
+//
+//===----------------------------------------------------------------------===//
+//
+// Shared-memory rings, one each way, for pairs ipcd says to use them
+// (see ipcd/ring.go).  Data is copied through the ring, its writer
+// and reader each owning a position, so streaming it takes no
+// system calls and no lock between them.  The local transport is
+// kept for poll() and friends, and for telling when our peer's gone,
+// carrying wakeups only when asked for:
+//
+// - A reader about to wait for data says so in the ring's header,
+//   then looks again.  Whoever next sends rings the bell, a byte on
+//   the transport, once, so it polls readable.  Readers that find
+//   data already don't wait (our poll()s report them ready).
+// - While the ring is full, the writer fills the transport's
+//   (small) send buffer with stuffing, so it stops polling writable,
+//   and says so.  The reader takes that back out once there's room.
+//
+// Both sides mark, then look at what the other side marked, so of
+// any two racing one sees the other.
+//
+// A writer with something the ring can't carry (ancillary data)
+// moves on to the original socket: it marks the ring, and the
+// reader, once it has read what's left, does the same.
+//
+// Rings are mapped per process, so each endpoint keeps its ring's
+// memory open, mapping it again after exec() (ring_reattach).
+//
+//===----------------------------------------------------------------------===//
+
+#include "ring.h"
+
+#include "debug.h"
+#include "ipcreg_internal.h"
+#include "real.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Must match ipcd/ring.go.
+const size_t RING_HEADER_SIZE = 4096;
+// Send buffer of the local transport, so few bytes fill it.
+const int RING_SNDBUF = 4096;
+// What's sent on the transport.
+const char RING_BELL = 'b';
+const char RING_STUFFING = 's';
+
+// Between writers, or between readers, of the same ring: threads,
+// or processes sharing the socket.  Holds the holder's PID, with
+// the top bit set if anyone's waiting.  A holder dying leaves
+// nothing half-done, positions only moving once data's copied,
+// so a lock it held is just taken over.
+struct ring_lock {
+  volatile uint32_t word;
+};
+const uint32_t LOCK_WAITERS = 1u << 31;
+// How long to wait before checking the holder's still there.
+const long LOCK_CHECK_NS = 100 * 1000 * 1000;
+
+// Start of each direction's half: its header, then the data.
+// Positions only grow, wrapping around the data when used.
+struct ring_header {
+  // The writer's, then the reader's, each in their own line.
+  volatile uint64_t head;
+  volatile uint32_t bells;
+  char pad1[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+  volatile uint64_t tail;
+  volatile uint32_t heard;
+  char pad2[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+  // The reader is (about to be) waiting for the bell.
+  volatile uint32_t waiting;
+  // The writer filled the transport, the ring being full.
+  volatile uint32_t stuffed;
+  // The writer moved on to the original socket.
+  volatile uint32_t moved;
+  ring_lock wlock;
+  ring_lock rlock;
+};
+
+struct ring_map {
+  char *base;
+  size_t size;
+  // Data in each direction.
+  size_t cap;
+  // Which half we write, reading the other.
+  unsigned side;
+  int localfd;
+};
+
+static ring_map rings[TABLE_SIZE];
+// Endpoint of each local transport carrying a ring, for epoll,
+// which only knows the former.
+static ep_slot ring_eps[TABLE_SIZE];
+
+static pid_t self;
+
+void ring_forked() { self = 0; }
+
+static int futex(volatile uint32_t *addr, int op, uint32_t val,
+                 const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void lock(ring_lock &l) {
+  if (!self)
+    self = getpid();
+  uint32_t me = self, take = me;
+  uint32_t cur = 0;
+  while (!__atomic_compare_exchange_n(&l.word, &cur, take, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    uint32_t holder = cur & ~LOCK_WAITERS;
+    if (holder == 0) {
+      cur = 0;
+      continue;
+    }
+    if (holder != me && kill(holder, 0) == -1 && errno == ESRCH) {
+      if (__atomic_compare_exchange_n(&l.word, &cur, take, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        ipclog("Took over ring lock from pid %u, gone\n", holder);
+        return;
+      }
+      continue;
+    }
+    if (!(cur & LOCK_WAITERS) &&
+        !__atomic_compare_exchange_n(&l.word, &cur, cur | LOCK_WAITERS,
+                                     false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+      continue;
+    struct timespec check = {0, LOCK_CHECK_NS};
+    futex(&l.word, FUTEX_WAIT, cur | LOCK_WAITERS, &check);
+    // Others may be waiting too, so wake them when done.
+    take = me | LOCK_WAITERS;
+    cur = 0;
+  }
+}
+
+static void unlock(ring_lock &l) {
+  if (__atomic_exchange_n(&l.word, 0, __ATOMIC_RELEASE) & LOCK_WAITERS)
+    futex(&l.word, FUTEX_WAKE, 1, NULL);
+}
+
+static ring_header *header(ring_map &r, unsigned half) {
+  return (ring_header *)(r.base + half * (RING_HEADER_SIZE + r.cap));
+}
+
+static char *data(ring_map &r, unsigned half) {
+  return (char *)header(r, half) + RING_HEADER_SIZE;
+}
+
+// Map the ring in 'memfd', writing half 'side' of it.
+static bool map_ring(endpoint ep, int localfd, int memfd, uint8_t side) {
+  struct stat st;
+  bool ok = side <= 1 && fstat(memfd, &st) == 0 &&
+            (size_t)st.st_size > 2 * RING_HEADER_SIZE &&
+            st.st_size % 2 == 0;
+  void *base = ok ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, memfd, 0)
+                  : MAP_FAILED;
+  if (base == MAP_FAILED)
+    return false;
+
+  ring_map &r = rings[ep];
+  r.base = (char *)base;
+  r.size = st.st_size;
+  r.cap = r.size / 2 - RING_HEADER_SIZE;
+  r.side = side;
+  r.localfd = localfd;
+  ring_eps[localfd] = ep;
+  ipclog("Ring for ep=%d, side %u, %zu bytes each way\n", ep, r.side, r.cap);
+  return true;
+}
+
+bool ring_attach(endpoint ep, int localfd, int &memfd, uint8_t &side) {
+  char c = 0;
+  struct iovec iov = {&c, 1};
+  struct msghdr msg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  memfd = -1;
+  ssize_t ret =
+      __real_recvmsg(localfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = ret == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+  side = c - '0';
+  if (memfd == -1 || !map_ring(ep, localfd, memfd, side)) {
+    ipclog("No ring for ep=%d on localfd=%d\n", ep, localfd);
+    if (memfd != -1)
+      __real_close(memfd);
+    memfd = -1;
+    return false;
+  }
+
+  int sndbuf = RING_SNDBUF;
+  __real_setsockopt(localfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  return true;
+}
+
+bool ring_reattach(endpoint ep, int localfd, int memfd, uint8_t side) {
+  if (rings[ep].base)
+    return true;
+  if (!map_ring(ep, localfd, memfd, side)) {
+    ipclog("Unable to map ring for ep=%d again\n", ep);
+    return false;
+  }
+  return true;
+}
+
+void ring_detach(endpoint ep) {
+  ring_map &r = rings[ep];
+  if (!r.base)
+    return;
+  munmap(r.base, r.size);
+  ring_eps[r.localfd] = EP_INVALID;
+  memset(&r, 0, sizeof(r));
+}
+
+// Copy 'len' bytes between the ring's data, at position 'pos',
+// and 'vec', skipping the first 'skip' bytes of the latter.
+static void copy_ring(char *ring, size_t cap, uint64_t pos,
+                      const struct iovec *vec, int count, size_t skip,
+                      size_t len, bool to_ring) {
+  for (int v = 0; v < count && len > 0; ++v) {
+    if (skip >= vec[v].iov_len) {
+      skip -= vec[v].iov_len;
+      continue;
+    }
+    char *buf = (char *)vec[v].iov_base + skip;
+    size_t n = vec[v].iov_len - skip;
+    if (n > len)
+      n = len;
+    skip = 0;
+    len -= n;
+    while (n > 0) {
+      size_t off = pos % cap;
+      size_t chunk = n < cap - off ? n : cap - off;
+      if (to_ring)
+        memcpy(ring + off, buf, chunk);
+      else
+        memcpy(buf, ring + off, chunk);
+      buf += chunk;
+      pos += chunk;
+      n -= chunk;
+    }
+  }
+}
+
+static size_t iov_total(const struct iovec *vec, int count) {
+  size_t total = 0;
+  for (int v = 0; v < count; ++v)
+    total += vec[v].iov_len;
+  return total;
+}
+
+static uint64_t filled(ring_header *h) {
+  return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+}
+
+// Anything for the reader: data, or news that we moved on.  Only
+// data beyond 'seen', if given, which it was told of already.
+static bool readable(ring_header *h, const uint64_t *seen = NULL) {
+  if (__atomic_load_n(&h->moved, __ATOMIC_ACQUIRE))
+    return true;
+  return filled(h) > 0 && (!seen || h->head != *seen);
+}
+
+// Ring the bell if the reader's waiting for it, having just
+// published data (or moved on).  False if our peer's gone.
+static bool wake(ring_header *h, int localfd) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&h->waiting, __ATOMIC_RELAXED) ||
+      !__atomic_exchange_n(&h->waiting, 0, __ATOMIC_ACQ_REL))
+    return true;
+  if (__real_send(localfd, &RING_BELL, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == 1) {
+    __atomic_add_fetch(&h->bells, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+  // Full of stuffing, which it polls readable with anyway.
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Fill the transport's send buffer so it stops polling writable.
+// False if our peer's gone.  Single bytes, as our peer taking any
+// one back out must make it writable again.
+static bool stuff(int localfd) {
+  while (__real_send(localfd, &RING_STUFFING, 1,
+                     MSG_DONTWAIT | MSG_NOSIGNAL) == 1)
+    ;
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Take everything our peer sent on the transport, counting the
+// bells.  0 at EOF, -1 on error, 1 otherwise.  Our peer having
+// left bells unread is no reset, just EOF.
+static int hear(ring_header *h, int localfd) {
+  char buf[64];
+  for (;;) {
+    ssize_t ret = __real_recv(localfd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno == ECONNRESET))
+      return 0;
+    if (ret < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    uint32_t bells = 0;
+    for (ssize_t i = 0; i < ret; ++i)
+      bells += buf[i] == RING_BELL;
+    __atomic_add_fetch(&h->heard, bells, __ATOMIC_RELAXED);
+  }
+}
+
+// About to wait for the transport to poll readable: ask for the
+// bell, unless there's something to read after all (true).
+static bool will_wait(ring_header *h, int localfd, uint64_t *seen = NULL) {
+  // Bells we've not taken would wake us straight away.
+  if (__atomic_load_n(&h->bells, __ATOMIC_RELAXED) !=
+      __atomic_load_n(&h->heard, __ATOMIC_RELAXED))
+    hear(h, localfd);
+  if (!readable(h, seen)) {
+    __atomic_store_n(&h->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!readable(h, seen))
+      return false;
+  }
+  if (seen)
+    *seen = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  return true;
+}
+
+// Wait for the transport to poll with 'events', false if interrupted.
+static bool wait_for(int localfd, short events) {
+  struct pollfd pfd = {localfd, events, 0};
+  return __real_poll(&pfd, 1, -1) != -1;
+}
+
+ssize_t ring_send(endpoint ep, int localfd, const struct iovec *vec, int count,
+                  bool nonblock, bool &lost) {
+  lost = false;
+  ring_map &r = rings[ep];
+  if (!r.base) {
+    lost = true;
+    errno = EPIPE;
+    return -1;
+  }
+  ring_header *h = header(r, r.side);
+  char *ring = data(r, r.side);
+  size_t len = iov_total(vec, count);
+  size_t done = 0;
+  int err = 0;
+  if (len == 0)
+    return 0;
+
+  lock(h->wlock);
+  while (done < len) {
+    if (h->moved) {
+      lost = true;
+      break;
+    }
+    uint64_t head = h->head;
+    uint64_t tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    size_t n = r.cap - (head - tail);
+    if (n > len - done)
+      n = len - done;
+    if (n > 0) {
+      copy_ring(ring, r.cap, head, vec, count, done, n, true);
+      __atomic_store_n(&h->head, head + n, __ATOMIC_RELEASE);
+      done += n;
+      if (!wake(h, localfd)) {
+        lost = true;
+        break;
+      }
+      continue;
+    }
+    if (done > 0 && nonblock)
+      break;
+
+    // Full: stop polling writable until our peer makes room,
+    // unless it did meanwhile, maybe not seeing we stuffed (then
+    // it takes that out next time it reads what we write now).
+    if (!stuff(localfd)) {
+      lost = true;
+      break;
+    }
+    __atomic_store_n(&h->stuffed, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (filled(h) < r.cap)
+      continue;
+    if (nonblock) {
+      err = EAGAIN;
+      break;
+    }
+    unlock(h->wlock);
+    bool woke = wait_for(localfd, POLLOUT);
+    lock(h->wlock);
+    if (!woke) {
+      err = errno;
+      break;
+    }
+  }
+  unlock(h->wlock);
+
+  if (done > 0) {
+    // Anything else is for next time.
+    lost = false;
+    return done;
+  }
+  errno = lost ? EPIPE : err;
+  return -1;
+}
+
+ssize_t ring_recv(endpoint ep, int localfd, const struct iovec *vec, int count,
+                  int flags, bool nonblock, bool &lost) {
+  lost = false;
+  ring_map &r = rings[ep];
+  if (!r.base) {
+    lost = true;
+    errno = EPIPE;
+    return -1;
+  }
+  ring_header *h = header(r, 1 - r.side);
+  char *ring = data(r, 1 - r.side);
+  size_t len = iov_total(vec, count);
+  bool peek = flags & MSG_PEEK;
+  bool waitall = (flags & MSG_WAITALL) && !peek;
+  size_t done = 0;
+  bool eof = false, waited = false;
+  int err = 0;
+  if (len == 0)
+    return 0;
+
+  lock(h->rlock);
+  while (done < len) {
+    uint64_t tail = h->tail;
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    size_t n = head - tail;
+    if (n > len - done)
+      n = len - done;
+    if (n > 0) {
+      copy_ring(ring, r.cap, tail, vec, count, done, n, false);
+      done += n;
+      if (peek)
+        break;
+      __atomic_store_n(&h->tail, tail + n, __ATOMIC_RELEASE);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&h->stuffed, __ATOMIC_RELAXED) &&
+          __atomic_exchange_n(&h->stuffed, 0, __ATOMIC_ACQ_REL))
+        hear(h, localfd);
+      if (!waitall)
+        break;
+      continue;
+    }
+
+    // Empty.  Unless waiting, or having woken with it still
+    // empty, see whether our peer's closed its end.
+    if (__atomic_load_n(&h->moved, __ATOMIC_ACQUIRE)) {
+      lost = true;
+      break;
+    }
+    if (nonblock || waited) {
+      int ret = hear(h, localfd);
+      if (ret == 0) {
+        eof = true;
+        break;
+      }
+      if (ret < 0 || nonblock) {
+        err = ret < 0 ? errno : EAGAIN;
+        // It may have sent more before we took its bell.
+        if (ret > 0 && readable(h))
+          continue;
+        break;
+      }
+    }
+    unlock(h->rlock);
+    bool woke = will_wait(h, localfd) || wait_for(localfd, POLLIN);
+    lock(h->rlock);
+    if (!woke) {
+      err = errno;
+      break;
+    }
+    waited = true;
+  }
+  unlock(h->rlock);
+
+  if (done > 0 || eof) {
+    lost = false;
+    return done;
+  }
+  errno = lost ? EPIPE : err;
+  return -1;
+}
+
+void ring_move(endpoint ep, int localfd) {
+  ring_map &r = rings[ep];
+  if (!r.base)
+    return;
+  ring_header *h = header(r, r.side);
+  lock(h->wlock);
+  if (!h->moved) {
+    __atomic_store_n(&h->moved, 1, __ATOMIC_RELEASE);
+    // Wake our peer to find out, if it's waiting.
+    wake(h, localfd);
+  }
+  unlock(h->wlock);
+}
+
+bool ring_empty(endpoint ep) {
+  ring_map &r = rings[ep];
+  if (!r.base)
+    return true;
+  return filled(header(r, 1 - r.side)) == 0;
+}
+
+bool ring_will_wait(int localfd, uint64_t *seen) {
+  if (!inbounds_fd(localfd))
+    return false;
+  endpoint ep = ring_eps[localfd];
+  if (!valid_ep(ep) || !rings[ep].base)
+    return false;
+  ring_map &r = rings[ep];
+  return will_wait(header(r, 1 - r.side), localfd, seen);
+}
@@ -0,0 +1,61 @@
+//===-- ring.h --------------------------------------------------*- C++ -*-===//
+//
+// Slipstream: Automatic Interprocess Communication Optimization
+//
+// Copyright (c) 2015, Will Dietz <w@wdtz.org>
+// This file is distributed under the ISC license, see LICENSE for details.
+//
+// http://wdtz.org/slipstream
+//
+//===----------------------------------------------------------------------===//
+//
+// Shared-memory rings carrying an endpoint's data, its local
+// transport only waking the other end (see ring.cpp).
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "ipcd.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Map the ring ipcd sent over 'localfd', false if there isn't one.
+// Its memory is left open as 'memfd', and which half
+// we write is 'side', for mapping it again after exec().
+bool ring_attach(endpoint ep, int localfd, int &memfd, uint8_t &side);
+bool ring_reattach(endpoint ep, int localfd, int memfd, uint8_t side);
+void ring_detach(endpoint ep);
+
+// Like writev()/readv() on the local transport, 'nonblock' saying
+// whether to wait.  Set 'lost' (returning -1, EPIPE) once the ring
+// can't be used: our peer's gone (sending), or has moved on and
+// we've read all it sent over the ring (receiving), or it isn't
+// mapped.  Receiving
+// returns 0 at EOF, once our peer closed its end.
+// Understands MSG_PEEK and MSG_WAITALL.
+ssize_t ring_send(endpoint ep, int localfd, const struct iovec *vec, int count,
+                  bool nonblock, bool &lost);
+ssize_t ring_recv(endpoint ep, int localfd, const struct iovec *vec, int count,
+                  int flags, bool nonblock, bool &lost);
+
+// Stop sending over the ring, telling our peer to read whatever
+// follows from the original socket once it's read the rest.
+void ring_move(endpoint ep, int localfd);
+// Has our peer nothing more for us in the ring?
+bool ring_empty(endpoint ep);
+
+// About to wait for 'localfd' to poll readable: if it carries a
+// ring, true if that has something to read already, so don't;
+// otherwise our peer's asked to wake us when it sends.  With
+// 'seen', only what's beyond it counts, which is then updated
+// (for edge-triggered waits).
+bool ring_will_wait(int localfd, uint64_t *seen);
+
+// In a new child, whose PID locks are to be taken with.
+void ring_forked();
+
+#endif // _RING_H_
@@ -115,8 +115,21 @@ int fcntl(int fd, int cmd, ...) {
   return __internal_fcntl(fd, cmd, arg);
 }
 
+int getpeername(int socket, struct sockaddr *RESTRICT address,
+                socklen_t *RESTRICT address_len) {
+  return __internal_getpeername(socket, address, address_len);
+}
+
+int getsockname(int socket, struct sockaddr *RESTRICT address,
+                socklen_t *RESTRICT address_len) {
+  return __internal_getsockname(socket, address, address_len);
+}
+
 int getsockopt(int socket, int level, int option_name,
-               void *RESTRICT option_value, socklen_t *RESTRICT option_len);
+               void *RESTRICT option_value, socklen_t *RESTRICT option_len) {
+  return __internal_getsockopt(socket, level, option_name, option_value,
+                               option_len);
+}
 
 int listen(int fd, int backlog) { return __internal_listen(fd, backlog); }
 
@@ -142,7 +155,10 @@ int select(int nfds, fd_set *RESTRICT readfds, fd_set *RESTRICT writefds,
 }
 
 int setsockopt(int socket, int level, int option_name, const void *option_value,
-               socklen_t option_len);
+               socklen_t option_len) {
+  return __internal_setsockopt(socket, level, option_name, option_value,
+                               option_len);
+}
 
 int shutdown(int sockfd, int how) { return __internal_shutdown(sockfd, how); }
 
@@ -291,6 +307,14 @@ int __real_getsockopt(int socket, int level, int option_name,
                       socklen_t *RESTRICT option_len) {
   CALL_REAL(getsockopt, socket, level, option_name, option_value, option_len);
 }
+int __real_getpeername(int socket, struct sockaddr *RESTRICT address,
+                       socklen_t *RESTRICT address_len) {
+  CALL_REAL(getpeername, socket, address, address_len);
+}
+int __real_getsockname(int socket, struct sockaddr *RESTRICT address,
+                       socklen_t *RESTRICT address_len) {
+  CALL_REAL(getsockname, socket, address, address_len);
+}
 int __real_listen(int fd, int backlog) { CALL_REAL(listen, fd, backlog); }
 
 int __real_poll(struct pollfd fds[], nfds_t nfds, int timeout) {
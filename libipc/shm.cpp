@@ -102,10 +102,10 @@ bool is_valid_fd(int fd) {
   return __real_fcntl(fd, F_GETFD, /* kludge */ 0) >= 0;
 }
 
-void shm_state_restore() {
+bool shm_state_restore() {
   // If we have memory to restore, it'll be in our magic FD!
   if (!is_valid_fd(MAGIC_SHM_FD))
-    return;
+    return false;
 
   ipclog("Inherited ipc state FD, starting state restoration...\n");
 
@@ -126,6 +126,7 @@ void shm_state_restore() {
   UC(ret, "close shm");
 
   ipclog("State restored!\n");
+  return true;
 }
 
 void shm_state_destroy() {
@@ -17,7 +17,8 @@
 #define _SHM_H_
 
 void shm_state_destroy();
-void shm_state_restore();
+// Returns true if state was inherited and restored.
+bool shm_state_restore();
 void shm_state_save();
 
 #endif // _SHM_H_
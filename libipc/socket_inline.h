@@ -36,11 +36,6 @@
 int __attribute((used)) __only_include_once = 0;
 
 static inline int __internal_socket(int domain, int type, int protocol) {
-  // For now, don't support ipv6.
-  if (domain == AF_INET6) {
-    errno = EAFNOSUPPORT;
-    return -1;
-  }
   int fd = __real_socket(domain, type, protocol);
 
   bool ip_domain = (domain == AF_INET) || (domain == AF_INET6);
@@ -59,8 +54,7 @@ static inline int __internal_socket(int domain, int type, int protocol) {
   bool tcp_proto = (protocol == 0) || (protocol == IPPROTO_TCP);
   bool tcp = ip_domain && stream_sock && tcp_proto;
   bool valid_fd = (fd != -1);
-  if (tcp && valid_fd) {
-    register_inet_socket(fd, false);
+  if (tcp && valid_fd && register_inet_socket(fd, false)) {
     set_nonblocking(fd, (type & SOCK_NONBLOCK) != 0);
     set_cloexec(fd, (type & SOCK_CLOEXEC) != 0);
   }
@@ -155,17 +149,23 @@ static inline int __internal_accept4(int fd, struct sockaddr *addr,
     // Okay so this could be non-blocking...
     // assert(!get_nonblocking(fd));
   }
-  int ret = __real_accept4(fd, addr, addrlen, flags);
-  if (is_registered) {
+  int ret;
+  bool is_virtual = false;
+  if (is_registered && is_virtual_listener(fd))
+    ret = virtual_accept4(fd, addr, addrlen, flags, is_virtual);
+  else
+    ret = __real_accept4(fd, addr, addrlen, flags);
+  if (is_registered && !is_virtual) {
     end = get_time();
     ipclog("accept/accept4(fd=%d, flags=%d) -> %d\n", fd, flags, ret);
-    if (ret != -1) {
-      register_inet_socket(ret, true);
+    if (ret != -1 && register_inet_socket(ret, true)) {
       set_nonblocking(ret, (flags & SOCK_NONBLOCK) != 0);
       set_cloexec(ret, (flags & SOCK_CLOEXEC) != 0);
       set_time(ret, start, end);
-      submit_info_if_needed(ret);
+      attempt_fast_optimization(ret, false);
     }
+  } else if (ret != -1 && is_unix_listener(fd)) {
+    register_unix_socket(ret, true);
   }
   return ret;
 }
@@ -180,34 +180,56 @@ static inline int __internal_connect(int fd, const struct sockaddr *addr,
                                      socklen_t addrlen) {
   bool is_reg = is_registered_socket(fd);
   struct timespec start, end;
+  if (is_reg && is_dgram_socket(fd)) {
+    // UDP connecting to someone else (or no one): start over.
+    release_dgram_socket(fd);
+    is_reg = false;
+  }
   if (is_reg) {
     assert(!is_accept(fd));
+    if (is_connecting_socket(fd)) {
+      // Asking again how a non-blocking connect() is going.
+      int ret = __real_connect(fd, addr, addrlen);
+      int saved_errno = errno;
+      check_connect(fd);
+      errno = saved_errno;
+      return ret;
+    }
+    if (virtual_connect(fd, addr, addrlen))
+      return 0;
     start = get_time();
   }
   int ret = __real_connect(fd, addr, addrlen);
   if (is_reg) {
+    int saved_errno = errno;
     if (ret != -1) {
       // If this was successful, we're done here.
       end = get_time();
       set_time(fd, start, end);
-      submit_info_if_needed(ret);
-    } else {
-      // If non-blocking and connect-in-progress...
-      if (errno == EINPROGRESS && get_nonblocking(fd)) {
-        // XXX: THIS IS WRONG
-        // Assume connect() succeeds (!)
-        // and submit end time as now, since we don't look at it.
-        ipclog("async connect(), using start time and fake end time...\n");
-        end = get_time();
-        set_time(fd, start, end);
-      }
+      submit_info_if_needed(fd);
+      attempt_fast_optimization(fd, !get_nonblocking(fd));
+    } else if (saved_errno == EINPROGRESS) {
+      // Non-blocking: finish up once we see it complete,
+      // by poll/select/epoll, getsockopt(SO_ERROR) or I/O.
+      ipclog("async connect(), fd=%d in progress\n", fd);
+      set_connecting(fd, start);
     }
+    errno = saved_errno;
+  } else if (ret == 0 && addr &&
+             (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+    register_dgram_socket(fd, addr);
+  } else if (ret == 0 && addr && addr->sa_family == AF_UNIX) {
+    register_unix_socket(fd, false);
   }
   return ret;
 }
 
 static inline int __internal_listen(int fd, int backlog) {
   int ret = __real_listen(fd, backlog);
+  if (ret == 0) {
+    register_listener(fd);
+    register_unix_listener(fd);
+  }
   return ret;
 }
 
@@ -291,7 +313,7 @@ static inline int __internal_dup(int fd) {
   // ipclog("dup(fd=%d (%d)) = %d (%d)\n", fd, is_registered_socket(fd),
   //        ret, is_registered_socket(ret));
 
-  if (is_registered_socket(fd)) {
+  if (is_registered_socket(fd) || is_virtual_socket(fd)) {
     dup_inet_socket(fd, ret);
   }
   
@@ -318,7 +340,8 @@ static inline int __internal_poll(struct pollfd fds[], nfds_t nfds,
                                   int timeout) {
   bool use_internal = false;
   for (nfds_t i = 0; i < nfds; ++i) {
-    if (is_optimized_socket_safe(fds[i].fd)) {
+    int fd = fds[i].fd;
+    if (is_drained_socket_safe(fd) || is_connecting_socket(fd)) {
       use_internal = true;
       break;
     }
@@ -341,19 +364,41 @@ static inline int __internal_select(int nfds, fd_set *readfds, fd_set *writefds,
   return do_ipc_select(nfds, readfds, writefds, errorfds, timeout);
 }
 
+static inline int __internal_getsockname(int socket, struct sockaddr *address,
+                                         socklen_t *address_len) {
+  if (is_virtual_socket(socket))
+    return virtual_getname(socket, address, address_len, true);
+  return __real_getsockname(real_socket_fd(socket), address, address_len);
+}
+
+static inline int __internal_getpeername(int socket, struct sockaddr *address,
+                                         socklen_t *address_len) {
+  if (is_virtual_socket(socket))
+    return virtual_getname(socket, address, address_len, false);
+  return __real_getpeername(real_socket_fd(socket), address, address_len);
+}
+
 static inline int __internal_getsockopt(int socket, int level, int option_name,
                                         void *option_value,
                                         socklen_t *option_len) {
-  // TODO: Do something here besides forwarding to actual impl?
-  return __real_getsockopt(socket, level, option_name, option_value,
-                           option_len);
+  if (is_virtual_socket(socket))
+    return virtual_getsockopt(socket, level, option_name, option_value,
+                              option_len);
+  int ret = __real_getsockopt(real_socket_fd(socket), level, option_name,
+                              option_value, option_len);
+  if (ret == 0 && level == SOL_SOCKET && option_name == SO_ERROR)
+    check_connect(socket);
+  return ret;
 }
 
 static inline int __internal_setsockopt(int socket, int level, int option_name,
                                         const void *option_value,
                                         socklen_t option_len) {
   int ret;
-  if (!is_registered_socket(socket))
+  if (is_virtual_socket(socket))
+    ret = virtual_setsockopt(socket, level, option_name, option_value,
+                             option_len);
+  else if (!is_registered_socket(socket))
     ret =
         __real_setsockopt(socket, level, option_name, option_value, option_len);
   else
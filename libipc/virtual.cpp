@@ -0,0 +1,338 @@
+//===-- virtual.cpp -------------------------------------------------------===//
+//
+// Slipstream: Automatic Interprocess Communication Optimization
+//
+// Copyright (c) 2015, Will Dietz <w@wdtz.org>
+// This file is distributed under the ISC license, see LICENSE for details.
+//
+// http://wdtz.org/slipstream
+//
+//===----------------------------------------------------------------------===//
+//
+// Virtual loopback connections: connect() to a listener in a process
+// using libipc is handed a local transport by ipcd directly,
+// never creating a TCP connection.  Enabled with IPCD_VIRTUAL.
+//
+// A virtual listener's descriptor is replaced by an epoll descriptor
+// watching both the real listening socket and the accept queue
+// virtual connections arrive on, so it still polls as readable
+// when there's a connection to accept.
+//
+//===----------------------------------------------------------------------===//
+
+#include "debug.h"
+#include "ipcd.h"
+#include "ipcopt.h"
+#include "ipcreg_internal.h"
+#include "real.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool virtual_enabled() {
+  static bool enabled = getenv("IPCD_VIRTUAL") != NULL;
+  return enabled;
+}
+
+static void to_netaddr(const sockaddr_in &sin, netaddr &na) {
+  na.port = ntohs(sin.sin_port);
+  const char *retstr =
+      inet_ntop(AF_INET, &sin.sin_addr, na.addr, sizeof(na.addr));
+  assert(retstr != NULL);
+}
+
+static bool from_netaddr(const char *addr, int port, sockaddr_in &sin) {
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  return inet_pton(AF_INET, addr, &sin.sin_addr) == 1;
+}
+
+static void copy_addr(const sockaddr_in &sin, struct sockaddr *address,
+                      socklen_t *address_len) {
+  socklen_t len = *address_len;
+  if (len > sizeof(sin))
+    len = sizeof(sin);
+  memcpy(address, &sin, len);
+  *address_len = sizeof(sin);
+}
+
+static void set_virtual(int fd, const sockaddr_in &local,
+                        const sockaddr_in &peer) {
+  fd_info &f = getFDInfo(fd);
+  f.is_virtual = true;
+  f.virt_local = local;
+  f.virt_peer = peer;
+}
+
+char is_virtual_socket(int fd) {
+  return inbounds_fd(fd) && getFDInfo(fd).is_virtual;
+}
+
+bool is_virtual_listener(int fd) {
+  return is_registered_socket(fd) &&
+         getInfo(getEP(fd)).state == STATE_VLISTEN;
+}
+
+int real_socket_fd(int fd) {
+  return is_virtual_listener(fd) ? getInfo(getEP(fd)).localfd : fd;
+}
+
+bool virtual_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  if (!virtual_enabled() || !is_registered_socket(fd))
+    return false;
+  if (addrlen < sizeof(sockaddr_in) || addr->sa_family != AF_INET)
+    return false;
+
+  sockaddr_in dst;
+  memcpy(&dst, addr, sizeof(dst));
+  if ((ntohl(dst.sin_addr.s_addr) >> IN_CLASSA_NSHIFT) != IN_LOOPBACKNET)
+    return false;
+
+  endpoint ep = getEP(fd);
+  ipc_info &i = getInfo(ep);
+  if (i.ref_count != 1 || i.state != STATE_UNOPT)
+    return false;
+
+  // Bind if needed, so our address is one nobody else has
+  sockaddr_in src;
+  socklen_t len = sizeof(src);
+  if (__real_getsockname(fd, (struct sockaddr *)&src, &len) != 0 ||
+      src.sin_family != AF_INET)
+    return false;
+  if (src.sin_addr.s_addr == htonl(INADDR_ANY))
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (src.sin_port == 0) {
+    if (__real_bind(fd, (struct sockaddr *)&src, sizeof(src)) != 0)
+      return false;
+    len = sizeof(src);
+    if (__real_getsockname(fd, (struct sockaddr *)&src, &len) != 0)
+      return false;
+  }
+
+  netaddr na_src, na_dst;
+  to_netaddr(src, na_src);
+  to_netaddr(dst, na_dst);
+  int vfd = ipcd_vconnect(ep, na_src, na_dst);
+  if (vfd == -1)
+    return false;
+
+  bool non_blocking = i.non_blocking;
+  bool cloexec = getFDInfo(fd).close_on_exec;
+
+  // Replace our TCP socket with our end of the connection
+  if (__real_dup2(vfd, fd) == -1) {
+    perror("virtual_connect dup2");
+    __real_close(vfd);
+    return false;
+  }
+  __real_close(vfd);
+  unregister_inet_socket(fd);
+
+  __real_fcntl_int(fd, F_SETFL, non_blocking ? O_NONBLOCK : 0);
+  if (cloexec)
+    __real_fcntl_int(fd, F_SETFD, FD_CLOEXEC);
+  set_cloexec(fd, cloexec);
+  set_virtual(fd, src, dst);
+
+  ipclog("Virtual connect: fd=%d, %s:%d -> %s:%d\n", fd, na_src.addr,
+         na_src.port, na_dst.addr, na_dst.port);
+  return true;
+}
+
+bool virtual_listen(int fd, netaddr &na) {
+  if (!virtual_enabled())
+    return false;
+
+  endpoint ep = getEP(fd);
+  ipc_info &i = getInfo(ep);
+  if (i.ref_count != 1 || i.state != STATE_UNOPT)
+    return false;
+
+  int queue = ipcd_vlisten(ep, na);
+  if (queue == -1)
+    return false;
+
+  bool cloexec = getFDInfo(fd).close_on_exec;
+  int hidden = __real_fcntl_int(fd, cloexec ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+  int epfd = __real_epoll_create1(cloexec ? EPOLL_CLOEXEC : 0);
+  bool ok = inbounds_fd(queue) && inbounds_fd(hidden) && epfd != -1;
+  if (ok) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = hidden;
+    ok = __real_epoll_ctl(epfd, EPOLL_CTL_ADD, hidden, &ev) == 0;
+    ev.data.fd = queue;
+    ok = ok && __real_epoll_ctl(epfd, EPOLL_CTL_ADD, queue, &ev) == 0;
+  }
+  // Real listener must never block, we wait on both ourselves.
+  ok = ok && __real_fcntl_int(hidden, F_SETFL, O_NONBLOCK) == 0;
+  ok = ok && (cloexec || __real_fcntl_int(queue, F_SETFD, 0) == 0);
+  ok = ok && __real_dup2(epfd, fd) != -1;
+  if (!ok) {
+    ipclog("Unable to set up virtual listener for fd=%d\n", fd);
+    __real_close(queue);
+    if (hidden != -1)
+      __real_close(hidden);
+    if (epfd != -1)
+      __real_close(epfd);
+    return false;
+  }
+  __real_close(epfd);
+  if (cloexec)
+    __real_fcntl_int(fd, F_SETFD, FD_CLOEXEC);
+
+  i.localfd = track_localfd(hidden);
+  i.auxfd = track_localfd(queue);
+  i.state = STATE_VLISTEN;
+  ipclog("Virtual listener: fd=%d, ep=%d, listener=%d, queue=%d\n", fd, ep,
+         hidden, queue);
+  return true;
+}
+
+// Take connection from virtual listener's accept queue, if any.
+static int accept_queued(int fd, ipc_info &i, struct sockaddr *addr,
+                         socklen_t *addrlen, int flags) {
+  char buf[2 * INET6_ADDRSTRLEN + 32];
+  struct iovec iov[1];
+  struct msghdr msg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = sizeof(buf) - 1;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  int rflags = MSG_DONTWAIT;
+  if (flags & SOCK_CLOEXEC)
+    rflags |= MSG_CMSG_CLOEXEC;
+  ssize_t ret = __real_recvmsg(i.auxfd, &msg, rflags);
+  if (ret == 0) {
+    // ipcd went away, no more virtual connections.
+    ipclog("Accept queue for fd=%d closed\n", fd);
+    __real_epoll_ctl(fd, EPOLL_CTL_DEL, i.auxfd, NULL);
+    __real_close(i.auxfd);
+    is_local(i.auxfd) = false;
+    i.auxfd = 0;
+    errno = EAGAIN;
+    return -1;
+  }
+  if (ret < 0)
+    return -1;
+  buf[ret] = 0;
+
+  int newfd = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&newfd, CMSG_DATA(cmsg), sizeof(int));
+
+  char src_addr[INET6_ADDRSTRLEN], dst_addr[INET6_ADDRSTRLEN];
+  int src_port, dst_port;
+  sockaddr_in src, dst;
+  int n = sscanf(buf, "%45s %d %45s %d", src_addr, &src_port, dst_addr,
+                 &dst_port);
+  if (newfd == -1 || n != 4 || !from_netaddr(src_addr, src_port, src) ||
+      !from_netaddr(dst_addr, dst_port, dst) || !inbounds_fd(newfd)) {
+    ipclog("Bad virtual connection '%s' (fd=%d) for fd=%d\n", buf, newfd, fd);
+    if (newfd != -1)
+      __real_close(newfd);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (flags & SOCK_NONBLOCK)
+    __real_fcntl_int(newfd, F_SETFL, O_NONBLOCK);
+  set_cloexec(newfd, (flags & SOCK_CLOEXEC) != 0);
+  set_virtual(newfd, dst, src);
+  if (addr && addrlen)
+    copy_addr(src, addr, addrlen);
+
+  ipclog("Virtual accept: fd=%d -> %d, from %s:%d\n", fd, newfd, src_addr,
+         src_port);
+  return newfd;
+}
+
+int virtual_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                    int flags, bool &is_virtual) {
+  ipc_info &i = getInfo(getEP(fd));
+  assert(i.state == STATE_VLISTEN);
+
+  is_virtual = false;
+  while (true) {
+    if (i.auxfd) {
+      int ret = accept_queued(fd, i, addr, addrlen, flags);
+      if (ret != -1) {
+        is_virtual = true;
+        return ret;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    }
+
+    int ret = __real_accept4(i.localfd, addr, addrlen, flags);
+    if (ret != -1 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return ret;
+    // Check the descriptor itself, as ioctl(FIONBIO) isn't tracked.
+    int fl = __real_fcntl_int(fd, F_GETFL, 0);
+    if (fl == -1 || (fl & O_NONBLOCK))
+      return -1;
+
+    struct pollfd fds[2];
+    fds[0].fd = i.localfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = i.auxfd;
+    fds[1].events = POLLIN;
+    if (__real_poll(fds, i.auxfd ? 2 : 1, -1) == -1)
+      return -1;
+  }
+}
+
+int virtual_getname(int fd, struct sockaddr *address, socklen_t *address_len,
+                    bool local) {
+  fd_info &f = getFDInfo(fd);
+  copy_addr(local ? f.virt_local : f.virt_peer, address, address_len);
+  return 0;
+}
+
+int virtual_getsockopt(int fd, int level, int option_name, void *option_value,
+                       socklen_t *option_len) {
+  int value;
+  if (level == SOL_SOCKET && option_name == SO_DOMAIN)
+    value = AF_INET;
+  else if (level == SOL_SOCKET && option_name == SO_PROTOCOL)
+    value = IPPROTO_TCP;
+  else if (level == IPPROTO_TCP) {
+    // No TCP underneath, report all options as unset.
+    memset(option_value, 0, *option_len);
+    return 0;
+  } else
+    return __real_getsockopt(fd, level, option_name, option_value, option_len);
+
+  socklen_t len = *option_len;
+  if (len > sizeof(value))
+    len = sizeof(value);
+  memcpy(option_value, &value, len);
+  *option_len = len;
+  return 0;
+}
+
+int virtual_setsockopt(int fd, int level, int option_name,
+                       const void *option_value, socklen_t option_len) {
+  // IP and TCP options mean nothing here, pretend they took effect.
+  if (level == IPPROTO_IP || level == IPPROTO_TCP)
+    return 0;
+  return __real_setsockopt(fd, level, option_name, option_value, option_len);
+}